@@ -0,0 +1,538 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+----------------------------------------    SIM/HAL.CPP     ---------------------------------------------
+_________________________________________________________________________________________________________
+Couche d'abstraction materielle - Version simulation sur PC (voir Sim.h)
+
+Meme contrat que xylo/Hal.cpp (Leonardo) : le timer de coupure ne fait que les coupures, les
+ecritures des cartes partent depuis update(). Arduino.h et MIDIUSB.h factices sont servis ici.
+***********************************************************************************************************/
+
+#include "Hal.h"
+#include "Health.h"
+#include "Sim.h"
+#include <MIDIUSB.h>
+#include <stdio.h>
+
+#define SIM_PINS 64
+#define SIM_TIMER_MIN_US 16           // comme Timer1 sur la carte
+#define SIM_SPI_MAX_FREQ 8000000UL    // SPI du Leonardo : F_CPU / 2
+
+// registres du mcp23017 / mcp23s17 (IOCON.BANK = 0)
+#define SIM_MCP_IODIR 0x00
+#define SIM_MCP_IOCON 0x0A
+#define SIM_MCP_GPIO 0x12
+#define SIM_MCP_HAEN 0x08
+
+// registres du pca9685 : LEDn_ON_L, ON_H, OFF_L, OFF_H a 0x06 + 4 * n, ALL_LED_* a 0xFA
+#define SIM_PCA_LED0 0x06
+#define SIM_PCA_ALL_LED 0xFA
+#define SIM_PCA_FULL 0x10
+
+struct SimMidiPacket {
+  unsigned long time;
+  midiEventPacket_t packet;
+};
+
+SimSerial Serial;
+SimMidiUSB MidiUSB;
+
+static unsigned long simNow = 0;
+static unsigned long simStep = 1;
+static unsigned long simBusFree = 0;
+static byte simLockDepth = 0;
+static bool simInTimer = false;
+static bool simTimerArmed = false;
+static unsigned long simTimerDeadline = 0;
+static void (*simTimerCallback)() = nullptr;
+
+static std::vector<SimI2cFrame> simI2c;
+static byte simMcpAddress[COIL_EXPANDERS];
+static byte simI2cRegisters[128][256];
+static int simI2cNacks[128];
+static bool simI2cFailed = false;
+static byte simI2cLost = 0;
+
+static std::vector<SimSpiFrame> simSpi;
+static byte simSpiMcp[8][0x16];
+static std::vector<byte> simShiftRegister;    // octets poussés depuis le dernier verrou, le plus recent a la fin
+static byte simShiftLatch[16];
+
+static byte simPins[SIM_PINS];
+static std::vector<SimPinWrite> simPinLog;
+static std::vector<SimPinWrite> simPwmLog;
+static int simPwmValue = 0;
+static int (*simPickup)(unsigned long time) = nullptr;
+static byte simEeprom[HAL_STORE_SIZE];
+static unsigned long simEepromReady = 0;      // fin de la programmation de l'octet precedent
+
+static std::vector<SimMidiPacket> simMidiIn;
+static std::vector<byte> simMidiOut;
+static std::string simSerialText;
+
+//*********************************************************************************************
+//******************             VIRTUAL CLOCK
+
+// avance jusqu'a target en appelant le timer a son echeance s'il n'est pas masqué
+static void simRun(unsigned long target) {
+  for (;;) {
+    if (simTimerArmed && !simInTimer && simLockDepth == 0 && (long)(simTimerDeadline - target) <= 0) {
+      if ((long)(simTimerDeadline - simNow) > 0) {
+        simNow = simTimerDeadline;
+      }
+      simTimerArmed = false;      // one shot : le callback reprogramme si besoin
+      simInTimer = true;
+      simTimerCallback();
+      simInTimer = false;
+      continue;
+    }
+    if ((long)(target - simNow) > 0) {
+      simNow = target;
+    }
+    return;
+  }
+}
+
+void simReset() {
+  simNow = 0;
+  simStep = 1;
+  simBusFree = 0;
+  simLockDepth = 0;
+  simInTimer = false;
+  simTimerArmed = false;
+  simTimerCallback = nullptr;
+  simI2c.clear();
+  memset(simI2cRegisters, 0, sizeof(simI2cRegisters));
+  memset(simI2cNacks, 0, sizeof(simI2cNacks));
+  simI2cFailed = false;
+  simI2cLost = 0;
+  simSpi.clear();
+  memset(simSpiMcp, 0, sizeof(simSpiMcp));
+  for (byte i = 0; i < 8; i++) {
+    simSpiMcp[i][SIM_MCP_IODIR] = 0xFF;   // broches en entrée a la mise sous tension
+    simSpiMcp[i][SIM_MCP_IODIR + 1] = 0xFF;
+  }
+#if COIL_DRIVER == COIL_DRIVER_PCA9685
+  for (byte i = 0; i < COIL_EXPANDERS; i++) {
+    for (byte channel = 0; channel < 16; channel++) {
+      simI2cRegisters[PCA9685_BASE_ADDR + i][SIM_PCA_LED0 + 4 * channel + 3] = SIM_PCA_FULL;// voies eteintes a la mise sous tension
+    }
+  }
+#endif
+  simShiftRegister.clear();
+  memset(simShiftLatch, 0, sizeof(simShiftLatch));
+  memset(simPins, LOW, sizeof(simPins));
+  simPinLog.clear();
+  simPwmLog.clear();
+  simPwmValue = 0;
+  simPickup = nullptr;
+  memset(simEeprom, 0xFF, sizeof(simEeprom));
+  simEepromReady = 0;
+  simMidiIn.clear();
+  simMidiOut.clear();
+  simSerialText.clear();
+}
+
+unsigned long simTime() {
+  return simNow;
+}
+
+void simAdvance(unsigned long us) {
+  simRun(simNow + us);
+}
+
+void simSetClockStep(unsigned long us) {
+  simStep = us;
+}
+
+//*********************************************************************************************
+//******************             HAL : CLOCK, LOCKS, PWM, TIMER
+
+void halBegin() {
+  pinMode(PWM_PIN, OUTPUT);
+}
+
+unsigned long halMicros() {
+  simRun(simNow + simStep);
+  return simNow;
+}
+
+void halLock() {
+  simLockDepth++;
+}
+
+void halUnlock() {
+  if (--simLockDepth == 0) {
+    simRun(simNow);               // un timer echu pendant la section critique part maintenant
+  }
+}
+
+void halPwmWrite(int value) {
+  analogWrite(PWM_PIN, value);
+}
+
+void halTimerBegin(void (*callback)()) {
+  simTimerCallback = callback;
+  simTimerArmed = false;
+}
+
+void halTimerArm(unsigned long delayUs) {
+  simTimerDeadline = simNow + max(delayUs, (unsigned long)SIM_TIMER_MIN_US);
+  simTimerArmed = simTimerCallback != nullptr;
+}
+
+void halTimerStop() {
+  simTimerArmed = false;
+}
+
+//*********************************************************************************************
+//******************             HAL : I2C BUS AND I2C BOARDS
+
+// START, adresse, octets, STOP : 9 bits par octet
+static unsigned long simI2cDuration(byte length) {
+  return ((length + 1) * 9UL + 2) * 1000000UL / HAL_I2C_FREQ + 1;
+}
+
+void halI2cWrite(byte index, byte address, const byte *data, byte length) {
+  for (byte attempt = 0; attempt < HAL_I2C_RETRIES; attempt++) {
+    health.i2cWrites++;
+    simBusFree = max(simBusFree, simNow) + simI2cDuration(length);
+    bool acked = simI2cNacks[address & 0x7F] == 0;
+    if (simI2cNacks[address & 0x7F] > 0) {
+      simI2cNacks[address & 0x7F]--;
+    }
+    SimI2cFrame frame = {simBusFree, address, acked, std::vector<byte>(data, data + length)};
+    simI2c.push_back(frame);
+    if (acked) {
+      // premier octet : registre, puis auto incrément
+      for (byte i = 1; i < length; i++) {
+        byte reg = data[0] + i - 1;
+        simI2cRegisters[address & 0x7F][reg] = data[i];
+#if COIL_DRIVER == COIL_DRIVER_PCA9685
+        if (reg >= SIM_PCA_ALL_LED && reg < SIM_PCA_ALL_LED + 4) {
+          for (byte channel = 0; channel < 16; channel++) {
+            simI2cRegisters[address & 0x7F][SIM_PCA_LED0 + 4 * channel + reg - SIM_PCA_ALL_LED] = data[i];// ALL_LED : toutes les voies
+          }
+        }
+#endif
+      }
+      return;
+    }
+    health.i2cFailures++;
+    simI2cFailed = true;
+  }
+  simI2cLost |= 1 << index;       // abandonnée apres HAL_I2C_RETRIES essais
+}
+
+byte halI2cLost() {
+  byte lost = simI2cLost;
+  simI2cLost = 0;
+  return lost;
+}
+
+bool halI2cSync() {
+  simRun(max(simBusFree, simNow));// la carte attend la fin du bus
+  bool ok = !simI2cFailed;
+  simI2cFailed = false;
+  return ok;
+}
+
+bool halExpanderBegin(byte index, byte address) {
+  const byte low[] = {SIM_MCP_GPIO, 0, 0};
+  const byte output[] = {SIM_MCP_IODIR, 0, 0};
+  simMcpAddress[index] = address;
+  halI2cSync();
+  halI2cWrite(index, address, low, sizeof(low));
+  bool found = halI2cSync();
+  halI2cWrite(index, address, output, sizeof(output));
+  return halI2cSync() && found;
+}
+
+void halExpanderWrite(byte index, uint16_t outputs) {
+  const byte frame[] = {SIM_MCP_GPIO, (byte)outputs, (byte)(outputs >> 8)};
+  halI2cWrite(index, simMcpAddress[index], frame, sizeof(frame));
+}
+
+const std::vector<SimI2cFrame> &simI2cFrames() {
+  return simI2c;
+}
+
+void simI2cNack(byte address, int count) {
+  simI2cNacks[address & 0x7F] = count;
+}
+
+byte simI2cRegister(byte address, byte reg) {
+  return simI2cRegisters[address & 0x7F][reg];
+}
+
+uint16_t simMcpOutputs(byte address) {
+  return simI2cRegisters[address & 0x7F][SIM_MCP_GPIO] | (simI2cRegisters[address & 0x7F][SIM_MCP_GPIO + 1] << 8);
+}
+
+//*********************************************************************************************
+//******************             HAL : SPI BUS AND SPI BOARDS
+
+#if COIL_DRIVER == COIL_DRIVER_MCP23S17
+// mcp23s17 : tous repondent tant que HAEN est a 0, sinon seulement celui de l'adresse
+static void simSpiMcpTransfer(byte *data, byte length) {
+  if (length < 2) {
+    return;
+  }
+  byte address = (data[0] >> 1) & 7;
+  bool read = data[0] & 1;
+  for (byte device = 0; device < 8; device++) {
+    byte *registers = simSpiMcp[device];
+    if ((registers[SIM_MCP_IOCON] & SIM_MCP_HAEN) && device != address) {
+      continue;
+    }
+    for (byte i = 2; i < length; i++) {
+      byte reg = (data[1] + i - 2) % 0x16;
+      if (read) {
+        data[i] = registers[reg];
+      } else {
+        registers[reg] = data[i];
+        if ((reg & ~1) == SIM_MCP_IOCON) {
+          registers[reg ^ 1] = data[i];   // IOCON a deux adresses
+        }
+      }
+    }
+    if (read) {
+      return;
+    }
+  }
+}
+#endif
+
+void halSpiBegin(byte csPin) {
+  digitalWrite(csPin, HIGH);
+  pinMode(csPin, OUTPUT);
+}
+
+void halSpiTransfer(byte csPin, byte *data, byte length) {
+  SimSpiFrame frame = {0, csPin, std::vector<byte>(data, data + length)};
+  unsigned long bits = length * 8UL;
+  simRun(simNow + (bits * 1000000UL + min((unsigned long)COIL_SPI_FREQ, SIM_SPI_MAX_FREQ) - 1) / min((unsigned long)COIL_SPI_FREQ, SIM_SPI_MAX_FREQ));
+#if COIL_DRIVER == COIL_DRIVER_MCP23S17
+  simSpiMcpTransfer(data, length);
+#else
+  for (byte i = 0; i < length; i++) {
+    simShiftRegister.push_back(data[i]);
+    data[i] = 0;                  // MISO non relié
+  }
+  // front montant de CS : le registre n prend l'octet poussé n places avant le dernier
+  for (byte chip = 0; chip < sizeof(simShiftLatch) && chip < simShiftRegister.size(); chip++) {
+    simShiftLatch[chip] = simShiftRegister[simShiftRegister.size() - 1 - chip];
+  }
+#endif
+  frame.time = simNow;
+  simSpi.push_back(frame);
+}
+
+void halPinOutput(byte pin) {
+  pinMode(pin, OUTPUT);
+}
+
+void halPinWrite(byte pin, bool level) {
+  digitalWrite(pin, level);
+}
+
+const std::vector<SimSpiFrame> &simSpiFrames() {
+  return simSpi;
+}
+
+uint16_t simSpiMcpOutputs(byte hardwareAddress) {
+  const byte *registers = simSpiMcp[hardwareAddress & 7];
+  return registers[SIM_MCP_GPIO] | (registers[SIM_MCP_GPIO + 1] << 8);
+}
+
+byte simShiftOutputs(byte chip) {
+  return chip < sizeof(simShiftLatch) ? simShiftLatch[chip] : 0;
+}
+
+//*********************************************************************************************
+//******************             HAL : CALIBRATION PICKUP AND EEPROM
+
+int halPickupRead() {
+  return analogRead(CALIBRATION_PICKUP_PIN);
+}
+
+void halStoreRead(int address, byte *data, int length) {
+  for (int i = 0; i < length; i++) {
+    data[i] = address + i < HAL_STORE_SIZE ? simEeprom[address + i] : 0xFF;
+  }
+}
+
+bool halStoreWrite(int address, byte data) {
+  if ((long)(simNow - simEepromReady) < 0) {
+    return false;
+  }
+  if (address < HAL_STORE_SIZE && simEeprom[address] != data) {
+    simEeprom[address] = data;
+    simEepromReady = simNow + SIM_EEPROM_WRITE_US;
+  }
+  return true;
+}
+
+void simSetPickup(int (*pickup)(unsigned long time)) {
+  simPickup = pickup;
+}
+
+byte *simStore() {
+  return simEeprom;
+}
+
+//*********************************************************************************************
+//******************             ARDUINO : TIME AND PINS
+
+unsigned long millis() {
+  return halMicros() / 1000;
+}
+
+unsigned long micros() {
+  return halMicros();
+}
+
+void delay(unsigned long ms) {
+  simAdvance(ms * 1000UL);
+}
+
+void delayMicroseconds(unsigned int us) {
+  simAdvance(us);
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  if (mode == INPUT_PULLUP && pin < SIM_PINS) {
+    simPins[pin] = HIGH;
+  }
+}
+
+void digitalWrite(uint8_t pin, uint8_t level) {
+  if (pin < SIM_PINS) {
+    simPins[pin] = level ? HIGH : LOW;
+    SimPinWrite write = {simNow, pin, simPins[pin]};
+    simPinLog.push_back(write);
+  }
+}
+
+int digitalRead(uint8_t pin) {
+  return pin < SIM_PINS ? simPins[pin] : LOW;
+}
+
+int analogRead(uint8_t pin) {
+  return simPickup ? simPickup(halMicros()) : 512;
+}
+
+void analogWrite(uint8_t pin, int value) {
+  simPwmValue = value;
+  SimPinWrite write = {simNow, pin, (byte)value};
+  simPwmLog.push_back(write);
+}
+
+const std::vector<SimPinWrite> &simPinWrites() {
+  return simPinLog;
+}
+
+byte simPin(byte pin) {
+  return pin < SIM_PINS ? simPins[pin] : LOW;
+}
+
+int simPwm() {
+  return simPwmValue;
+}
+
+const std::vector<SimPinWrite> &simPwmWrites() {
+  return simPwmLog;
+}
+
+//*********************************************************************************************
+//******************             ARDUINO : SERIAL
+
+size_t SimSerial::write(uint8_t value) {
+  simSerialText.push_back((char)value);
+  return 1;
+}
+
+size_t SimSerial::write(const uint8_t *data, size_t length) {
+  simSerialText.append((const char *)data, length);
+  return length;
+}
+
+void SimSerial::print(const char *text) {
+  simSerialText += text;
+}
+
+void SimSerial::print(char value) {
+  simSerialText.push_back(value);
+}
+
+void SimSerial::print(long value, int base) {
+  if (value < 0 && base == DEC) {
+    simSerialText.push_back('-');
+    print((unsigned long)-value, base);
+  } else {
+    print((unsigned long)value, base);
+  }
+}
+
+void SimSerial::print(unsigned long value, int base) {
+  char text[24];
+  snprintf(text, sizeof(text), base == HEX ? "%lX" : "%lu", value);
+  simSerialText += text;
+}
+
+void SimSerial::print(double value, int digits) {
+  char text[48];
+  snprintf(text, sizeof(text), "%.*f", digits, value);
+  simSerialText += text;
+}
+
+std::string &simSerial() {
+  return simSerialText;
+}
+
+//*********************************************************************************************
+//******************             MIDI USB
+
+midiEventPacket_t SimMidiUSB::read() {
+  midiEventPacket_t none = {0, 0, 0, 0};
+  if (simMidiIn.empty() || (long)(simMidiIn.front().time - simNow) > 0) {
+    return none;
+  }
+  midiEventPacket_t packet = simMidiIn.front().packet;
+  simMidiIn.erase(simMidiIn.begin());
+  return packet;
+}
+
+void SimMidiUSB::sendMIDI(midiEventPacket_t packet) {
+  byte count = (packet.header & 0x0F) == 0x4 ? 3 : (packet.header & 0x0F) - 4;
+  const byte bytes[3] = {packet.byte1, packet.byte2, packet.byte3};
+  for (byte i = 0; i < count && i < 3; i++) {
+    simMidiOut.push_back(bytes[i]);
+  }
+}
+
+void simMidiFeed(unsigned long time, byte header, byte byte1, byte byte2, byte byte3) {
+  SimMidiPacket packet = {time, {header, byte1, byte2, byte3}};
+  std::vector<SimMidiPacket>::iterator position = simMidiIn.end();
+  while (position != simMidiIn.begin() && (long)((position - 1)->time - time) > 0) {
+    position--;                   // rangés par heure, dans l'ordre d'arrivée a heure egale
+  }
+  simMidiIn.insert(position, packet);
+}
+
+void simMidiNoteOn(unsigned long time, byte channel, byte note, byte velocity) {
+  simMidiFeed(time, 0x09, 0x90 | channel, note, velocity);
+}
+
+void simMidiNoteOff(unsigned long time, byte channel, byte note) {
+  simMidiFeed(time, 0x08, 0x80 | channel, note, 0);
+}
+
+void simMidiControl(unsigned long time, byte channel, byte control, byte value) {
+  simMidiFeed(time, 0x0B, 0xB0 | channel, control, value);
+}
+
+const std::vector<byte> &simMidiSent() {
+  return simMidiOut;
+}
@@ -0,0 +1,85 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+------------------------------------------    SIM.H    --------------------------------------------------
+_________________________________________________________________________________________________________
+Simulation sur PC de la carte Leonardo : horloge virtuelle et peripheriques factices
+
+sim/Hal.cpp remplace xylo/Hal.cpp : les memes Xylophone.cpp, MidiHandler.cpp, CoilDriver.cpp...
+tournent sur PC sans une ligne de modifiée. Tout ce qu'ils font au materiel est enregistré avec
+l'heure virtuelle, et les tests (sim/test_*.cpp) verifient ces enregistrements.
+
+Horloge : demarre a 0 et n'avance que par simAdvance(), delay(), les transferts qui bloquent sur la
+carte (halI2cSync(), trames SPI) et chaque lecture de halMicros()/micros() (simSetClockStep() µs,
+1 par defaut : une boucle d'attente sur l'horloge finit toujours). Le timer de coupure est appelé a
+son echeance exacte, jamais sous halLock() (comme une interruption masquée, il part a halUnlock()).
+
+Bus I2C : chaque trame prend le temps de ses octets a HAL_I2C_FREQ, l'une apres l'autre. Les
+cartes I2C (mcp23017, pca9685) sont des registres a auto incrément (pca9685 : voies eteintes a la
+mise sous tension, ALL_LED recopié sur les 16 voies) ; simI2cNack() fait refuser les prochaines
+trames d'une adresse. Bus SPI : mcp23s17 (adresses materielles, relecture) ou
+chaine de 74HC595 selon COIL_DRIVER, verrouillée au front montant de COIL_SPI_CS_PIN.
+MIDI : simMidiFeed() range des paquets USB-MIDI que MidiUSB.read() rend a leur heure.
+***********************************************************************************************************/
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <Arduino.h>
+#include <vector>
+#include <string>
+#include "settings.h"
+
+struct SimI2cFrame {
+  unsigned long time;             // fin de la trame sur le bus (µs)
+  byte address;
+  bool acked;
+  std::vector<byte> data;
+};
+
+struct SimSpiFrame {
+  unsigned long time;             // front montant de CS (µs)
+  byte csPin;
+  std::vector<byte> data;         // octets envoyés
+};
+
+struct SimPinWrite {
+  unsigned long time;
+  byte pin;
+  byte level;
+};
+
+void simReset();                                  // horloge a 0, peripheriques et journaux vidés
+unsigned long simTime();
+void simAdvance(unsigned long us);                // avance l'horloge, le timer part a son echeance
+void simSetClockStep(unsigned long us);           // µs ajoutées par chaque lecture de l'horloge
+
+// bus I2C et cartes I2C factices
+const std::vector<SimI2cFrame> &simI2cFrames();
+void simI2cNack(byte address, int count);         // les count prochaines trames vers address ne sont pas acquittées (-1 : toujours)
+byte simI2cRegister(byte address, byte reg);      // registre d'une carte I2C (mcp23017, pca9685)
+uint16_t simMcpOutputs(byte address);             // GPIOA | GPIOB << 8 d'un mcp23017
+
+// bus SPI : mcp23s17 ou 74HC595 selon COIL_DRIVER
+const std::vector<SimSpiFrame> &simSpiFrames();
+uint16_t simSpiMcpOutputs(byte hardwareAddress);  // GPIOA | GPIOB << 8 d'un mcp23s17
+byte simShiftOutputs(byte chip);                  // sorties verrouillées du 74HC595 n (0 : relié a MOSI)
+
+// broches, PWM commun, capteur de calibration et EEPROM
+const std::vector<SimPinWrite> &simPinWrites();
+byte simPin(byte pin);
+int simPwm();                                     // derniere valeur de halPwmWrite()
+const std::vector<SimPinWrite> &simPwmWrites();   // pin = PWM_PIN, level = valeur
+void simSetPickup(int (*pickup)(unsigned long time));// lecture du capteur a l'heure donnée
+byte *simStore();                                 // EEPROM (1 Ko, effacée a 0xFF)
+#define SIM_EEPROM_WRITE_US 3300                  // programmation d'un octet modifié, halStoreWrite() refuse pendant ce temps
+
+// MIDI USB et port serie
+void simMidiFeed(unsigned long time, byte header, byte byte1, byte byte2, byte byte3);
+void simMidiNoteOn(unsigned long time, byte channel, byte note, byte velocity);
+void simMidiNoteOff(unsigned long time, byte channel, byte note);
+void simMidiControl(unsigned long time, byte channel, byte control, byte value);
+const std::vector<byte> &simMidiSent();           // octets des SysEx envoyés
+std::string &simSerial();                         // tout ce qui a été ecrit sur Serial
+
+#endif // SIM_H
@@ -0,0 +1,43 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+---------------------------------------    SIMTEST.H    -------------------------------------------------
+_________________________________________________________________________________________________________
+Verifications des tests de la simulation : SIM_CHECK() note l'echec et continue, simTestResult()
+donne le code de sortie du test (0 si tout est passé) pour ctest.
+***********************************************************************************************************/
+
+#ifndef SIM_TEST_H
+#define SIM_TEST_H
+
+#include <stdio.h>
+
+static int simTestFailures = 0;
+
+#define SIM_CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      fprintf(stderr, "%s:%d: echec : %s\n", __FILE__, __LINE__, #condition); \
+      simTestFailures++; \
+    } \
+  } while (0)
+
+#define SIM_CHECK_NEAR(value, expected, tolerance) \
+  do { \
+    long simValue = (long)(value); \
+    long simExpected = (long)(expected); \
+    if (simValue < simExpected - (long)(tolerance) || simValue > simExpected + (long)(tolerance)) { \
+      fprintf(stderr, "%s:%d: echec : %s = %ld, attendu %ld a %ld pres\n", __FILE__, __LINE__, #value, \
+              simValue, simExpected, (long)(tolerance)); \
+      simTestFailures++; \
+    } \
+  } while (0)
+
+inline int simTestResult(const char *name) {
+  if (simTestFailures == 0) {
+    printf("%s : ok\n", name);
+  }
+  return simTestFailures == 0 ? 0 : 1;
+}
+
+#endif // SIM_TEST_H
@@ -0,0 +1,97 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+-----------------------------------    SIM/ARDUINO/ARDUINO.H    -----------------------------------------
+_________________________________________________________________________________________________________
+Arduino.h pour la simulation sur PC
+
+Juste ce que les sources de xylo/ utilisent (types, broches, Serial, temps, maths). Le temps est
+celui de l'horloge virtuelle de Sim.h : delay() avance l'horloge et declenche le timer de coupure
+a son echeance, comme sur la carte. Serial garde tout ce qui est ecrit (simSerial()).
+***********************************************************************************************************/
+
+#ifndef SIM_ARDUINO_H
+#define SIM_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <string>
+
+typedef uint8_t byte;
+typedef bool boolean;
+using std::min;
+using std::max;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define DEC 10
+#define HEX 16
+
+// broches analogiques du Leonardo
+#define A0 18
+#define A1 19
+#define A2 20
+#define A3 21
+#define A4 22
+#define A5 23
+
+#define F(text) (text)
+#define PROGMEM
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+#define pgm_read_word(address) (*(const uint16_t *)(address))
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t level);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+void analogWrite(uint8_t pin, int value);
+
+inline long map(long x, long inMin, long inMax, long outMin, long outMax) {
+  return (x - inMin) * (outMax - outMin) / (inMax - inMin) + outMin;
+}
+
+template <class T, class L, class H>
+T constrain(T x, L low, H high) {
+  return x < (T)low ? (T)low : (x > (T)high ? (T)high : x);
+}
+
+// port serie : garde le texte et les trames envoyés
+class SimSerial {
+public:
+  void begin(unsigned long baud) {}
+  operator bool() const { return true; }
+  int availableForWrite() const { return 64; }
+  void flush() {}
+  size_t write(uint8_t value);
+  size_t write(const uint8_t *data, size_t length);
+
+  void print(const char *text);
+  void print(const std::string &text) { print(text.c_str()); }
+  void print(char value);
+  void print(int value, int base = DEC) { print((long)value, base); }
+  void print(unsigned int value, int base = DEC) { print((unsigned long)value, base); }
+  void print(uint8_t value, int base = DEC) { print((unsigned long)value, base); }
+  void print(long value, int base = DEC);
+  void print(unsigned long value, int base = DEC);
+  void print(double value, int digits = 2);
+
+  template <class T> void println(T value) { print(value); println(); }
+  template <class T> void println(T value, int format) { print(value, format); println(); }
+  void println() { print("\r\n"); }
+};
+
+extern SimSerial Serial;
+
+#endif // SIM_ARDUINO_H
@@ -0,0 +1,33 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+------------------------------------    SIM/ARDUINO/MIDIUSB.H    ----------------------------------------
+_________________________________________________________________________________________________________
+MidiUSB factice pour la simulation sur PC
+
+read() rend les paquets USB-MIDI donnés par simMidiFeed() (Sim.h) dont l'heure est arrivée, puis
+un paquet vide comme la vraie bibliotheque. Les paquets envoyés (SysEx) sont gardés par simMidiSent().
+***********************************************************************************************************/
+
+#ifndef SIM_MIDIUSB_H
+#define SIM_MIDIUSB_H
+
+#include <Arduino.h>
+
+typedef struct {
+  uint8_t header;
+  uint8_t byte1;
+  uint8_t byte2;
+  uint8_t byte3;
+} midiEventPacket_t;
+
+class SimMidiUSB {
+public:
+  midiEventPacket_t read();
+  void sendMIDI(midiEventPacket_t packet);
+  void flush() {}
+};
+
+extern SimMidiUSB MidiUSB;
+
+#endif // SIM_MIDIUSB_H
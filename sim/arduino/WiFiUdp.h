@@ -0,0 +1,24 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+------------------------------------    SIM/ARDUINO/WIFIUDP.H    ----------------------------------------
+_________________________________________________________________________________________________________
+WiFiUDP factice pour compiler xylo_esp32_wifi/RtpJournal.cpp sur PC : aucun paquet ne se presente,
+les tests donnent les paquets directement a RtpJournal::feed().
+***********************************************************************************************************/
+
+#ifndef SIM_WIFIUDP_H
+#define SIM_WIFIUDP_H
+
+#include <Arduino.h>
+
+class WiFiUDP {
+public:
+  uint8_t begin(uint16_t port) { return 1; }
+  int parsePacket() { return 0; }
+  int read() { return -1; }
+  int read(unsigned char *buffer, size_t length) { return 0; }
+  int read(char *buffer, size_t length) { return 0; }
+};
+
+#endif // SIM_WIFIUDP_H
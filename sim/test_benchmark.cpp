@@ -0,0 +1,61 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+-----------------------------------    TEST_BENCHMARK.CPP    --------------------------------------------
+_________________________________________________________________________________________________________
+MidiHandler::benchmark() sur la carte simulée : les charges de reference passent par la reception
+USB-MIDI, la file et la boucle, comme sur le Leonardo. Les lignes JSON sont recopiées sur la sortie
+standard (memes histogrammes que sur la carte) et verifiées : une ligne par charge et par mesure,
+toutes les notes jouées, et hors accords une latence de quelques µs (un accord attend au plus un
+decalage COIL_STAGGER_US de plus).
+***********************************************************************************************************/
+
+#include <stdio.h>
+#include "Sim.h"
+#include "SimTest.h"
+#include "MidiHandler.h"
+
+// la ligne JSON d'une charge et d'une mesure, vide si absente
+static std::string reportLine(const char *workload, const char *metric) {
+  std::string key = std::string("{\"workload\":\"") + workload + "\",\"metric\":\"" + metric + "\"";
+  size_t start = simSerial().find(key);
+  if (start == std::string::npos) {
+    return std::string();
+  }
+  return simSerial().substr(start, simSerial().find('\n', start) - start);
+}
+
+static long reportValue(const std::string &line, const char *field) {
+  size_t start = line.find(std::string("\"") + field + "\":");
+  return start == std::string::npos ? -1 : atol(line.c_str() + start + strlen(field) + 3);
+}
+
+int main() {
+  simReset();
+  Xylophone xylophone;
+  xylophone.begin();
+  MidiHandler midiHandler(xylophone);
+  midiHandler.begin();
+  simSerial().clear();
+  midiHandler.benchmark();
+  fputs(simSerial().c_str(), stdout);
+
+  const char *workloads[] = { "single_notes", "dense_chords", "fast_repeats", "all_notes_off_bursts" };
+  const char *metrics[] = { "latency_us", "dwell_error_us", "jitter_us" };
+  for (const char *workload : workloads) {
+    for (const char *metric : metrics) {
+      SIM_CHECK(!reportLine(workload, metric).empty());
+    }
+    SIM_CHECK(reportValue(reportLine(workload, "latency_us"), "count") > 0);
+  }
+  std::string single = reportLine("single_notes", "latency_us");
+  std::string chords = reportLine("dense_chords", "latency_us");
+  std::string repeats = reportLine("fast_repeats", "latency_us");
+  SIM_CHECK(reportValue(single, "count") == INSTRUMENT_RANGE);
+  SIM_CHECK(reportValue(chords, "count") == 20 * 6);
+  SIM_CHECK(reportValue(repeats, "count") == 50);
+  SIM_CHECK(reportValue(single, "max") <= 100);
+  SIM_CHECK(reportValue(repeats, "max") <= 100);
+  SIM_CHECK(reportValue(chords, "max") <= COIL_STAGGER_US + 100);
+  return simTestResult("benchmark");
+}
@@ -0,0 +1,112 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+---------------------------------    TEST_CALIBRATION_FIT.CPP    ----------------------------------------
+_________________________________________________________________________________________________________
+Calculs de CalibrationFit sur des traces ADC synthetiques : piezo au repos avec du bruit, puis
+sinusoide amortie a partir d'un instant connu. Compilé sans Arduino.h ni Hal.h : seul
+xylo/CalibrationFit.cpp est lié.
+***********************************************************************************************************/
+
+#include <math.h>
+#include "SimTest.h"
+#include "CalibrationFit.h"
+
+#define TRACE_REST 512
+#define TRACE_INTERVAL 250      // µs entre deux echantillons, comme CALIBRATION_SAMPLE_INTERVAL
+
+// echantillon a l'instant t (µs apres la commande) : bruit de ±noise au repos, puis oscillation
+// a 1 kHz d'amplitude peak qui decroit en 20 ms a partir de onset
+static int traceSample(unsigned long t, unsigned long onset, int peak, int noise) {
+  int sample = TRACE_REST + (int)((t / TRACE_INTERVAL) % 3) * noise - noise;
+  if (t >= onset) {
+    float s = (t - onset) / 1000000.0f;
+    sample += (int)(peak * expf(-s / 0.02f) * sinf(2 * 3.14159265f * 1000 * s + 1.5707963f));
+  }
+  return sample;
+}
+
+static void runDetector(EnvelopeDetector &detector, unsigned long onset, int peak, int noise, int threshold) {
+  detector.reset(threshold);
+  for (int i = 0; i < 16; i++) {
+    detector.baseline(traceSample(0, 1000000UL, 0, noise));
+  }
+  for (unsigned long t = 0; t <= 50000UL; t += TRACE_INTERVAL) {
+    detector.feed(t, traceSample(t, onset, peak, noise));
+  }
+}
+
+static void testEnvelope() {
+  EnvelopeDetector detector;
+
+  // front raide : le seuil est franchi au premier echantillon apres l'onset
+  runDetector(detector, 3000, 300, 2, 30);
+  SIM_CHECK(detector.detected());
+  SIM_CHECK_NEAR(detector.onset(), 3000, TRACE_INTERVAL);
+  SIM_CHECK_NEAR(detector.peak(), 300, 10);
+
+  // onset entre deux echantillons : l'interpolation reste dans l'intervalle
+  runDetector(detector, 5130, 200, 2, 30);
+  SIM_CHECK(detector.detected());
+  SIM_CHECK(detector.onset() >= 5130 - TRACE_INTERVAL && detector.onset() <= 5130 + TRACE_INTERVAL);
+
+  // le bruit seul ne declenche pas
+  runDetector(detector, 1000000UL, 0, 5, 30);
+  SIM_CHECK(!detector.detected());
+  SIM_CHECK(detector.peak() < 30);
+
+  // interpolation exacte sur une rampe : seuil 30 entre 0 (t = 1000) et 60 (t = 1250)
+  detector.reset(30);
+  detector.baseline(TRACE_REST);
+  detector.feed(1000, TRACE_REST);
+  detector.feed(1250, TRACE_REST + 60);
+  SIM_CHECK_NEAR(detector.onset(), 1125, 1);
+}
+
+static void testLinearFit() {
+  LinearFit fit;
+  float offset = 0;
+  float slope = 0;
+  SIM_CHECK(!fit.solve(offset, slope));
+  fit.add(100, 50);
+  fit.add(100, 60);
+  SIM_CHECK(!fit.solve(offset, slope));    // un seul PWM
+
+  // crete = 20 + 1.5 * pwm, avec ±3 d'ecart alterné
+  fit.reset();
+  for (int pwm = 60; pwm <= 255; pwm += 39) {
+    fit.add(pwm, 20 + 1.5f * pwm + ((pwm / 39) % 2 ? 3 : -3));
+  }
+  SIM_CHECK(fit.count() == 6);
+  SIM_CHECK(fit.solve(offset, slope));
+  SIM_CHECK(fabsf(slope - 1.5f) < 0.05f);
+  SIM_CHECK(fabsf(offset - 20) < 8);
+}
+
+static void testSettings() {
+  const uint8_t dwells[] = { 10, 15, 20, 25, 30 };
+  const int peaks[] = { 200, 290, 300, 298, 280 };
+  SIM_CHECK(calibrationDwell(peaks, dwells, 5, 5) == 15);   // 290 >= 95% de 300
+  SIM_CHECK(calibrationDwell(peaks, dwells, 5, 1) == 20);
+  const int silent[] = { 0, 0, 0, 0, 0 };
+  SIM_CHECK(calibrationDwell(silent, dwells, 5, 5) == 0);
+
+  NoteCalibration calibration = { 20, 1.5f, 4000, -10, 20, 1 };
+  SIM_CHECK(calibrationMinPwm(calibration, 80, 50) == 40);
+  SIM_CHECK(calibrationMinPwm(calibration, 10, 50) == 0);
+  SIM_CHECK(calibrationMinPwm(calibration, 1000, 50) == 255);
+  calibration.levelSlope = 0;
+  SIM_CHECK(calibrationMinPwm(calibration, 80, 50) == 50);   // la crete ne croit pas avec le PWM
+
+  SIM_CHECK(calibrationLatency(calibration, 100) == 3000);
+  SIM_CHECK(calibrationLatency(calibration, 255) == 1450);
+  calibration.latencyOffset = 1000;
+  SIM_CHECK(calibrationLatency(calibration, 255) == 0);     // jamais negative
+}
+
+int main() {
+  testEnvelope();
+  testLinearFit();
+  testSettings();
+  return simTestResult("calibration_fit");
+}
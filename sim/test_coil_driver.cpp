@@ -0,0 +1,183 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+---------------------------------    TEST_COIL_DRIVER.CPP    --------------------------------------------
+_________________________________________________________________________________________________________
+Une carte de sortie (CoilDriver.h) sur les peripheriques factices de sim/Hal.cpp. Le meme fichier
+est compilé une fois par valeur de COIL_DRIVER (voir CMakeLists.txt) : mise a LOW au demarrage,
+image des banques recopiée sur les sorties, banques non modifiées laissées de coté, et pour les
+cartes I2C une carte absente et une trame abandonnée.
+***********************************************************************************************************/
+
+#include "Sim.h"
+#include "SimTest.h"
+#include "CoilDriver.h"
+#include "Hal.h"
+
+#if COIL_DRIVER == COIL_DRIVER_PCA9685
+#define PCA9685_LED0 0x06
+#define PCA9685_FULL 0x10
+
+// ON_H et OFF de la voie channel de la carte bank
+static byte pcaOnHigh(byte bank, byte channel) {
+  return simI2cRegister(PCA9685_BASE_ADDR + bank, PCA9685_LED0 + 4 * channel + 1);
+}
+
+static uint16_t pcaOff(byte bank, byte channel) {
+  byte reg = PCA9685_LED0 + 4 * channel + 2;
+  return simI2cRegister(PCA9685_BASE_ADDR + bank, reg) | (simI2cRegister(PCA9685_BASE_ADDR + bank, reg + 1) << 8);
+}
+#endif
+
+// sorties de la banque telles que la carte les montre
+static uint16_t boardOutputs(byte bank) {
+#if COIL_DRIVER == COIL_DRIVER_MCP23017
+  return simMcpOutputs(MCP_BASE_ADDR + bank);
+#elif COIL_DRIVER == COIL_DRIVER_MCP23S17
+  return simSpiMcpOutputs(bank);
+#elif COIL_DRIVER == COIL_DRIVER_74HC595
+  return simShiftOutputs(bank * 2) | (simShiftOutputs(bank * 2 + 1) << 8);
+#elif COIL_DRIVER == COIL_DRIVER_GPIO
+  const byte count = sizeof(COIL_GPIO_PINS) / sizeof(COIL_GPIO_PINS[0]);
+  uint16_t outputs = 0;
+  for (byte bit = 0; bit < 16 && bank * 16 + bit < count; bit++) {
+    outputs |= (uint16_t)simPin(COIL_GPIO_PINS[bank * 16 + bit]) << bit;
+  }
+  return outputs;
+#elif COIL_DRIVER == COIL_DRIVER_PCA9685
+  uint16_t outputs = 0;
+  for (byte channel = 0; channel < 16; channel++) {
+    if (!(pcaOff(bank, channel) & (PCA9685_FULL << 8))) {
+      outputs |= 1U << channel;
+    }
+  }
+  return outputs;
+#endif
+}
+
+// sorties que la carte peut montrer : chaine de 74HC595 ou broches plus courtes que l'image
+static uint16_t boardMask(byte bank) {
+#if COIL_DRIVER == COIL_DRIVER_74HC595
+  byte chips = COIL_595_COUNT > bank * 2 ? min(COIL_595_COUNT - bank * 2, 2) : 0;
+  return chips == 2 ? 0xFFFF : (chips == 1 ? 0x00FF : 0);
+#elif COIL_DRIVER == COIL_DRIVER_GPIO
+  int count = (int)(sizeof(COIL_GPIO_PINS) / sizeof(COIL_GPIO_PINS[0])) - bank * 16;
+  return count >= 16 ? 0xFFFF : (count > 0 ? (1U << count) - 1 : 0);
+#else
+  return 0xFFFF;
+#endif
+}
+
+static void testBeginAndWrite() {
+  simReset();
+  SIM_CHECK(coilDriverBegin());
+  SIM_CHECK(coilDriverSync());
+  for (byte bank = 0; bank < COIL_BANKS; bank++) {
+    SIM_CHECK(boardOutputs(bank) == 0);
+  }
+
+  uint16_t outputs[COIL_BANKS] = {};
+  bool dirty[COIL_BANKS] = {};
+  byte duty[COIL_BANKS * 16];
+  memset(duty, 255, sizeof(duty));
+  for (byte bank = 0; bank < COIL_BANKS; bank++) {
+    outputs[bank] = (0x0A05 << bank) & boardMask(bank);
+    dirty[bank] = true;
+  }
+  coilDriverWrite(outputs, dirty, duty);
+  SIM_CHECK(coilDriverSync());
+  for (byte bank = 0; bank < COIL_BANKS; bank++) {
+    SIM_CHECK(boardOutputs(bank) == outputs[bank]);
+  }
+
+  // une banque modifiée sans etre marquée n'est pas envoyée (sauf la chaine, poussée en entier)
+  uint16_t previous = outputs[0];
+  outputs[0] ^= 0x0001;
+  dirty[0] = false;
+  for (byte bank = 1; bank < COIL_BANKS; bank++) {
+    dirty[bank] = false;
+  }
+  coilDriverWrite(outputs, dirty, duty);
+  coilDriverSync();
+  SIM_CHECK(boardOutputs(0) == previous);
+  dirty[0] = true;
+  coilDriverWrite(outputs, dirty, duty);
+  coilDriverSync();
+  SIM_CHECK(boardOutputs(0) == outputs[0]);
+}
+
+#if COIL_DRIVER == COIL_DRIVER_PCA9685
+// rapport cyclique de chaque voie : OFF = duty * 16 sur 4096, 255 = toujours allumée
+static void testDuty() {
+  simReset();
+  coilDriverBegin();
+  uint16_t outputs[COIL_BANKS] = {0x0007};
+  bool dirty[COIL_BANKS] = {true};
+  byte duty[COIL_BANKS * 16] = {128, 255, 1};
+  coilDriverWrite(outputs, dirty, duty);
+  coilDriverSync();
+  SIM_CHECK(pcaOff(0, 0) == 128 << 4 && pcaOnHigh(0, 0) == 0);
+  SIM_CHECK(pcaOff(0, 1) == 0 && pcaOnHigh(0, 1) == PCA9685_FULL);
+  SIM_CHECK(pcaOff(0, 2) == 1 << 4);
+  SIM_CHECK(pcaOff(0, 3) == PCA9685_FULL << 8);
+
+  // voie restée allumée passée au PWM de maintien : seule cette voie est renvoyée
+  size_t frames = simI2cFrames().size();
+  duty[1] = 40;
+  coilDriverWrite(outputs, dirty, duty);
+  coilDriverSync();
+  SIM_CHECK(simI2cFrames().size() == frames + 1);
+  SIM_CHECK(simI2cFrames().back().data.size() == 1 + 4);
+  SIM_CHECK(pcaOff(0, 1) == 40 << 4 && pcaOnHigh(0, 1) == 0);
+  SIM_CHECK(pcaOff(0, 0) == 128 << 4);
+
+  // rien de changé : pas de trame
+  coilDriverWrite(outputs, dirty, duty);
+  coilDriverSync();
+  SIM_CHECK(simI2cFrames().size() == frames + 1);
+}
+#endif
+
+#if COIL_DRIVER == COIL_DRIVER_MCP23017 || COIL_DRIVER == COIL_DRIVER_PCA9685
+#if COIL_DRIVER == COIL_DRIVER_MCP23017
+#define BOARD_ADDR(bank) (MCP_BASE_ADDR + (bank))
+#else
+#define BOARD_ADDR(bank) (PCA9685_BASE_ADDR + (bank))
+#endif
+
+// carte absente au demarrage, puis trame abandonnée apres HAL_I2C_RETRIES refus : l'image est
+// renvoyée a l'ecriture suivante, meme sans banque modifiée
+static void testI2cFailures() {
+  simReset();
+  simI2cNack(BOARD_ADDR(COIL_BANKS - 1), -1);
+  SIM_CHECK(!coilDriverBegin());
+
+  simReset();
+  coilDriverBegin();
+  uint16_t outputs[COIL_BANKS] = {0x0003};
+  bool dirty[COIL_BANKS] = {true};
+  byte duty[COIL_BANKS * 16];
+  memset(duty, 255, sizeof(duty));
+  simI2cNack(BOARD_ADDR(0), HAL_I2C_RETRIES);
+  coilDriverWrite(outputs, dirty, duty);
+  SIM_CHECK(!coilDriverSync());
+  SIM_CHECK(boardOutputs(0) == 0);
+  dirty[0] = false;
+  coilDriverWrite(outputs, dirty, duty);
+  SIM_CHECK(coilDriverSync());
+  SIM_CHECK(boardOutputs(0) == 0x0003);
+  coilDriverWrite(outputs, dirty, duty);  // plus rien a renvoyer
+  SIM_CHECK(simI2cFrames().back().acked);
+}
+#endif
+
+int main() {
+  testBeginAndWrite();
+#if COIL_DRIVER == COIL_DRIVER_PCA9685
+  testDuty();
+#endif
+#if COIL_DRIVER == COIL_DRIVER_MCP23017 || COIL_DRIVER == COIL_DRIVER_PCA9685
+  testI2cFailures();
+#endif
+  return simTestResult("coil_driver");
+}
@@ -0,0 +1,169 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+------------------------------------    TEST_RTP_JOURNAL.CPP    -----------------------------------------
+_________________________________________________________________________________________________________
+Recovery journal RTP-MIDI de xylo_esp32_wifi (RtpJournal.h) : paquets construits octet par octet et
+donnés a feed(), etat reçu donné comme le feraient les callbacks AppleMIDI. Chapitre C (valeurs et
+compteurs), chapitre N (note on journalisés, OFFBITS), checkpoint deroulé au passage de 0xFFFF et
+retard estimé d'un paquet perdu a partir des timestamps RTP.
+***********************************************************************************************************/
+
+#include <vector>
+#include "RtpJournal.h"             // settings.h de xylo_esp32_wifi
+#include "Sim.h"
+#include "SimTest.h"
+
+#define TOC_C 0x40
+#define TOC_N 0x08
+
+struct Replayed {
+  byte type;
+  byte channel;
+  byte data1;
+  byte data2;
+};
+
+static std::vector<Replayed> replayed;
+
+static void onReplay(byte type, byte channel, byte data1, byte data2) {
+  Replayed event = {type, channel, data1, data2};
+  replayed.push_back(event);
+}
+
+static bool wasReplayed(byte type, byte data1, byte data2) {
+  for (const Replayed &event : replayed) {
+    if (event.type == type && event.channel == 1 && event.data1 == data1 && event.data2 == data2) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// journal d'un seul canal : entete S Y A H TOTCHAN (A), checkpoint, entete S CHAN H LENGTH, table des chapitres
+static std::vector<byte> channelJournal(uint16_t checkpoint, byte toc, const std::vector<byte> &chapters) {
+  unsigned int length = 3 + chapters.size();
+  std::vector<byte> journal = {0x20, (byte)(checkpoint >> 8), (byte)checkpoint, (byte)(length >> 8), (byte)length, toc};
+  journal.insert(journal.end(), chapters.begin(), chapters.end());
+  return journal;
+}
+
+// paquet RTP-MIDI (V=2, PT 0x61) : section des commandes B J Z P LEN, puis le journal s'il y en a un
+static void feedPacket(RtpJournal &journal, uint16_t seq, uint32_t timestamp, const std::vector<byte> &commands,
+                       const std::vector<byte> &recovery) {
+  std::vector<byte> packet = {0x80, 0x61, (byte)(seq >> 8), (byte)seq, (byte)(timestamp >> 24), (byte)(timestamp >> 16),
+                              (byte)(timestamp >> 8), (byte)timestamp, 0x12, 0x34, 0x56, 0x78};
+  packet.push_back((recovery.empty() ? 0x00 : 0x40) | commands.size());
+  packet.insert(packet.end(), commands.begin(), commands.end());
+  packet.insert(packet.end(), recovery.begin(), recovery.end());
+  journal.feed(packet.data(), packet.size(), true);
+}
+
+static void testControls() {
+  simReset();
+  replayed.clear();
+  RtpJournal journal;
+  journal.setHandler(onReplay);
+  feedPacket(journal, 10, 0, {0xB0, 7, 20}, {});
+  journal.controlChange(1, 7, 20);
+  journal.controlChange(1, 64, 127);
+  journal.controlChange(1, 10, 64);
+
+  // 11 perdu (CC 7 = 100, pedale 64 relevée puis enfoncée, CC 66 une fois) : chapitre C du paquet 12
+  simAdvance(10000);
+  std::vector<byte> chapterC = {3, 7, 100, 64, 0x80 | 3, 10, 64, 66, 0x80 | 0x40 | 1};
+  feedPacket(journal, 12, 100, {}, channelJournal(10, TOC_C, chapterC));
+  SIM_CHECK(replayed.size() == 3);
+  SIM_CHECK(wasReplayed(0xB0, 7, 100));
+  SIM_CHECK(wasReplayed(0xB0, 64, 127));   // compteur 1 -> 3 : nombre impair, enfoncée
+  SIM_CHECK(wasReplayed(0xB0, 66, 0));     // compteur avec T
+  RecoveryStats stats = journal.stats();
+  SIM_CHECK(stats.lostPackets == 1 && stats.recovered == 3 && stats.dropped == 0);
+
+  // 13 perdu sans changement : le meme chapitre ne rejoue rien
+  simAdvance(10000);
+  replayed.clear();
+  feedPacket(journal, 14, 200, {}, channelJournal(10, TOC_C, chapterC));
+  SIM_CHECK(replayed.empty());
+  SIM_CHECK(journal.stats().lostPackets == 2);
+}
+
+// sequence qui passe 0xFFFF : le checkpoint 0xFFFE est deroulé avant le paquet 0xFFFF
+static void testNotes() {
+  simReset();
+  replayed.clear();
+  RtpJournal journal;
+  journal.setHandler(onReplay);
+  feedPacket(journal, 0xFFFE, 0, {0x90, 62, 100}, {});
+  journal.noteOn(1, 62);
+  simAdvance(10000);
+  feedPacket(journal, 0xFFFF, 100, {0x90, 60, 100}, {});
+  journal.noteOn(1, 60);
+
+  // 0x0000 perdu (note off 62, note on 64 et 65) : chapitre N du paquet 0x0001, checkpoint 0xFFFE.
+  // 60 est journalisé mais reçu apres le checkpoint, 65 n'est pas recommandé (Y = 0),
+  // OFFBITS des notes 56..63 : 61 (jamais tenue) et 62
+  simAdvance(10000);
+  std::vector<byte> chapterN = {3, 0x77, 60, 0x80 | 100, 64, 0x80 | 90, 65, 80, 0x04 | 0x02};
+  feedPacket(journal, 0x0001, 300, {}, channelJournal(0xFFFE, TOC_N, chapterN));
+  SIM_CHECK(replayed.size() == 2);
+  SIM_CHECK(wasReplayed(0x90, 64, 90));
+  SIM_CHECK(wasReplayed(0x80, 62, 0));
+  RecoveryStats stats = journal.stats();
+  SIM_CHECK(stats.lostPackets == 1 && stats.recovered == 2 && stats.dropped == 1);
+
+  // 0x0002 perdu, meme checkpoint : 64 est maintenant tenue depuis un paquet apres le checkpoint,
+  // 65 a été abandonnée une fois pour toutes
+  simAdvance(10000);
+  replayed.clear();
+  feedPacket(journal, 0x0003, 500, {}, channelJournal(0xFFFE, TOC_N, chapterN));
+  SIM_CHECK(replayed.empty());
+  SIM_CHECK(journal.stats().dropped == 1);
+}
+
+// une perte entre deux paquets : rejouée ou abandonnée selon le retard estimé, CC 7 = value
+static bool lossReplayed(RtpJournal &journal, uint16_t &seq, uint32_t &timestamp, uint16_t lost,
+                         unsigned long sendGap, unsigned long arrivalGap, byte value) {
+  feedPacket(journal, seq, timestamp, {}, {});
+  simAdvance(arrivalGap);
+  seq += lost + 1;
+  timestamp += sendGap * RTP_CLOCK_RATE / 1000000UL;
+  replayed.clear();
+  std::vector<byte> chapterC = {0, 7, value};
+  feedPacket(journal, seq, timestamp, {}, channelJournal(seq - lost - 1, TOC_C, chapterC));
+  journal.controlChange(1, 7, value);
+  seq++;
+  timestamp += 100;
+  simAdvance(10000);
+  return wasReplayed(0xB0, 7, value);
+}
+
+static void testLateness() {
+  simReset();
+  replayed.clear();
+  RtpJournal journal;
+  journal.setHandler(onReplay);
+  uint16_t seq = 100;
+  uint32_t timestamp = 5000;
+  unsigned long lateness = WIFI_RECOVERY_LATENESS * 1000UL;
+
+  // un paquet perdu au milieu d'un silence de 1,5 x la limite : il n'a que 0,75 x la limite de retard
+  SIM_CHECK(lossReplayed(journal, seq, timestamp, 1, lateness * 3 / 2, lateness * 3 / 2, 1));
+  // silence de 2,5 x la limite : le perdu a 1,25 x la limite de retard
+  SIM_CHECK(!lossReplayed(journal, seq, timestamp, 1, lateness * 5 / 2, lateness * 5 / 2, 2));
+  // trois perdus sur 2 x la limite : le plus ancien aurait dû arriver apres 0,5 x, il a 1,5 x de retard
+  SIM_CHECK(!lossReplayed(journal, seq, timestamp, 3, lateness * 2, lateness * 2, 3));
+  // paquet retardé par le reseau : envoyé 0,5 x apres le dernier, reçu 1,2 x apres (0,95 x de retard)
+  SIM_CHECK(lossReplayed(journal, seq, timestamp, 1, lateness / 2, lateness * 6 / 5, 4));
+  // timestamp qui n'avance pas : tout le silence compte
+  SIM_CHECK(!lossReplayed(journal, seq, timestamp, 1, 0, lateness * 3 / 2, 5));
+  RecoveryStats stats = journal.stats();
+  SIM_CHECK(stats.lostPackets == 7 && stats.recovered == 2 && stats.dropped == 3);
+}
+
+int main() {
+  testControls();
+  testNotes();
+  testLateness();
+  return simTestResult("rtp_journal");
+}
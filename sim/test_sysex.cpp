@@ -0,0 +1,140 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+---------------------------------------    TEST_SYSEX.CPP    --------------------------------------------
+_________________________________________________________________________________________________________
+Chargement de partition par SysEx (SysExParser.h) octet par octet : sequence, somme, bloc renvoyé,
+longueur et partition pleine, puis echeances rendues par Score::next() pendant la lecture.
+***********************************************************************************************************/
+
+#include <vector>
+#include "SimTest.h"
+#include "SysExParser.h"
+
+// message complet F0 ... F7, renvoie la commande rendue par feed() sur F7
+static SysExCommand sysexFeed(SysExParser &parser, const std::vector<byte> &message) {
+  SysExCommand command = SYSEX_NONE;
+  for (byte data : message) {
+    command = parser.feed(data);
+  }
+  return command;
+}
+
+static std::vector<byte> sysexCommand(byte command) {
+  return std::vector<byte>{0xF0, SYSEX_MANUFACTURER_ID, SYSEX_DEVICE_ID, command, 0xF7};
+}
+
+// bloc de partition : count evenements {delta, note, vélocité}, somme corrigée de fix
+static std::vector<byte> sysexChunk(byte sequence, byte count, uint16_t delta, byte fix = 0) {
+  std::vector<byte> message = {0xF0, SYSEX_MANUFACTURER_ID, SYSEX_DEVICE_ID, SYSEX_UPLOAD_CHUNK, sequence};
+  byte checksum = sequence;
+  for (byte i = 0; i < count; i++) {
+    byte event[4] = {(byte)(delta & 0x7F), (byte)(delta >> 7), (byte)(INSTRUMENT_START_NOTE + i % INSTRUMENT_RANGE), 100};
+    for (byte data : event) {
+      message.push_back(data);
+      checksum ^= data;
+    }
+  }
+  message.push_back(checksum ^ fix);
+  message.push_back(0xF7);
+  return message;
+}
+
+static void testSequence() {
+  Score score;
+  SysExParser parser(score);
+  SIM_CHECK(sysexFeed(parser, sysexCommand(SYSEX_UPLOAD_BEGIN)) == SYSEX_UPLOAD_BEGIN);
+
+  // le bloc 127 juste apres le debut n'est pas un renvoi du bloc precedent : il n'y en a pas
+  SIM_CHECK(sysexFeed(parser, sysexChunk(127, 2, 10)) == SYSEX_UPLOAD_CHUNK);
+  SIM_CHECK(parser.status() == SYSEX_BAD_SEQUENCE && score.count() == 0);
+
+  SIM_CHECK(sysexFeed(parser, sysexChunk(0, 2, 10)) == SYSEX_UPLOAD_CHUNK);
+  SIM_CHECK(parser.status() == SYSEX_OK && parser.sequence() == 0 && score.count() == 2);
+
+  // accusé perdu : le bloc 0 renvoyé est acquitté sans etre ajouté une deuxieme fois
+  SIM_CHECK(sysexFeed(parser, sysexChunk(0, 2, 10)) == SYSEX_UPLOAD_CHUNK);
+  SIM_CHECK(parser.status() == SYSEX_OK && score.count() == 2);
+
+  SIM_CHECK(sysexFeed(parser, sysexChunk(5, 1, 10)) == SYSEX_UPLOAD_CHUNK);
+  SIM_CHECK(parser.status() == SYSEX_BAD_SEQUENCE && score.count() == 2);
+
+  SIM_CHECK(sysexFeed(parser, sysexChunk(1, 3, 10)) == SYSEX_UPLOAD_CHUNK);
+  SIM_CHECK(parser.status() == SYSEX_OK && parser.sequence() == 1 && score.count() == 5);
+  SIM_CHECK(sysexFeed(parser, sysexCommand(SYSEX_UPLOAD_END)) == SYSEX_UPLOAD_END);
+
+  // nouveau chargement : partition vidée, sequence repartie de 0
+  sysexFeed(parser, sysexCommand(SYSEX_UPLOAD_BEGIN));
+  SIM_CHECK(score.count() == 0);
+  sysexFeed(parser, sysexChunk(1, 1, 10));
+  SIM_CHECK(parser.status() == SYSEX_BAD_SEQUENCE && score.count() == 0);
+}
+
+static void testCorruptChunks() {
+  Score score;
+  SysExParser parser(score);
+  sysexFeed(parser, sysexCommand(SYSEX_UPLOAD_BEGIN));
+
+  sysexFeed(parser, sysexChunk(0, 2, 10, 0x01));
+  SIM_CHECK(parser.status() == SYSEX_BAD_CHECKSUM && score.count() == 0);
+
+  // evenement incomplet : 3 octets apres la sequence, somme juste
+  std::vector<byte> chunk = {0xF0, SYSEX_MANUFACTURER_ID, SYSEX_DEVICE_ID, SYSEX_UPLOAD_CHUNK, 0, 10, 0, 60, 0 ^ 10 ^ 0 ^ 60, 0xF7};
+  sysexFeed(parser, chunk);
+  SIM_CHECK(parser.status() == SYSEX_BAD_LENGTH && score.count() == 0);
+
+  // message interrompu par un octet de statut : rien n'est gardé, le bloc peut etre renvoyé
+  std::vector<byte> cut = sysexChunk(0, 2, 10);
+  cut.resize(cut.size() - 4);
+  sysexFeed(parser, cut);
+  parser.feed(0x90);
+  SIM_CHECK(score.count() == 0);
+  sysexFeed(parser, sysexChunk(0, 2, 10));
+  SIM_CHECK(parser.status() == SYSEX_OK && score.count() == 2);
+}
+
+static void testFullScore() {
+  Score score;
+  SysExParser parser(score);
+  sysexFeed(parser, sysexCommand(SYSEX_UPLOAD_BEGIN));
+  byte sequence = 0;
+  while (score.count() + 8 <= SCORE_MAX_EVENTS) {
+    sysexFeed(parser, sysexChunk(sequence, 8, 10));
+    SIM_CHECK(parser.status() == SYSEX_OK);
+    sequence = (sequence + 1) & 0x7F;
+  }
+  uint16_t count = score.count();
+
+  // le bloc qui deborde est refusé en entier, la partition garde les blocs validés
+  sysexFeed(parser, sysexChunk(sequence, 8, 10));
+  SIM_CHECK(parser.status() == SYSEX_SCORE_FULL && score.count() == count);
+  if (count < SCORE_MAX_EVENTS) {
+    sysexFeed(parser, sysexChunk(sequence, SCORE_MAX_EVENTS - count, 10));
+    SIM_CHECK(parser.status() == SYSEX_OK && score.count() == SCORE_MAX_EVENTS);
+  }
+}
+
+// les echeances sont cumulées depuis le debut de la lecture, meme si next() est appelé en retard
+static void testPlaybackDeadlines() {
+  Score score;
+  SysExParser parser(score);
+  sysexFeed(parser, sysexCommand(SYSEX_UPLOAD_BEGIN));
+  sysexFeed(parser, sysexChunk(0, 3, 10));
+  score.play(1000);
+
+  ScoreEvent event;
+  unsigned long time;
+  SIM_CHECK(!score.next(10999, event, time));
+  SIM_CHECK(score.next(11000, event, time) && time == 11000 && event.note == INSTRUMENT_START_NOTE);
+  SIM_CHECK(score.next(25700, event, time) && time == 21000);    // boucle en retard de 4,7 ms
+  SIM_CHECK(score.next(50000, event, time) && time == 31000);    // le retard ne s'accumule pas
+  SIM_CHECK(!score.playing() && !score.next(60000, event, time));
+}
+
+int main() {
+  testSequence();
+  testCorruptChunks();
+  testFullScore();
+  testPlaybackDeadlines();
+  return simTestResult("sysex");
+}
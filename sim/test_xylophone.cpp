@@ -0,0 +1,409 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+-----------------------------------    TEST_XYLOPHONE.CPP    --------------------------------------------
+_________________________________________________________________________________________________________
+Chemin complet paquet USB-MIDI -> mcp23017 sur la carte simulée : heure d'allumage et de coupure
+des electroaimants, accords, notes repetées, all notes off, roulements et ecritures de la
+calibration en EEPROM. Compilé aussi avec
+VELOCITY_DWELL=true (test_xylophone_dwell) : durée de frappe de chaque note d'un accord.
+***********************************************************************************************************/
+
+#include "Sim.h"
+#include "SimTest.h"
+#include "MidiHandler.h"
+#include "CoilMap.h"
+
+struct Edge {
+  unsigned long time;
+  bool level;
+};
+
+// fronts de la sortie d'une lame, relus dans les trames acquittées vers son mcp
+static std::vector<Edge> coilEdges(byte slot) {
+  std::vector<Edge> edges;
+  const CoilOutput &output = COIL_MAP[slot];
+  bool level = false;
+  for (const SimI2cFrame &frame : simI2cFrames()) {
+    if (!frame.acked || frame.address != MCP_BASE_ADDR + output.bank || frame.data.size() != 3 || frame.data[0] != 0x12) {
+      continue;
+    }
+    bool state = ((frame.data[1] | (frame.data[2] << 8)) & output.mask) != 0;
+    if (state != level) {
+      Edge edge = {frame.time, state};
+      edges.push_back(edge);
+      level = state;
+    }
+  }
+  return edges;
+}
+
+// la boucle loop() du sketch jusqu'a l'heure indiquée
+static void runUntil(MidiHandler &midiHandler, unsigned long time) {
+  while ((long)(simTime() - time) < 0) {
+    midiHandler.handleMidiEvent();
+    midiHandler.update();
+  }
+}
+
+#if !VELOCITY_DWELL
+static void testSingleNote() {
+  simReset();
+  Xylophone xylophone;
+  MidiHandler midiHandler(xylophone);
+  midiHandler.begin();
+  unsigned long start = simTime() + 1000;
+  simMidiNoteOn(start, 0, INSTRUMENT_START_NOTE, 100);
+  runUntil(midiHandler, start + 100000UL);
+
+  std::vector<Edge> edges = coilEdges(0);
+  SIM_CHECK(edges.size() == 2);
+  if (edges.size() == 2) {
+    SIM_CHECK_NEAR(edges[0].time, start, 300);            // lecture USB + une trame I2C
+    SIM_CHECK_NEAR(edges[1].time - edges[0].time, TIME_HIT * 1000UL, 300);
+  }
+  SIM_CHECK(simPwmWrites().size() >= 2);
+  if (!simPwmWrites().empty()) {
+    SIM_CHECK(simPwmWrites().front().level == map(100, 0, 127, MIN_PWM_VALUE, 255));
+    SIM_CHECK(simPwm() == PWM_OFF_VALUE);                 // coupé avec la derniere note
+  }
+  SIM_CHECK(health.notesPlayed > 0);
+}
+
+static void testChord() {
+  simReset();
+  Xylophone xylophone;
+  MidiHandler midiHandler(xylophone);
+  midiHandler.begin();
+  unsigned long start = simTime() + 1000;
+  for (byte i = 0; i < 6; i++) {
+    simMidiNoteOn(start, 0, INSTRUMENT_START_NOTE + i, 100);
+  }
+  runUntil(midiHandler, start + 100000UL);
+
+  // COIL_STAGGER_GROUP notes dans la premiere trame, le reste COIL_STAGGER_US plus tard
+  unsigned long first = 0xFFFFFFFFUL;
+  unsigned long last = 0;
+  for (byte i = 0; i < 6; i++) {
+    std::vector<Edge> edges = coilEdges(i);
+    SIM_CHECK(edges.size() == 2);
+    if (edges.size() == 2) {
+      first = min(first, edges[0].time);
+      last = max(last, edges[0].time);
+      SIM_CHECK_NEAR(edges[1].time - edges[0].time, TIME_HIT * 1000UL, 300);
+    }
+  }
+  SIM_CHECK(last - first >= COIL_STAGGER_US);
+  SIM_CHECK(last - first < COIL_STAGGER_US + 500);
+  byte together = 0;
+  for (byte i = 0; i < 6; i++) {
+    std::vector<Edge> edges = coilEdges(i);
+    if (!edges.empty() && edges[0].time == first) {
+      together++;
+    }
+  }
+  SIM_CHECK(together == COIL_STAGGER_GROUP);
+}
+
+static void testRepeatedNote() {
+  simReset();
+  Xylophone xylophone;
+  MidiHandler midiHandler(xylophone);
+  midiHandler.begin();
+  unsigned long start = simTime() + 1000;
+  simMidiNoteOn(start, 0, INSTRUMENT_START_NOTE, 100);
+  simMidiNoteOn(start + 5000, 0, INSTRUMENT_START_NOTE, 100);   // pendant la frappe : gardée
+  runUntil(midiHandler, start + 200000UL);
+
+  std::vector<Edge> edges = coilEdges(0);
+  SIM_CHECK(edges.size() == 4);
+  if (edges.size() == 4) {
+    // refrappe a la fin du retour de la mailloche
+    SIM_CHECK_NEAR(edges[2].time - edges[1].time, STRIKE_RECOVERY * 1000UL, 300);
+  }
+}
+
+static void testAllNotesOff() {
+  simReset();
+  Xylophone xylophone;
+  MidiHandler midiHandler(xylophone);
+  midiHandler.begin();
+  unsigned long start = simTime() + 1000;
+  simMidiNoteOn(start, 0, INSTRUMENT_START_NOTE, 100);
+  simMidiControl(start + 5000, 0, 123, 0);
+  runUntil(midiHandler, start + 100000UL);
+
+  std::vector<Edge> edges = coilEdges(0);
+  SIM_CHECK(edges.size() == 2);
+  SIM_CHECK(simMcpOutputs(MCP_BASE_ADDR) == 0 && simMcpOutputs(MCP_BASE_ADDR + 1) == 0);
+  SIM_CHECK(xylophone.idle());
+}
+
+// all notes off coupe aussi une frappe plus longue que l'attente de reset(), et les notes d'un
+// accord pas encore admises ne partent pas apres
+static void testAllNotesOffLongStrike() {
+  simReset();
+  Xylophone xylophone;
+  MidiHandler midiHandler(xylophone);
+  midiHandler.begin();
+  xylophone.setHitTime(INSTRUMENT_START_NOTE, 100);
+  unsigned long start = simTime() + 1000;
+  simMidiNoteOn(start, 0, INSTRUMENT_START_NOTE, 100);
+  for (byte i = 1; i < 8; i++) {
+    simMidiNoteOn(start + 20000UL, 0, INSTRUMENT_START_NOTE + i, 100);
+  }
+  simMidiControl(start + 20000UL + COIL_STAGGER_US / 3, 0, 123, 0);
+  runUntil(midiHandler, start + 300000UL);
+
+  std::vector<Edge> edges = coilEdges(0);
+  SIM_CHECK(edges.size() == 2);
+  if (edges.size() == 2) {
+    SIM_CHECK_NEAR(edges[1].time, start + 20000UL + COIL_STAGGER_US / 3, 1000);
+  }
+  // la note 0 est encore alimentée : le premier groupe de l'accord s'y ajoute, le reste attendait
+  // le groupe suivant au moment du CC
+  byte struck = 0;
+  for (byte i = 1; i < 8; i++) {
+    std::vector<Edge> chordEdges = coilEdges(i);
+    SIM_CHECK(chordEdges.empty() || chordEdges.size() == 2);
+    struck += chordEdges.size() == 2;
+  }
+  SIM_CHECK(struck == COIL_STAGGER_GROUP);
+  SIM_CHECK(simMcpOutputs(MCP_BASE_ADDR) == 0 && simMcpOutputs(MCP_BASE_ADDR + 1) == 0);
+  SIM_CHECK(simPwm() == PWM_OFF_VALUE);
+  SIM_CHECK(xylophone.idle());
+}
+
+// coupure refusée HAL_I2C_RETRIES fois par le mcp : la trame est abandonnée, l'image est renvoyée
+static void testLostFrame() {
+  simReset();
+  Xylophone xylophone;
+  MidiHandler midiHandler(xylophone);
+  midiHandler.begin();
+  unsigned long start = simTime() + 1000;
+  simMidiNoteOn(start, 0, INSTRUMENT_START_NOTE, 100);
+  runUntil(midiHandler, start + 2000);
+  SIM_CHECK(simMcpOutputs(MCP_BASE_ADDR) != 0);
+  unsigned long failures = health.i2cFailures;
+  simI2cNack(MCP_BASE_ADDR, HAL_I2C_RETRIES);
+  runUntil(midiHandler, start + 100000UL);
+
+  SIM_CHECK(health.i2cFailures - failures == HAL_I2C_RETRIES);
+  std::vector<Edge> edges = coilEdges(0);
+  SIM_CHECK(edges.size() == 2);
+  if (edges.size() == 2) {
+    SIM_CHECK_NEAR(edges[1].time - edges[0].time, TIME_HIT * 1000UL, 1000);
+  }
+  SIM_CHECK(simMcpOutputs(MCP_BASE_ADDR) == 0);
+}
+
+// loop() bloquée pendant tout un accord : chaque electroaimant est coupé a son echeance par le
+// timer seul, sans attendre la derniere note ni le prochain update()
+static void testReleaseWithoutLoop() {
+  simReset();
+  Xylophone xylophone;
+  MidiHandler midiHandler(xylophone);
+  midiHandler.begin();
+  const byte hitTimes[3] = {5, 12, 40};
+  for (byte i = 0; i < 3; i++) {
+    xylophone.setHitTime(INSTRUMENT_START_NOTE + i, hitTimes[i]);
+  }
+  unsigned long start = simTime() + 1000;
+  for (byte i = 0; i < 3; i++) {
+    simMidiNoteOn(start, 0, INSTRUMENT_START_NOTE + i, 100);
+  }
+  runUntil(midiHandler, start + 2000);
+  health.maxDwellOvershoot = 0;   // mesuré quand la trame de coupure est posée par le timer
+  simAdvance(100000UL);           // plus aucun passage dans loop()
+
+  for (byte i = 0; i < 3; i++) {
+    std::vector<Edge> edges = coilEdges(i);
+    SIM_CHECK(edges.size() == 2);
+    if (edges.size() == 2) {
+      SIM_CHECK_NEAR(edges[1].time - edges[0].time, hitTimes[i] * 1000UL, 150);
+    }
+  }
+  SIM_CHECK(simMcpOutputs(MCP_BASE_ADDR) == 0);
+  SIM_CHECK(simPwm() == PWM_OFF_VALUE);
+  SIM_CHECK(health.maxDwellOvershoot > 0 && health.maxDwellOvershoot < 100);
+}
+
+// roulement armé pendant qu'une note est tenue, boucle irreguliere : les coups restent sur la grille
+// de la cadence (pas de derive) et la vélocité monte de (ROLL_SHAPE_CC - 64) / 8 par coup
+static void testRoll() {
+  simReset();
+  Xylophone xylophone;
+  MidiHandler midiHandler(xylophone);
+  midiHandler.begin();
+  const unsigned long period = 1000000UL / ROLL_MAX_RATE;
+  const byte strokes = 10;
+  unsigned long start = simTime() + 1000;
+  unsigned long armTime = start + 100000UL;
+  simMidiNoteOn(start, 0, INSTRUMENT_START_NOTE, 60);
+  simMidiControl(armTime - 1000, 0, ROLL_SHAPE_CC, 127);
+  simMidiControl(armTime, 0, ROLL_CC, 127);
+  simMidiNoteOff(armTime + strokes * period + period / 2, 0, INSTRUMENT_START_NOTE);
+  for (unsigned int i = 0; (long)(simTime() - (armTime + (strokes + 2) * period)) < 0; i++) {
+    midiHandler.handleMidiEvent();
+    midiHandler.update();
+    simAdvance((i * 337) % 900);  // loop() ralentie par le reste du sketch
+  }
+
+  std::vector<Edge> edges = coilEdges(0);
+  SIM_CHECK(edges.size() == 2 * (1 + strokes));
+  for (byte k = 1; k <= strokes && 2 * k < edges.size(); k++) {
+    SIM_CHECK_NEAR(edges[2 * k].time, armTime + k * period, 1100);
+  }
+  std::vector<int> pwm;
+  for (const SimPinWrite &write : simPwmWrites()) {
+    if (write.level != PWM_OFF_VALUE) {
+      pwm.push_back(write.level);
+    }
+  }
+  SIM_CHECK(pwm.size() == 1 + strokes);
+  for (byte k = 0; k < pwm.size(); k++) {
+    byte velocity = k == 0 ? 60 : 60 + (127 - 64) / 8 * (k - 1);
+    SIM_CHECK(pwm[k] == map(velocity, 0, 127, MIN_PWM_VALUE, 255));
+  }
+}
+
+// la meme lame frappée 200 ms a pleine puissance des qu'elle est prete : la frappe raccourcit a
+// partir de COIL_DERATE_START % de la limite, jusqu'a COIL_DERATE_MIN_HIT %, puis attend que la
+// bobine refroidisse ; la chaleur decroit ensuite en exp(-t / COIL_THERMAL_TAU)
+static void testThermal() {
+  simReset();
+  Xylophone xylophone;
+  xylophone.begin();
+  const byte hitTime = 200;
+  xylophone.setHitTime(INSTRUMENT_START_NOTE, hitTime);
+  std::vector<unsigned long> calls;
+  std::vector<Edge> edges;
+  do {
+    simAdvance(STRIKE_RECOVERY * 1000UL);
+    calls.push_back(simTime());
+    xylophone.strike(INSTRUMENT_START_NOTE, 255, hitTime);
+    do {
+      xylophone.update();
+      simAdvance(50);
+    } while (!xylophone.idle());
+    edges = coilEdges(0);
+  } while (calls.size() < 100 && edges.size() == 2 * calls.size() && edges[edges.size() - 2].time < calls.back() + 1000);
+
+  SIM_CHECK(edges.size() == 2 * calls.size());
+  if (edges.size() != 2 * calls.size()) {
+    return;
+  }
+  unsigned long previous = hitTime * 1000UL;
+  bool derated = false;
+  for (size_t k = 0; k < calls.size(); k++) {
+    unsigned long dwell = edges[2 * k + 1].time - edges[2 * k].time;
+    SIM_CHECK(dwell <= previous + 300);                     // jamais plus longue que la precedente
+    SIM_CHECK(dwell + 300 >= hitTime * 10UL * COIL_DERATE_MIN_HIT);
+    derated = derated || dwell + 1000 < hitTime * 1000UL;
+    previous = dwell;
+    if (k + 1 < calls.size()) {
+      SIM_CHECK_NEAR(edges[2 * k].time, calls[k], 300);      // pas d'attente avant la limite
+    }
+  }
+  SIM_CHECK_NEAR(edges[1].time - edges[0].time, hitTime * 1000UL, 300);
+  SIM_CHECK(derated);
+  SIM_CHECK(edges[edges.size() - 2].time > calls.back() + 1000);// la derniere a attendu
+  SIM_CHECK(xylophone.coilLoad(INSTRUMENT_START_NOTE) <= 100);
+
+  byte load = xylophone.coilLoad(INSTRUMENT_START_NOTE);
+  simAdvance(COIL_THERMAL_TAU * 1000UL);
+  SIM_CHECK_NEAR(xylophone.coilLoad(INSTRUMENT_START_NOTE), load * 0.3679f, 2);
+  SIM_CHECK(xylophone.coilLoad(INSTRUMENT_START_NOTE + 1) == 0);
+}
+
+// calibration lancée sur une EEPROM vierge : l'effacement des lames avance d'un octet par
+// passage sans bloquer loop(), l'en tete est ecrit en dernier, la premiere frappe attend la fin
+static void testCalibrationStore() {
+  simReset();
+  Xylophone xylophone;
+  MidiHandler midiHandler(xylophone);
+  midiHandler.begin();
+  unsigned long start = simTime() + 1000;
+  simMidiControl(start, 0, CALIBRATION_CC, 127);
+  runUntil(midiHandler, start + 100);
+  health.maxLoopTime = 0;
+  runUntil(midiHandler, start + 20000UL);
+
+  const byte *store = simStore();
+  const int records = CALIBRATION_STORE_ADDR + 4;
+  const int recordsEnd = records + INSTRUMENT_RANGE * sizeof(NoteCalibration);
+  SIM_CHECK(store[CALIBRATION_STORE_ADDR] == 0xFF);
+  SIM_CHECK(store[records] == 0 && store[records + 5] == 0 && store[records + 7] == 0xFF);
+  SIM_CHECK(health.maxLoopTime < 1000);
+
+  unsigned long wiped = start + (recordsEnd - CALIBRATION_STORE_ADDR) * SIM_EEPROM_WRITE_US;
+  runUntil(midiHandler, wiped + 10000UL);
+  SIM_CHECK(store[0] == 'X' && store[1] == 'C' && store[2] == 1 && store[3] == INSTRUMENT_RANGE);
+  bool zero = true;
+  for (int i = records; i < recordsEnd; i++) {
+    zero = zero && store[i] == 0;
+  }
+  SIM_CHECK(zero);
+  SIM_CHECK(coilEdges(0).empty());
+  SIM_CHECK(health.maxLoopTime < 1000);
+
+  runUntil(midiHandler, wiped + CALIBRATION_SETTLE * 1000UL + 100000UL);
+  std::vector<Edge> edges = coilEdges(0);
+  SIM_CHECK(!edges.empty());
+  if (!edges.empty()) {
+    SIM_CHECK_NEAR(edges[0].time, wiped + CALIBRATION_SETTLE * 1000UL, 10000);
+  }
+}
+
+#else
+// accord de vélocités differentes au meme PWM : chaque lame est alimentée DWELL_CURVE % de TIME_HIT
+static void testVelocityDwell() {
+  simReset();
+  Xylophone xylophone;
+  MidiHandler midiHandler(xylophone);
+  midiHandler.begin();
+  const byte velocities[COIL_STAGGER_GROUP] = {127, 90, 50, 10};
+  unsigned long start = simTime() + 1000;
+  for (byte i = 0; i < COIL_STAGGER_GROUP; i++) {
+    simMidiNoteOn(start, 0, INSTRUMENT_START_NOTE + i, velocities[i]);
+  }
+  runUntil(midiHandler, start + 100000UL);
+
+  const byte points = sizeof(DWELL_CURVE) / sizeof(DWELL_CURVE[0]);
+  for (byte i = 0; i < COIL_STAGGER_GROUP; i++) {
+    float position = velocities[i] * (points - 1) / 127.0f;
+    byte index = (byte)position;
+    float percent = DWELL_CURVE[index];
+    if (index + 1 < points) {
+      percent += (DWELL_CURVE[index + 1] - DWELL_CURVE[index]) * (position - index);
+    }
+    std::vector<Edge> edges = coilEdges(i);
+    SIM_CHECK(edges.size() == 2);
+    if (edges.size() == 2) {
+      SIM_CHECK_NEAR(edges[1].time - edges[0].time, TIME_HIT * 10.0f * percent, 300);
+    }
+  }
+  for (const SimPinWrite &write : simPwmWrites()) {
+    SIM_CHECK(write.level == DWELL_PWM || write.level == PWM_OFF_VALUE);
+  }
+}
+#endif
+
+int main() {
+#if VELOCITY_DWELL
+  testVelocityDwell();
+  return simTestResult("xylophone_dwell");
+#else
+  testSingleNote();
+  testChord();
+  testRepeatedNote();
+  testAllNotesOff();
+  testAllNotesOffLongStrike();
+  testLostFrame();
+  testReleaseWithoutLoop();
+  testRoll();
+  testThermal();
+  testCalibrationStore();
+  return simTestResult("xylophone");
+#endif
+}
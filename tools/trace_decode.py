@@ -0,0 +1,115 @@
+#!/usr/bin/env python3
+"""Decode les traces binaires de Trace.h envoyees sur le port serie.
+
+Trames de 10 octets : 0xA5, id, a, b (2 octets), heure en us (4 octets, poids faible d'abord),
+ou exclusif des octets 1 a 8. Les noms des identifiants sont lus dans l'enum TraceId de Trace.h :
+rien a mettre a jour ici quand un identifiant est ajoute.
+Le texte qui passe entre les trames (JSON de benchReport(), calibration...) est recopie tel quel.
+
+    python3 tools/trace_decode.py /dev/ttyACM0          (pyserial)
+    python3 tools/trace_decode.py capture.bin           (fichier enregistre)
+    cat /dev/ttyACM0 | python3 tools/trace_decode.py -
+"""
+
+import argparse
+import os
+import re
+import sys
+
+SYNC = 0xA5
+FRAME_SIZE = 10
+DEFAULT_HEADER = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'xylo', 'Trace.h')
+
+
+def read_names(header):
+    names = {}
+    in_enum = False
+    index = 0
+    with open(header, encoding='utf-8', errors='replace') as f:
+        for line in f:
+            if line.startswith('enum TraceId'):
+                in_enum = True
+                continue
+            if in_enum:
+                if line.startswith('}'):
+                    break
+                match = re.match(r'\s*(TRACE_\w+)\s*,\s*(?://\s*(.*))?', line)
+                if match:
+                    names[index] = (match.group(1)[len('TRACE_'):], (match.group(2) or '').strip())
+                    index += 1
+    return names
+
+
+def open_input(path, baud):
+    if path == '-':
+        return sys.stdin.buffer
+    if path.startswith('/dev/') or path.upper().startswith('COM'):
+        import serial  # pyserial, seulement pour lire directement le port
+        return serial.Serial(path, baud, timeout=None)
+    return open(path, 'rb')
+
+
+def decode(stream, names, out):
+    buffer = bytearray()
+    text = bytearray()
+    start = None
+    last = None
+    wraps = 0
+    previous = None
+
+    def flush_text():
+        if text:
+            out.write('# ' + text.decode('utf-8', errors='replace').rstrip('\r\n') + '\n')
+            text.clear()
+
+    while True:
+        chunk = stream.read(1) if hasattr(stream, 'in_waiting') else stream.read(4096)
+        if not chunk:
+            break
+        buffer += chunk
+        while buffer:
+            if buffer[0] != SYNC:
+                text.append(buffer.pop(0))
+                if text.endswith(b'\n'):
+                    flush_text()
+                continue
+            if len(buffer) < FRAME_SIZE:
+                break
+            frame = buffer[:FRAME_SIZE]
+            check = 0
+            for byte in frame[1:FRAME_SIZE - 1]:
+                check ^= byte
+            if check != frame[FRAME_SIZE - 1]:
+                text.append(buffer.pop(0))  # 0xA5 dans du texte (UTF-8) : pas une trame
+                continue
+            del buffer[:FRAME_SIZE]
+            flush_text()
+            ident, a = frame[1], frame[2]
+            b = frame[3] | frame[4] << 8
+            time = frame[5] | frame[6] << 8 | frame[7] << 16 | frame[8] << 24
+            # halMicros() deborde toutes les 71 minutes : heure deroulee
+            if previous is not None and time < previous and previous - time > 0x80000000:
+                wraps += 1
+            previous = time
+            time += wraps << 32
+            if start is None:
+                start = time
+            delta = '' if last is None else '+%d' % (time - last)
+            last = time
+            name, comment = names.get(ident, ('ID_%d' % ident, ''))
+            out.write('%12d %10s  %-12s a=%-4d b=%-6d  %s\n' % (time - start, delta, name, a, b, comment))
+        out.flush()
+    flush_text()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('input', help='port serie, fichier de capture, ou - pour stdin')
+    parser.add_argument('--baud', type=int, default=115200)
+    parser.add_argument('--header', default=DEFAULT_HEADER, help='Trace.h qui donne les noms des identifiants')
+    args = parser.parse_args()
+    decode(open_input(args.input, args.baud), read_names(args.header), sys.stdout)
+
+
+if __name__ == '__main__':
+    main()
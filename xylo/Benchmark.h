@@ -0,0 +1,56 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+---------------------------------------     BENCHMARK.H    ----------------------------------------------
+_________________________________________________________________________________________________________
+Mesures de latence et de gigue entre la reception MIDI et l'electroaimant
+
+Si BENCHMARK_ENABLED est a true dans settings.h, MidiHandler et Xylophone notent les instants
+(horloge halMicros()) de :
+  - reception du message note on         -> benchNoteReceived()
+  - ecriture effective de la sortie mcp  -> benchCoilOn()
+  - coupure de l'electroaimant           -> benchCoilOff()
+et remplissent trois histogrammes :
+  - latency_us     : reception -> electroaimant alimenté
+  - dwell_error_us : coupure reelle - echeance demandée (TIME_HIT)
+  - jitter_us      : ecart entre l'intervalle de sortie et l'intervalle d'entrée de deux notes successives
+
+benchReport() envoie sur Serial une ligne JSON par histogramme (count, p50, p99, max et les
+classes non vides) : le meme format sert pour les mesures sur la carte et en simulation
+(sim/test_benchmark.cpp). MidiHandler::benchmark() injecte ses charges dans la reception MIDI.
+Les classes sont logarithmiques (4 par octave) de 1µs a 131ms.
+Avec BENCHMARK_ENABLED a false les appels sont supprimés a la compilation.
+***********************************************************************************************************/
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <Arduino.h>
+#include "settings.h"
+
+#define BENCH_BUCKETS 64
+
+class LatencyHistogram {
+public:
+  LatencyHistogram();
+  void reset();
+  void add(unsigned long us);
+  unsigned long percentile(byte p) const;// borne haute de la classe contenant le percentile p
+  void report(const char* workload, const char* metric) const;// une ligne JSON sur Serial
+
+private:
+  uint16_t _buckets[BENCH_BUCKETS];
+  uint16_t _count;
+  unsigned long _max;
+  static byte bucketOf(unsigned long us);
+  static unsigned long bucketLow(byte index);
+  static unsigned long bucketHigh(byte index);
+};
+
+void benchReset();
+void benchNoteReceived(byte slot, unsigned long time);
+void benchCoilOn(byte slot, unsigned long time);
+void benchCoilOff(byte slot, unsigned long time, unsigned long deadline);
+void benchReport(const char* workload);
+
+#endif // BENCHMARK_H
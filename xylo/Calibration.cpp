@@ -0,0 +1,240 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+-------------------------------------    CALIBRATION.CPP    ---------------------------------------------
+_________________________________________________________________________________________________________
+Balayage des durées et des PWM de chaque lame, enregistrement et application des resultats
+
+***********************************************************************************************************/
+
+#include "Calibration.h"
+
+#define CALIBRATION_DWELL_COUNT sizeof(CALIBRATION_DWELLS)
+
+// en tete de la zone enregistrée : change si le format ou le nombre de lames change
+static const byte calibrationHeader[] = { 'X', 'C', 1, INSTRUMENT_RANGE };
+static_assert(CALIBRATION_STORE_ADDR + sizeof(calibrationHeader) + INSTRUMENT_RANGE * sizeof(NoteCalibration) <= HAL_STORE_SIZE,
+              "la calibration de INSTRUMENT_RANGE lames depasse la memoire HAL_STORE_SIZE");
+
+Calibration::Calibration(Xylophone &xylophone) : _xylophone(xylophone), _state(IDLE), _storeAddress(0),
+                                                  _storeEnd(0), _storeWipe(false) {
+}
+
+// ----------------------------------      PUBLIC  --------------------------------------------
+
+void Calibration::begin() {
+  byte header[sizeof(calibrationHeader)];
+  halStoreRead(CALIBRATION_STORE_ADDR, header, sizeof(header));
+  if (memcmp(header, calibrationHeader, sizeof(header)) != 0) {
+    return;                       // jamais calibré : reglages de settings.h
+  }
+  for (byte i = 0; i < INSTRUMENT_RANGE; i++) {
+    NoteCalibration calibration;
+    halStoreRead(recordAddress(i), (byte *)&calibration, sizeof(calibration));
+    if (calibration.valid == 1) {
+      apply(i, calibration);
+    }
+  }
+}
+
+void Calibration::start(unsigned long now) {
+  byte header[sizeof(calibrationHeader)];
+  halStoreRead(CALIBRATION_STORE_ADDR, header, sizeof(header));
+  if (memcmp(header, calibrationHeader, sizeof(header)) != 0) {
+    // premiere calibration (ou format changé) : aucune lame valide
+    _storeWipe = true;
+    _storeAddress = recordAddress(0);
+    _storeEnd = recordAddress(INSTRUMENT_RANGE);
+    storeUpdate();
+  }
+  _note = 0;
+  _step = 0;
+  _levelFit.reset();
+  _latencyFit.reset();
+  _lastSample = now;
+  _state = STORE;                 // la premiere lame attend la fin de l'effacement
+  Serial.println(F("calibration : debut"));
+}
+
+void Calibration::stop() {
+  if (_state != IDLE) {
+    _state = IDLE;
+    Serial.println(F("calibration : arretée"));
+  }
+}
+
+void Calibration::update(unsigned long now) {
+  storeUpdate();                  // meme arretée : la derniere lame finit de s'enregistrer
+  if (_state == STORE) {
+    if (_storeAddress == _storeEnd) {
+      settle();                   // now est anterieur au debut de l'attente : rien a echantillonner
+    }
+    return;
+  }
+  if (_state == IDLE || now - _lastSample < CALIBRATION_SAMPLE_INTERVAL) {
+    return;
+  }
+  _lastSample = now;
+  int sample = halPickupRead();
+  unsigned long elapsed = now - _stepTime;
+
+  if (_state == SETTLE) {
+    if (elapsed >= CALIBRATION_SETTLE * 1000UL) {
+      strike();
+    } else if (elapsed >= CALIBRATION_SETTLE * 500UL) {
+      _envelope.baseline(sample); // seconde moitié seulement : la frappe precedente s'est tue
+    }
+  } else {
+    _envelope.feed(elapsed, sample);
+    if (elapsed >= CALIBRATION_WINDOW * 1000UL) {
+      endStep();
+    }
+  }
+}
+
+// ----------------------------------      PRIVATE  --------------------------------------------
+
+//*********************************************************************************************
+//******************          SWEEP OF A BAR
+
+// etapes 0 .. CALIBRATION_DWELL_COUNT - 1 : PWM maximum, puis CALIBRATION_PWM_STEPS PWM croissants
+int Calibration::stepPwm() const {
+  if (_step < CALIBRATION_DWELL_COUNT) {
+    return 255;
+  }
+  byte i = _step - CALIBRATION_DWELL_COUNT;
+  return CALIBRATION_PWM_START + (255 - CALIBRATION_PWM_START) * i / (CALIBRATION_PWM_STEPS - 1);
+}
+
+void Calibration::settle() {
+  _state = SETTLE;
+  _stepTime = halMicros();
+  _envelope.reset(CALIBRATION_THRESHOLD);
+}
+
+void Calibration::strike() {
+  byte dwell = _step < CALIBRATION_DWELL_COUNT ? pgm_read_byte(&CALIBRATION_DWELLS[_step]) : _dwell;
+  _state = LISTEN;
+  _stepTime = halMicros();        // la latence est comptée depuis la commande, comme pour scheduleNote()
+  _xylophone.strike(INSTRUMENT_START_NOTE + _note, stepPwm(), dwell);
+  _xylophone.update();            // ecrit la sortie sans attendre le prochain passage
+}
+
+void Calibration::endStep() {
+  if (_step < CALIBRATION_DWELL_COUNT) {
+    _dwellPeaks[_step] = _envelope.detected() ? _envelope.peak() : 0;
+  } else if (_envelope.detected()) {
+    _levelFit.add(stepPwm(), _envelope.peak());
+    _latencyFit.add(stepPwm(), _envelope.onset());
+  }
+  _step++;
+
+  if (_step == CALIBRATION_DWELL_COUNT) {
+    byte dwells[CALIBRATION_DWELL_COUNT];   // copie en RAM de la table en flash
+    for (byte i = 0; i < CALIBRATION_DWELL_COUNT; i++) {
+      dwells[i] = pgm_read_byte(&CALIBRATION_DWELLS[i]);
+    }
+    _dwell = calibrationDwell(_dwellPeaks, dwells, CALIBRATION_DWELL_COUNT, CALIBRATION_DWELL_TOLERANCE);
+    if (_dwell == 0) {
+      endNote();                  // rien entendu : lame ou capteur absent
+      return;
+    }
+  }
+  if (_step == CALIBRATION_DWELL_COUNT + CALIBRATION_PWM_STEPS) {
+    endNote();
+    return;
+  }
+  settle();
+}
+
+void Calibration::endNote() {
+  NoteCalibration calibration = {};
+  calibration.hitTime = _dwell;
+  calibration.valid = _dwell != 0
+                      && _levelFit.solve(calibration.levelOffset, calibration.levelSlope)
+                      && _latencyFit.solve(calibration.latencyOffset, calibration.latencySlope);
+  report(_note, calibration);
+  if (calibration.valid) {
+    _storeRecord = calibration;   // valid est le dernier champ : ecrit en dernier
+    _storeAddress = recordAddress(_note);
+    _storeEnd = _storeAddress + sizeof(NoteCalibration);
+    storeUpdate();
+    apply(_note, calibration);
+  }
+
+  _note++;
+  _step = 0;
+  _levelFit.reset();
+  _latencyFit.reset();
+  if (_note == INSTRUMENT_RANGE) {
+    _state = IDLE;
+    Serial.println(F("calibration : terminée"));
+    return;
+  }
+  _state = STORE;
+}
+
+//*********************************************************************************************
+//******************          RESULTS
+
+void Calibration::apply(byte noteIndex, const NoteCalibration &calibration) {
+  byte note = INSTRUMENT_START_NOTE + noteIndex;
+  int minPwm = calibrationMinPwm(calibration, CALIBRATION_MIN_LEVEL, MIN_PWM_VALUE);
+  _xylophone.setHitTime(note, calibration.hitTime);
+  _xylophone.setMinPwm(note, minPwm);
+  // latence au PWM du milieu de chaque tranche de vélocité, avec la meme loi que playNote()
+  for (byte bucket = 0; bucket < STRIKE_VELOCITY_BUCKETS; bucket++) {
+    byte velocity = (2 * bucket + 1) * 64 / STRIKE_VELOCITY_BUCKETS;
+    int pwm = map(velocity, 0, 127, minPwm, 255);
+    unsigned long latency = calibrationLatency(calibration, pwm) / STRIKE_LATENCY_UNIT;
+    _xylophone.setStrikeLatency(note, bucket, min(latency, 255UL));
+  }
+}
+
+int Calibration::recordAddress(byte noteIndex) const {
+  return CALIBRATION_STORE_ADDR + sizeof(calibrationHeader) + noteIndex * sizeof(NoteCalibration);
+}
+
+// octet a ecrire en _storeAddress : en tete, zero d'une lame effacée ou resultat de la lame
+byte Calibration::storeByte() const {
+  if (_storeAddress < recordAddress(0)) {
+    return calibrationHeader[_storeAddress - CALIBRATION_STORE_ADDR];
+  }
+  if (_storeWipe) {
+    return 0;
+  }
+  return ((const byte *)&_storeRecord)[_storeAddress - (_storeEnd - (int)sizeof(NoteCalibration))];
+}
+
+// AVR : s'arrete au premier octet modifié (halStoreWrite() refuse tant qu'il se programme), la
+// suite part aux passages suivants ; ESP32 : tout d'un coup, en RAM
+void Calibration::storeUpdate() {
+  while (_storeAddress != _storeEnd && halStoreWrite(_storeAddress, storeByte())) {
+    _storeAddress++;
+    if (_storeAddress == _storeEnd && _storeWipe) {
+      // lames effacées : l'en tete en dernier, une coupure pendant l'effacement le laisse invalide
+      _storeWipe = false;
+      _storeAddress = CALIBRATION_STORE_ADDR;
+      _storeEnd = recordAddress(0);
+    }
+  }
+}
+
+// une ligne JSON par lame sur Serial, comme benchReport()
+void Calibration::report(byte noteIndex, const NoteCalibration &calibration) {
+  Serial.print(F("{\"calibration\":"));
+  Serial.print(INSTRUMENT_START_NOTE + noteIndex);
+  Serial.print(F(",\"valid\":"));
+  Serial.print(calibration.valid);
+  Serial.print(F(",\"hitTime\":"));
+  Serial.print(calibration.hitTime);
+  Serial.print(F(",\"level\":["));
+  Serial.print(calibration.levelOffset);
+  Serial.print(F(","));
+  Serial.print(calibration.levelSlope);
+  Serial.print(F("],\"latency\":["));
+  Serial.print(calibration.latencyOffset);
+  Serial.print(F(","));
+  Serial.print(calibration.latencySlope);
+  Serial.println(F("]}"));
+}
@@ -0,0 +1,125 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+-----------------------------------    CALIBRATIONFIT.CPP    --------------------------------------------
+_________________________________________________________________________________________________________
+Detection d'enveloppe et ajustements de la calibration automatique
+
+***********************************************************************************************************/
+
+#include "CalibrationFit.h"
+
+//*********************************************************************************************
+//******************          ENVELOPE OF THE PICKUP SIGNAL
+
+EnvelopeDetector::EnvelopeDetector() {
+  reset(0);
+}
+
+void EnvelopeDetector::reset(int threshold) {
+  _sum = 0;
+  _count = 0;
+  _threshold = threshold;
+  _detected = false;
+  _onset = 0;
+  _peak = 0;
+  _lastElapsed = 0;
+  _lastLevel = 0;
+}
+
+void EnvelopeDetector::baseline(int sample) {
+  _sum += sample;
+  _count++;
+}
+
+void EnvelopeDetector::feed(unsigned long elapsed, int sample) {
+  int rest = _count > 0 ? _sum / (long)_count : 0;
+  int level = abs(sample - rest);   // le piezo oscille autour du repos : on prend l'ecart
+  if (level > _peak) {
+    _peak = level;
+  }
+  if (!_detected && level >= _threshold) {
+    _detected = true;
+    _onset = elapsed;
+    if (_lastLevel < _threshold && level > _lastLevel && elapsed > _lastElapsed) {
+      // passage du seuil interpolé entre l'echantillon precedent et celui ci
+      _onset = _lastElapsed + (unsigned long)((float)(elapsed - _lastElapsed) * (_threshold - _lastLevel) / (level - _lastLevel));
+    }
+  }
+  _lastElapsed = elapsed;
+  _lastLevel = level;
+}
+
+//*********************************************************************************************
+//******************          LEAST SQUARES LINE
+
+LinearFit::LinearFit() {
+  reset();
+}
+
+void LinearFit::reset() {
+  _count = 0;
+  _sx = 0;
+  _sy = 0;
+  _sxx = 0;
+  _sxy = 0;
+}
+
+void LinearFit::add(float x, float y) {
+  _count++;
+  _sx += x;
+  _sy += y;
+  _sxx += x * x;
+  _sxy += x * y;
+}
+
+bool LinearFit::solve(float &offset, float &slope) const {
+  float det = _count * _sxx - _sx * _sx;
+  if (_count < 2 || det <= 0) {
+    return false;
+  }
+  slope = (_count * _sxy - _sx * _sy) / det;
+  offset = (_sy - slope * _sx) / _count;
+  return true;
+}
+
+//*********************************************************************************************
+//******************          SETTINGS OF A BAR
+
+uint8_t calibrationDwell(const int *peaks, const uint8_t *dwells, uint8_t count, uint8_t tolerance) {
+  int best = 0;
+  for (uint8_t i = 0; i < count; i++) {
+    if (peaks[i] > best) {
+      best = peaks[i];
+    }
+  }
+  if (best == 0) {
+    return 0;
+  }
+  uint8_t dwell = 0;
+  for (uint8_t i = 0; i < count; i++) {
+    if ((long)peaks[i] * 100 >= (long)best * (100 - tolerance) && (dwell == 0 || dwells[i] < dwell)) {
+      dwell = dwells[i];
+    }
+  }
+  return dwell;
+}
+
+int calibrationMinPwm(const NoteCalibration &calibration, int level, int fallback) {
+  if (calibration.levelSlope <= 0) {
+    return fallback;
+  }
+  float pwm = (level - calibration.levelOffset) / calibration.levelSlope;
+  if (pwm < 0) {
+    return 0;
+  }
+  if (pwm > 255) {
+    return 255;
+  }
+  return (int)(pwm + 0.5f);
+}
+
+unsigned long calibrationLatency(const NoteCalibration &calibration, int pwm) {
+  float latency = calibration.latencyOffset + calibration.latencySlope * pwm;
+  return latency > 0 ? (unsigned long)(latency + 0.5f) : 0;
+}
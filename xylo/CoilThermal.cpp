@@ -0,0 +1,79 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+-------------------------------------    COILTHERMAL.CPP    ---------------------------------------------
+_________________________________________________________________________________________________________
+Echauffement de chaque electroaimant
+
+***********************************************************************************************************/
+
+#include "CoilThermal.h"
+#include <math.h>
+
+// chaleur tolérée en ms de frappe a pleine puissance
+#define COIL_HEAT_LIMIT ((float)COIL_DUTY_LIMIT * COIL_THERMAL_TAU / 100)
+
+static float strikeHeat(unsigned long dwell, byte pwm) {
+  float power = pwm / 255.0f;
+  return dwell / 1000.0f * power * power;
+}
+
+CoilThermal::CoilThermal() : _time(0) {
+  clear();
+}
+
+void CoilThermal::clear() {
+  for (byte i = 0; i < INSTRUMENT_RANGE; i++) {
+    _heat[i] = 0;
+  }
+}
+
+void CoilThermal::cool(unsigned long now) {
+  unsigned long elapsed = now - _time;
+  if (elapsed < 1000) {
+    return;                       // moins d'une ms : on garde l'ancienne date, rien ne se perd
+  }
+  _time = now;
+  float factor = exp(-(float)elapsed / (COIL_THERMAL_TAU * 1000.0f));
+  for (byte i = 0; i < INSTRUMENT_RANGE; i++) {
+    _heat[i] *= factor;
+  }
+}
+
+void CoilThermal::heat(byte slot, unsigned long dwell, byte pwm) {
+  if (slot < INSTRUMENT_RANGE) {
+    _heat[slot] += strikeHeat(dwell, pwm);
+  }
+}
+
+unsigned long CoilThermal::allow(byte slot, unsigned long dwell, byte pwm, unsigned long &wait) const {
+  wait = 0;
+  if (slot >= INSTRUMENT_RANGE) {
+    return dwell;
+  }
+  float heat = _heat[slot];
+  float load = heat * 100 / COIL_HEAT_LIMIT;
+
+  // frappe plus courte en approchant de la limite
+  if (load > COIL_DERATE_START) {
+    float excess = min((load - COIL_DERATE_START) / (100 - COIL_DERATE_START), 1.0f);
+    float scale = 1 - excess * (100 - COIL_DERATE_MIN_HIT) / 100;
+    dwell = max(1UL, (unsigned long)(dwell * scale + 0.5f));
+  }
+
+  // meme raccourcie elle depasserait la limite : attendre que la bobine ait assez refroidi
+  float room = COIL_HEAT_LIMIT - strikeHeat(dwell, pwm);
+  if (heat > room) {
+    room = max(room, COIL_HEAT_LIMIT / 2);// frappe plus chaude que la limite : reglages incoherents
+    wait = (unsigned long)(COIL_THERMAL_TAU * 1000.0f * log(heat / room)) + 1;
+  }
+  return dwell;
+}
+
+byte CoilThermal::load(byte slot) const {
+  if (slot >= INSTRUMENT_RANGE) {
+    return 0;
+  }
+  float load = _heat[slot] * 100 / COIL_HEAT_LIMIT;
+  return load >= 255 ? 255 : (byte)(load + 0.5f);
+}
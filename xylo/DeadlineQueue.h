@@ -0,0 +1,135 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+------------------------------------     DEADLINEQUEUE.H    ---------------------------------------------
+_________________________________________________________________________________________________________
+File d'echeances triée (tas binaire minimum) pour les electroaimants.
+Chaque entrée associe un numero de slot (0..N-1) a une echeance en µs (micros()).
+Le prochain electroaimant a traiter est toujours en tete : un passage ne touche que les slots
+dont l'echeance est arrivée, quel que soit le nombre de notes de l'instrument.
+
+Un slot est present au plus une fois : push() sur un slot deja present met a jour son echeance.
+Les comparaisons se font par difference signée pour supporter le debordement de micros().
+***********************************************************************************************************/
+
+#ifndef DEADLINE_QUEUE_H
+#define DEADLINE_QUEUE_H
+
+#include <Arduino.h>
+
+template <byte N>
+class DeadlineQueue {
+public:
+  static const byte NONE = 0xFF;
+
+  DeadlineQueue() : _size(0) {
+    for (byte i = 0; i < N; i++) {
+      _pos[i] = NONE;
+    }
+  }
+
+  bool empty() const { return _size == 0; }
+  byte size() const { return _size; }
+  bool contains(byte slot) const { return _pos[slot] != NONE; }
+  byte topSlot() const { return _heap[0]; }
+  unsigned long topTime() const { return _time[_heap[0]]; }
+
+  // vrai si l'echeance de tete est passée a l'instant now
+  bool due(unsigned long now) const {
+    return _size > 0 && (long)(now - _time[_heap[0]]) >= 0;
+  }
+
+  // ajoute le slot ou met a jour son echeance
+  void push(byte slot, unsigned long time) {
+    _time[slot] = time;
+    if (_pos[slot] == NONE) {
+      _heap[_size] = slot;
+      _pos[slot] = _size;
+      _size++;
+      siftUp(_pos[slot]);
+    } else {
+      siftUp(_pos[slot]);
+      siftDown(_pos[slot]);
+    }
+  }
+
+  // retire et renvoie le slot de tete
+  byte pop() {
+    byte slot = _heap[0];
+    remove(slot);
+    return slot;
+  }
+
+  void remove(byte slot) {
+    byte i = _pos[slot];
+    if (i == NONE) {
+      return;
+    }
+    _size--;
+    _pos[slot] = NONE;
+    if (i != _size) {
+      byte moved = _heap[_size];
+      _heap[i] = moved;
+      _pos[moved] = i;
+      siftUp(i);
+      siftDown(_pos[moved]);
+    }
+  }
+
+  void clear() {
+    for (byte i = 0; i < _size; i++) {
+      _pos[_heap[i]] = NONE;
+    }
+    _size = 0;
+  }
+
+private:
+  unsigned long _time[N]; // echeance par slot
+  byte _heap[N];          // slots ordonnés en tas
+  byte _pos[N];           // position de chaque slot dans _heap (NONE si absent)
+  byte _size;
+
+  bool before(byte a, byte b) const {
+    return (long)(_time[_heap[a]] - _time[_heap[b]]) < 0;
+  }
+
+  void swap(byte a, byte b) {
+    byte tmp = _heap[a];
+    _heap[a] = _heap[b];
+    _heap[b] = tmp;
+    _pos[_heap[a]] = a;
+    _pos[_heap[b]] = b;
+  }
+
+  void siftUp(byte i) {
+    while (i > 0) {
+      byte parent = (i - 1) / 2;
+      if (!before(i, parent)) {
+        break;
+      }
+      swap(i, parent);
+      i = parent;
+    }
+  }
+
+  void siftDown(byte i) {
+    while (true) {
+      unsigned int left = 2 * i + 1;
+      unsigned int right = left + 1;
+      byte smallest = i;
+      if (left < _size && before(left, smallest)) {
+        smallest = left;
+      }
+      if (right < _size && before(right, smallest)) {
+        smallest = right;
+      }
+      if (smallest == i) {
+        break;
+      }
+      swap(i, smallest);
+      i = smallest;
+    }
+  }
+};
+
+#endif // DEADLINE_QUEUE_H
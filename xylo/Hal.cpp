@@ -0,0 +1,302 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+------------------------------------------     HAL.CPP     ----------------------------------------------
+_________________________________________________________________________________________________________
+Couche d'abstraction materielle - Version Arduino Leonardo (AVR)
+
+***********************************************************************************************************/
+
+#include "Hal.h"
+#include "Health.h"
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <EEPROM.h>
+#include <SPI.h>
+
+// Timer1 en mode CTC avec un prescaler de 64 : 4µs par tick a 16MHz, 262ms max par programmation
+#define HAL_TIMER_US_PER_TICK (64 / (F_CPU / 1000000UL))
+#define HAL_TIMER_MAX_US (65535UL * HAL_TIMER_US_PER_TICK)
+#define HAL_TIMER_MIN_US 16
+
+// TWI par interruption, sans Wire : Wire attend la fin de chaque transfert et definit deja
+// l'interruption TWI_vect. Bits de TWBR pour HAL_I2C_FREQ (prescaler 1), au moins 10 en maitre
+#define HAL_TWI_BITRATE ((F_CPU / HAL_I2C_FREQ - 16) / 2)
+static_assert(HAL_TWI_BITRATE >= 10 && HAL_TWI_BITRATE <= 255, "HAL_I2C_FREQ hors de portée du TWI");
+// attente maximale de halI2cSync() : le double d'une trame pleine par carte avec tous ses essais.
+// Au dela le bus est bloqué (SDA tenu a LOW, carte debranchée sans pull-up)
+#define HAL_I2C_SYNC_TIMEOUT (2UL * COIL_EXPANDERS * HAL_I2C_RETRIES * (HAL_I2C_FRAME_MAX + 2) * 9 * 1000000UL / HAL_I2C_FREQ)
+
+// registres du mcp23017 (IOCON.BANK = 0 : A puis B a la suite)
+#define HAL_MCP_IODIR 0x00
+#define HAL_MCP_GPIO 0x12
+
+static byte halMcpAddress[COIL_EXPANDERS];
+// une trame en attente par carte, la plus recente remplace la precedente
+static byte halTwiAddress[COIL_EXPANDERS];
+static byte halTwiFrame[COIL_EXPANDERS][HAL_I2C_FRAME_MAX];
+static byte halTwiLength[COIL_EXPANDERS];
+static volatile byte halTwiPendingMask = 0;
+static volatile bool halTwiBusy = false;
+static volatile bool halTwiFailed = false;  // une carte n'a pas acquitté depuis le dernier halI2cSync()
+static volatile byte halTwiLost = 0;        // cartes dont une trame a été abandonnée (halI2cLost())
+// transfert en cours, touché seulement par l'interruption TWI une fois demarré
+static byte halTwiIndex;
+static byte halTwiBytes[HAL_I2C_FRAME_MAX];
+static byte halTwiCount;
+static byte halTwiStep;
+static byte halTwiRetries[COIL_EXPANDERS];
+static void (*halTimerCallback)() = nullptr;
+static uint8_t halSavedSREG;
+static uint8_t halLockDepth = 0;
+
+ISR(TIMER1_COMPA_vect) {
+  TCCR1B = 0;                     // one shot : le callback reprogramme si besoin
+  if (halTimerCallback) {
+    halTimerCallback();
+  }
+}
+
+//*********************************************************************************************
+//******************             INITIALISE THE HARDWARE
+
+void halBegin() {
+  // TWI a HAL_I2C_FREQ, pull-ups internes comme Wire (les resistances du bus restent conseillées)
+  digitalWrite(SDA, HIGH);
+  digitalWrite(SCL, HIGH);
+  TWSR = 0;
+  TWBR = HAL_TWI_BITRATE;
+  TWCR = _BV(TWEN);
+  pinMode(PWM_PIN, OUTPUT);// Définition de la broche PWM en tant que SORTIE
+}
+
+unsigned long halMicros() {
+  return micros();
+}
+
+//*********************************************************************************************
+//******************             CRITICAL SECTIONS
+
+void halLock() {
+  uint8_t sreg = SREG;
+  cli();
+  if (halLockDepth++ == 0) {
+    halSavedSREG = sreg;
+  }
+}
+
+void halUnlock() {
+  if (--halLockDepth == 0) {
+    SREG = halSavedSREG;
+  }
+}
+
+//*********************************************************************************************
+//******************             PWM OF THE MAGNETS
+
+void halPwmWrite(int value) {
+  analogWrite(PWM_PIN, value);
+}
+
+//*********************************************************************************************
+//******************             RELEASE TIMER (TIMER1)
+
+void halTimerBegin(void (*callback)()) {
+  halLock();
+  halTimerCallback = callback;
+  // Timer1 arreté, interruption compare match A autorisée (demarré par halTimerArm)
+  TCCR1A = 0;
+  TCCR1B = 0;
+  TIMSK1 = _BV(OCIE1A);
+  halUnlock();
+}
+
+void halTimerArm(unsigned long delayUs) {
+  if (delayUs < HAL_TIMER_MIN_US) {
+    delayUs = HAL_TIMER_MIN_US;
+  } else if (delayUs > HAL_TIMER_MAX_US) {
+    delayUs = HAL_TIMER_MAX_US;  // le callback reprogrammera la suite
+  }
+  halLock();
+  TCCR1B = 0;
+  TCNT1 = 0;
+  OCR1A = delayUs / HAL_TIMER_US_PER_TICK - 1;
+  TIFR1 = _BV(OCF1A);             // efface un compare match en attente
+  TCCR1B = _BV(WGM12) | _BV(CS11) | _BV(CS10);// CTC, prescaler 64
+  halUnlock();
+}
+
+void halTimerStop() {
+  TCCR1B = 0;
+}
+
+//*********************************************************************************************
+//******************             I2C OUTPUTS (INTERRUPT DRIVEN TWI)
+
+// demarre l'ecriture en attente suivante, sous halLock() ou depuis l'interruption TWI
+static void halTwiNext() {
+  if (halTwiPendingMask == 0) {
+    halTwiBusy = false;
+    return;
+  }
+  halTwiIndex = 0;
+  while (!(halTwiPendingMask & (1 << halTwiIndex))) {
+    halTwiIndex++;
+  }
+  halTwiPendingMask &= ~(1 << halTwiIndex);
+  halTwiCount = halTwiLength[halTwiIndex];
+  memcpy(halTwiBytes, halTwiFrame[halTwiIndex], halTwiCount);
+  halTwiStep = 0;
+  halTwiBusy = true;
+  health.i2cWrites++;
+  TWCR = _BV(TWINT) | _BV(TWSTA) | _BV(TWEN) | _BV(TWIE);
+}
+
+static void halTwiStop() {
+  TWCR = _BV(TWINT) | _BV(TWSTO) | _BV(TWEN);
+  while (TWCR & _BV(TWSTO)) {}    // quelques µs, avant de pouvoir redemarrer
+}
+
+void halI2cWrite(byte index, byte address, const byte *data, byte length) {
+  halLock();
+  halTwiAddress[index] = address;
+  memcpy(halTwiFrame[index], data, length);
+  halTwiLength[index] = length;
+  halTwiPendingMask |= 1 << index;
+  if (!halTwiBusy) {
+    halTwiNext();
+  }
+  halUnlock();
+}
+
+// START, adresse, octets de la trame, STOP : une interruption par octet
+ISR(TWI_vect) {
+  switch (TWSR & 0xF8) {
+    case 0x08: // START envoyé
+      TWDR = halTwiAddress[halTwiIndex] << 1;
+      TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE);
+      return;
+    case 0x18: // adresse acquittée
+    case 0x28: // octet acquitté
+      if (halTwiStep < halTwiCount) {
+        TWDR = halTwiBytes[halTwiStep++];
+        TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE);
+        return;
+      }
+      halTwiStop();
+      halTwiRetries[halTwiIndex] = 0;
+      break;
+    default:   // pas d'acquittement, arbitrage perdu ou erreur de bus
+      halTwiStop();
+      health.i2cFailures++;
+      halTwiFailed = true;
+      if (++halTwiRetries[halTwiIndex] < HAL_I2C_RETRIES && !(halTwiPendingMask & (1 << halTwiIndex))) {
+        memcpy(halTwiFrame[halTwiIndex], halTwiBytes, halTwiCount);// refaite, sauf si une trame plus recente attend
+        halTwiLength[halTwiIndex] = halTwiCount;
+        halTwiPendingMask |= 1 << halTwiIndex;
+      } else {
+        if (!(halTwiPendingMask & (1 << halTwiIndex))) {
+          halTwiLost |= 1 << halTwiIndex;// abandonnée : CoilDriver renverra l'image de la carte
+        }
+        halTwiRetries[halTwiIndex] = 0;
+      }
+      break;
+  }
+  halTwiNext();
+}
+
+bool halExpanderBegin(byte index, byte address) {
+  const byte low[] = {HAL_MCP_GPIO, 0, 0};    // sorties a LOW avant de passer les broches en sortie
+  const byte output[] = {HAL_MCP_IODIR, 0, 0};// les 16 broches en sortie
+  halMcpAddress[index] = address;
+  halI2cSync();                   // oublie les echecs precedents
+  halI2cWrite(index, address, low, sizeof(low));
+  bool found = halI2cSync();
+  halI2cWrite(index, address, output, sizeof(output));
+  return halI2cSync() && found;
+}
+
+void halExpanderWrite(byte index, uint16_t outputs) {
+  const byte frame[] = {HAL_MCP_GPIO, (byte)outputs, (byte)(outputs >> 8)};
+  halI2cWrite(index, halMcpAddress[index], frame, sizeof(frame));
+}
+
+byte halI2cLost() {
+  halLock();
+  byte lost = halTwiLost;
+  halTwiLost = 0;
+  halUnlock();
+  return lost;
+}
+
+bool halI2cSync() {
+  unsigned long start = micros();
+  while (halTwiBusy) {
+    if (micros() - start > HAL_I2C_SYNC_TIMEOUT) {
+      // bus bloqué : TWI reinitialisé, la trame en cours et celles en attente sont abandonnées
+      halLock();
+      TWCR = 0;
+      TWCR = _BV(TWEN);
+      halTwiLost |= halTwiPendingMask | (1 << halTwiIndex);
+      halTwiPendingMask = 0;
+      memset(halTwiRetries, 0, sizeof(halTwiRetries));
+      halTwiBusy = false;
+      halTwiFailed = true;
+      health.i2cFailures++;
+      halUnlock();
+      break;
+    }
+  }
+  halLock();
+  bool ok = !halTwiFailed;
+  halTwiFailed = false;
+  halUnlock();
+  return ok;
+}
+
+//*********************************************************************************************
+//******************             SPI AND GPIO OUTPUTS (OTHER COIL DRIVERS)
+
+void halSpiBegin(byte csPin) {
+  digitalWrite(csPin, HIGH);
+  pinMode(csPin, OUTPUT);
+  SPI.begin();
+}
+
+void halSpiTransfer(byte csPin, byte *data, byte length) {
+  SPI.beginTransaction(SPISettings(COIL_SPI_FREQ, MSBFIRST, SPI_MODE0));// 8 MHz au plus sur AVR (F_CPU / 2)
+  digitalWrite(csPin, LOW);
+  SPI.transfer(data, length);     // octets reçus a la place des octets envoyés
+  digitalWrite(csPin, HIGH);
+  SPI.endTransaction();
+}
+
+void halPinOutput(byte pin) {
+  pinMode(pin, OUTPUT);
+}
+
+void halPinWrite(byte pin, bool level) {
+  digitalWrite(pin, level);
+}
+
+//*********************************************************************************************
+//******************             CALIBRATION PICKUP AND EEPROM
+
+int halPickupRead() {
+  return analogRead(CALIBRATION_PICKUP_PIN);
+}
+
+void halStoreRead(int address, byte *data, int length) {
+  for (int i = 0; i < length; i++) {
+    data[i] = EEPROM.read(address + i);
+  }
+}
+
+bool halStoreWrite(int address, byte data) {
+  if (!eeprom_is_ready()) {
+    return false;                 // EEPROM.update() attendrait la fin de l'octet precedent
+  }
+  EEPROM.update(address, data);   // n'use que les octets modifiés, lance la programmation sans l'attendre
+  return true;
+}
@@ -0,0 +1,84 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+-------------------------------------------     HAL.H     -----------------------------------------------
+_________________________________________________________________________________________________________
+Couche d'abstraction materielle utilisée par Xylophone
+Regroupe tout ce qui touche directement au materiel : horloge, sections critiques, PWM,
+timer de coupure des electroaimants et bus des cartes de sortie (mcp, SPI, broches).
+
+Xylophone ne connait que ces fonctions : pour executer le code hors de la carte (simulation,
+mesures sur PC), il suffit de fournir un autre Hal.cpp avec une horloge virtuelle et des mcp,
+trames SPI et broches factices qui enregistrent chaque ecriture : c'est sim/Hal.cpp (voir sim/Sim.h),
+qui compile ces memes sources sur PC avec CMake.
+
+Version Arduino Leonardo (AVR) : Timer1 pour les notes off, TWI par interruption pour les cartes I2C.
+
+Les ecritures I2C (mcp, pca9685) partent en arriere plan : halI2cWrite() range la trame et
+rend la main, l'interruption TWI envoie les octets un par un. Le CPU ne reste plus bloqué
+pendant le transfert I2C, seul halI2cSync() attend (reset, initialisation).
+***********************************************************************************************************/
+
+#ifndef HAL_H
+#define HAL_H
+
+#include <Arduino.h>
+#include "settings.h"
+
+// sur AVR, le callback du timer (interruption) ne fait que les coupures, qu'il ecrit lui meme
+// (halI2cWrite() en arriere plan) : les frappes (admission, echauffement des bobines, exp() lent)
+// sont faites dans update(). Sur ESP32 le callback fait aussi les frappes.
+#define HAL_TIMER_CAN_STRIKE false
+
+void halBegin();                              // initialise le bus des mcp, le PWM et le timer
+unsigned long halMicros();                    // horloge en µs (deborde, comparer par difference)
+
+// section critique imbriquable, utilisable aussi depuis l'interruption du timer
+void halLock();
+void halUnlock();
+
+// verrou du bus des mcp (une seule ecriture a la fois), sans effet sur AVR
+inline void halBusLock() {}
+inline void halBusUnlock() {}
+
+void halPwmWrite(int value);                  // PWM commun d'alimentation des electroaimants
+
+// timer one shot de coupure des electroaimants
+void halTimerBegin(void (*callback)());
+void halTimerArm(unsigned long delayUs);      // declenche le callback dans delayUs µs
+void halTimerStop();
+
+// cartes I2C des electroaimants (index 0 a COIL_EXPANDERS - 1), bus a HAL_I2C_FREQ
+// une trame en attente par carte, ecrite en une transaction en arriere plan : ne bloque pas,
+// utilisable depuis le timer.
+// Une trame pas encore partie pour la meme carte est remplacée (chaque trame decrit l'etat complet).
+// Une carte qui n'acquitte pas est réessayée HAL_I2C_RETRIES fois (compteurs de Health.h), puis la
+// trame est abandonnée : halI2cLost() le dit a CoilDriver, qui renvoie l'image de la carte
+#if COIL_DRIVER == COIL_DRIVER_PCA9685
+#define HAL_I2C_FRAME_MAX 65                  // registre + 16 sorties de 4 octets
+#else
+#define HAL_I2C_FRAME_MAX 3                   // registre + GPIOA/GPIOB
+#endif
+void halI2cWrite(byte index, byte address, const byte *data, byte length);
+byte halI2cLost();                            // cartes (bit par index) dont une trame a été abandonnée depuis le dernier appel
+bool halI2cSync();                            // attend la fin des ecritures, false si une carte n'a pas acquitté depuis le dernier appel (jamais sous halLock())
+                                              // ou si le bus reste bloqué HAL_I2C_SYNC_TIMEOUT µs (TWI reinitialisé, trames en attente abandonnées)
+
+// mcp23017 : sorties en OUTPUT a LOW (attend la fin), puis GPIOA/GPIOB par halI2cWrite()
+bool halExpanderBegin(byte index, byte address);
+void halExpanderWrite(byte index, uint16_t outputs);
+
+// autres cartes de sortie (voir CoilDriver.h) : une trame SPI a COIL_SPI_FREQ entre un front
+// descendant et un front montant de csPin, ou une broche par sortie
+void halSpiBegin(byte csPin);
+void halSpiTransfer(byte csPin, byte *data, byte length);// full duplex : data reçoit les octets lus
+void halPinOutput(byte pin);
+void halPinWrite(byte pin, bool level);
+
+// calibration automatique : capteur analogique et memoire non volatile des resultats
+#define HAL_STORE_SIZE 1024                   // EEPROM de l'ATmega32U4
+int halPickupRead();                          // lecture ADC de CALIBRATION_PICKUP_PIN
+void halStoreRead(int address, byte *data, int length);
+bool halStoreWrite(int address, byte data);   // un octet sans attendre, false tant que l'EEPROM programme le precedent (~3,3 ms)
+
+#endif // HAL_H
@@ -14,7 +14,7 @@ Permet de lire les differents messages comme noteOff, noteOn, certains controls
 #include "settings.h" 
 
 // ----------------------------------      PUBLIC  --------------------------------------------
-MidiHandler::MidiHandler(Xylophone &xylophone) : _xylophone(xylophone) {
+MidiHandler::MidiHandler(Xylophone &xylophone) : _xylophone(xylophone), _lastUpdate(0), _sysEx(_score), _calibration(xylophone) {
   _extraOctaveEnabled = digitalRead(EXTRA_OCTAVE_SWITCH_PIN) == LOW;
     if(DEBUG_HANDLER){
     Serial.println(F("constructor handler"));
@@ -29,66 +29,128 @@ void MidiHandler::begin() {
   pinMode(EXTRA_OCTAVE_SWITCH_PIN, INPUT_PULLUP);// Définition de la broche extra octave  
   _extraOctaveEnabled = digitalRead(EXTRA_OCTAVE_SWITCH_PIN) == LOW;
   _xylophone.begin();
+  _calibration.begin();           // reglages de la derniere calibration
 }
 
 //*********************************************************************************************
 //******************               HANDLE MIDI EVENTS
 
 void MidiHandler::handleMidiEvent() {
-  //recupere le message midi
-  midiEventPacket_t midiPacket = MidiUSB.read();
-  //separe les informations du message
-  byte messageType = midiPacket.header & 0xF0;
-  byte channel = midiPacket.byte1 & 0x0F;
-  byte data1 = midiPacket.byte2;
-  byte data2 = midiPacket.byte3;
-  //reification channel
-  if (ALL_CHANNEL==false){
-    if (channel!=CHANNEL_XYLO){ 
-      return; // on ne fait rien si le channel n'est pas le bon
+  receiveMidi();    // tous les paquets arrivés depuis le dernier passage
+  playScore();      // notes de la partition chargée arrivées a echeance
+  playRoll();       // coups des roulements arrivés a echeance
+  processEvents();  // puis toutes les notes, envoyées ensemble au prochain update()
+}
+
+//*********************************************************************************************
+//******************          RECEIVE THE USB-MIDI PACKETS
+
+void MidiHandler::receiveMidi() {
+  // si la file est pleine on laisse les paquets dans le buffer USB jusqu'au prochain passage
+  while (!_events.full()) {
+    midiEventPacket_t midiPacket = MidiUSB.read();
+    if (midiPacket.header == 0) {
+      break; // plus rien a lire
     }
+    receivePacket(midiPacket);
   }
-  //selection de l'action a faire 
-  switch (messageType) {        
-    case 0x80: // Note Off
-      handleNoteOff(data1);
-      break;
-    case 0x90: // Note On
-      handleNoteOn(data1, data2);
-      break;
-    case 0xB0: // Control Change
-      handleControlChange(data1, data2);
-      break;
-    case 0xF0: // SysEx => ne devrais surement pas rester pour ce projet pour l'instant
-     {
-        // Lisez le message SysEx
-        byte sysExData[USB_EP_SIZE - 4];
-        unsigned int sysExLength = 0;
-        bool endOfSysEx = false;
-
-        while (!endOfSysEx && MidiUSB.available() > 0) {
-          midiPacket = MidiUSB.read();
-          if (midiPacket.byte1 != 0xF7) {
-            sysExData[sysExLength++] = midiPacket.byte1;
-          } else {
-            endOfSysEx = true;
+}
+
+// un paquet USB-MIDI : notes et CC dans la file, SysEx au parser
+void MidiHandler::receivePacket(const midiEventPacket_t &midiPacket) {
+    _rxTime = halMicros();
+    byte bytes[3] = { midiPacket.byte1, midiPacket.byte2, midiPacket.byte3 };
+
+    //selection de l'action a faire selon le Code Index Number du paquet
+    switch (midiPacket.header & 0x0F) {
+      case 0x8: // Note Off
+      case 0x9: // Note On
+      case 0xB: // Control Change
+        {
+          byte channel = midiPacket.byte1 & 0x0F;
+          bool noteOn = (midiPacket.header & 0x0F) == 0x9 && midiPacket.byte3 > 0;
+          if (noteOn) {
+            health.notesReceived++;
           }
-          if (midiPacket.byte2 != 0xF7) {
-            sysExData[sysExLength++] = midiPacket.byte2;
-          } else {
-            endOfSysEx = true;
+          if (ALL_CHANNEL == false && channel != CHANNEL_XYLO) {
+            if (noteOn) {
+              health.notesFiltered++;
+            }
+            break; // on ne fait rien si le channel n'est pas le bon
           }
-          if (midiPacket.byte3 != 0xF7) {
-            sysExData[sysExLength++] = midiPacket.byte3;
-          } else {
-            endOfSysEx = true;
+          MidiEvent event = { (byte)(midiPacket.byte1 & 0xF0), midiPacket.byte2, midiPacket.byte3, _rxTime };
+          _events.push(event);
+        }
+        break;
+      case 0x5: // SysEx : fin avec 1 octet (sinon message systeme d'un octet, ignoré)
+        if (bytes[0] != 0xF7) {
+          break;
+        }
+        __attribute__((fallthrough));   // meme traitement que les autres paquets SysEx
+      case 0x4: // SysEx : debut ou suite, 3 octets
+      case 0x6: // SysEx : fin avec 2 octets
+      case 0x7: // SysEx : fin avec 3 octets
+        {
+          byte count = (midiPacket.header & 0x0F) == 0x4 ? 3 : (midiPacket.header & 0x0F) - 4;
+          for (byte i = 0; i < count; i++) {
+            SysExCommand command = _sysEx.feed(bytes[i]);
+            if (command != SYSEX_NONE) {
+              handleSysEx(command);
+            }
           }
         }
-        handleSysEx(sysExData, sysExLength);
-      }
-    default:
-    // Ignorer les autres types de messages MIDI
-    break;
+        break;
+      default:
+        // Ignorer les autres types de messages MIDI
+        break;
+    }
+}
+
+//*********************************************************************************************
+//******************          PLAY THE UPLOADED SCORE
+
+// les evenements sont minutés par l'horloge de la carte, la reception USB n'intervient plus.
+// Datés de leur echeance comme les roulements : scheduleNote compense le retard de la boucle
+void MidiHandler::playScore() {
+  ScoreEvent event;
+  unsigned long time;
+  while (_score.next(halMicros(), event, time)) {
+    _rxTime = time;
+    handleNoteOn(event.note, event.velocity);
+  }
+}
+
+//*********************************************************************************************
+//******************          PLAY THE ROLLS
+
+// coups des roulements arrivés a echeance, datés de leur echeance : scheduleNote compense le retard de la boucle
+void MidiHandler::playRoll() {
+  byte note;
+  byte velocity;
+  unsigned long time;
+  while (_roll.next(halMicros(), note, velocity, time)) {
+    _xylophone.scheduleNote(note, velocity, time);
+  }
+}
+
+//*********************************************************************************************
+//******************          PLAY THE RECEIVED EVENTS
+
+void MidiHandler::processEvents() {
+  MidiEvent event;
+  while (_events.pop(event)) {
+    _rxTime = event.time;
+    switch (event.type) {
+      case 0x80: // Note Off
+        handleNoteOff(event.data1);
+        break;
+      case 0x90: // Note On
+        handleNoteOn(event.data1, event.data2);
+        break;
+      case 0xB0: // Control Change
+        handleControlChange(event.data1, event.data2);
+        break;
+    }
   }
 }
 //*********************************************************************************************
@@ -97,14 +159,18 @@ void MidiHandler::handleMidiEvent() {
 void MidiHandler::test(bool playMelody) {
   if (playMelody) {
     for (size_t i = 0; i < sizeof(INIT_MELODY) / sizeof(INIT_MELODY[0]); i++) {
-      handleNoteOn(INIT_MELODY[i], 127);  // Jouer la note avec une vélocité de 127
-      delay(INIT_MELODY_DELAY[i]);    // Attendre le temps indiqué dans INIT_MELODY_DELAY
-      handleNoteOff(INIT_MELODY[i]);     // Envoyer un message de note off
+      _rxTime = halMicros() - STRIKE_DELAY * 1000UL; // deja en retard : frappe immediate, sans precompensation
+      handleNoteOn(pgm_read_byte(&INIT_MELODY[i]), 127);  // Jouer la note avec une vélocité de 127
+      _xylophone.update();                // envoie la note aux mcp
+      delay(pgm_read_byte(&INIT_MELODY_DELAY[i]));    // Attendre le temps indiqué dans INIT_MELODY_DELAY
+      handleNoteOff(pgm_read_byte(&INIT_MELODY[i]));     // Envoyer un message de note off
     }
   } else {
      //joue tout les notes l'une après l'autre
     for (byte note = INSTRUMENT_START_NOTE; note < INSTRUMENT_START_NOTE + INSTRUMENT_RANGE; note++) {
+      _rxTime = halMicros() - STRIKE_DELAY * 1000UL; // deja en retard : frappe immediate, sans precompensation
       handleNoteOn(note, 127);  // Jouer la note avec une vélocité de 127
+      _xylophone.update(); // envoie la note aux mcp
       delay(20);           // Attendre 200 ms
       _xylophone.update(); // coupe l'electroaiman      
       handleNoteOff(note);     // Envoyer un message de note off
@@ -121,7 +187,94 @@ void MidiHandler::test(bool playMelody) {
 }
 
 void MidiHandler::update() {
+  unsigned long now = halMicros();
+  if (_lastUpdate != 0) {
+    healthMax(health.maxLoopTime, now - _lastUpdate);// duree d'un tour de loop()
+  }
+  _lastUpdate = now;
+  _calibration.update(halMicros());// au plus une lecture du capteur, ne bloque pas
   _xylophone.update();
+  if (_xylophone.idle()) {
+    traceDrain();                 // au repos seulement, sans attendre le port serie
+  }
+}
+
+//*********************************************************************************************
+//******************          LATENCY BENCHMARK
+
+// rejoue des charges de reference par la reception (paquets USB-MIDI, file, boucle) et envoie les
+// histogrammes sur Serial : la latence va du paquet lu a l'electroaimant alimenté
+void MidiHandler::benchmark() {
+  if (!BENCHMARK_ENABLED) {
+    Serial.println(F("benchmark : mettre BENCHMARK_ENABLED a true dans settings.h"));
+    return;
+  }
+  unsigned long t;
+
+  // notes seules : toutes les notes de l'instrument a 100ms d'intervalle
+  benchReset();
+  t = halMicros();
+  for (byte i = 0; i < INSTRUMENT_RANGE; i++) {
+    benchWait(t += 100000UL);
+    benchNoteOn(INSTRUMENT_START_NOTE + i, 100);
+  }
+  benchWait(t + 100000UL);
+  benchReport("single_notes");
+
+  // accords denses : 20 accords de 6 notes a 150ms, vélocités differentes
+  benchReset();
+  t = halMicros();
+  for (byte c = 0; c < 20; c++) {
+    benchWait(t += 150000UL);
+    for (byte i = 0; i < 6; i++) {
+      benchNoteOn(INSTRUMENT_START_NOTE + (c + i * 4) % INSTRUMENT_RANGE, 70 + i * 10);
+    }
+  }
+  benchWait(t + 150000UL);
+  benchReport("dense_chords");
+
+  // notes repetées rapides : 50 frappes de la meme note toutes les 40ms
+  benchReset();
+  t = halMicros();
+  for (byte i = 0; i < 50; i++) {
+    benchWait(t += 40000UL);
+    benchNoteOn(INSTRUMENT_START_NOTE + INSTRUMENT_RANGE / 2, 100);
+  }
+  benchWait(t + 100000UL);
+  benchReport("fast_repeats");
+
+  // salves : accord de 8 notes coupé 5ms plus tard par un all notes off (CC 123)
+  benchReset();
+  t = halMicros();
+  for (byte c = 0; c < 10; c++) {
+    benchWait(t += 200000UL);
+    for (byte i = 0; i < 8; i++) {
+      benchNoteOn(INSTRUMENT_START_NOTE + (c + i * 3) % INSTRUMENT_RANGE, 100);
+    }
+    benchWait(t + 5000UL);          // all notes off au milieu des frappes
+    benchControl(123, 0);
+  }
+  benchWait(t + 200000UL);
+  benchReport("all_notes_off_bursts");
+}
+
+// paquets construits comme ceux lus sur l'USB, sur le canal joué
+void MidiHandler::benchNoteOn(byte note, byte velocity) {
+  midiEventPacket_t packet = { 0x09, (byte)(0x90 | CHANNEL_XYLO), note, velocity };
+  receivePacket(packet);
+}
+
+void MidiHandler::benchControl(byte control, byte value) {
+  midiEventPacket_t packet = { 0x0B, (byte)(0xB0 | CHANNEL_XYLO), control, value };
+  receivePacket(packet);
+}
+
+// la boucle loop() : file des evenements, frappes et ecritures des mcp
+void MidiHandler::benchWait(unsigned long until) {
+  while ((long)(halMicros() - until) < 0) {
+    handleMidiEvent();
+    update();
+  }
 }
   
 // ----------------------------------      PUBLIC  --------------------------------------------
@@ -150,16 +303,19 @@ if (_extraOctaveEnabled) {
   if (isNotePlayable(note)) {
     if(velocity>0) {  
 
-        if(DEBUG_HANDLER){
-        Serial.print(F("MIDIHandler noteOn = ")); 
-        Serial.println(note); 
+      TRACE_EVENT(TRACE_NOTE_ON, note, velocity);
+      if (BENCHMARK_ENABLED) {
+        benchNoteReceived(note - INSTRUMENT_START_NOTE, _rxTime);
       }
-       // Appelle la fonction playNote de la classe Xylophone pour activer la sortie correspondante du MCP
+       // Programme la frappe dans la classe Xylophone, en avance de la latence de la lame,
       // avec la vélocité appropriée pour ajuster le PWM
-      _xylophone.playNote(note, velocity);
-      
-    
-    }      
+      _xylophone.scheduleNote(note, velocity, _rxTime);
+      _roll.noteOn(note, velocity, _rxTime);// refrappée tant qu'elle est tenue si le roulement est armé
+    } else {
+      _roll.noteOff(note);           // note on de vélocité 0 = note off
+    }
+  } else if (velocity > 0) {
+    health.notesOutOfRange++;
   }
 }
 
@@ -175,11 +331,8 @@ void MidiHandler::handleNoteOff( byte note) {
     }
   }
     if (isNotePlayable(note)) {
-       _xylophone.msgNoteOff(note);
-      if(DEBUG_HANDLER){
-        Serial.print(F("MIDIHandler noteOff = ")); 
-        Serial.println(note); 
-      }
+      TRACE_EVENT(TRACE_NOTE_OFF, note, 0);
+      _roll.noteOff(note);           // fin du roulement de cette note
     }
 }
 
@@ -189,20 +342,38 @@ void MidiHandler::handleNoteOff( byte note) {
 void MidiHandler::handleControlChange(byte control, byte value) {
   switch (control) {
     case 121: // Réinitialisation de tous les contrôleurs
+      _roll.setRate(0, halMicros());
+      _roll.setShape(64);
       _xylophone.reset();
       break;
     case 123: // Désactiver toutes les notes
+      _roll.clear();
       _xylophone.reset();
       break;
+    case ROLL_CC: // cadence des roulements, 0 = desarmé
+      _roll.setRate(value, halMicros());
+      break;
+    case ROLL_SHAPE_CC: // forme de la vélocité des roulements
+      _roll.setShape(value);
+      break;
+    case THERMAL_REPORT_CC: // echauffement des bobines (voir CoilThermal.h)
+      _xylophone.thermalReport();
+      break;
+    case CALIBRATION_CC: // calibration automatique avec le capteur (voir Calibration.h)
+      if (value == 0) {
+        _calibration.stop();
+      } else {
+        _calibration.start(halMicros());
+      }
+      break;
   }
 }
 
 //*********************************************************************************************
 //******************               HANDLE SYSTEMS EX
 
-void MidiHandler::handleSysEx(byte *data, unsigned int length) {
-  // Vérifiez si le message reçu est une demande d'identification (0x06, 0x01)
-  if (length >= 2 && data[0] == 0x06 && data[1] == 0x01) {
+void MidiHandler::handleSysEx(SysExCommand command) {
+  if (command == SYSEX_IDENTITY_REQUEST) {
     // Envoyez la réponse d'identification
     byte idResponse[] = {
       0xF0, // Début du message SysEx
@@ -215,9 +386,57 @@ void MidiHandler::handleSysEx(byte *data, unsigned int length) {
       0x00, 0x00, 0x00, 0x01, // Version du logiciel (par exemple, 0x00000001)
       0xF7  // Fin du message SysEx
     };
-    MidiUSB.write(idResponse, sizeof(idResponse));
-    MidiUSB.flush();
+    sendSysEx(idResponse, sizeof(idResponse));
+    return;
+  }
+
+  // compteurs de fonctionnement (voir Health.h) : la reponse tient lieu d'accusé
+  if (command == SYSEX_HEALTH && _sysEx.status() == SYSEX_OK) {
+    byte message[HEALTH_MESSAGE_SIZE];
+    healthMessage(message, _xylophone.activeCoils());
+    sendSysEx(message, sizeof(message));
+    return;
+  }
+
+  // protocole de chargement : la lecture n'est pas modifiée par un message refusé
+  if (_sysEx.status() == SYSEX_OK) {
+    switch (command) {
+      case SYSEX_UPLOAD_BEGIN: // la partition a été vidée par le parser
+        _xylophone.reset();
+        break;
+      case SYSEX_PLAY:
+        _score.play(halMicros());
+        break;
+      case SYSEX_STOP:
+        _score.stop();
+        break;
+      default:
+        break;
+    }
+  }
+  sendAck(command);
+}
+
+// accusé : F0 <fabricant> <appareil> 7F <commande> <seq> <statut> <nombre d'evenements (14 bits)> F7
+void MidiHandler::sendAck(byte command) {
+  byte ack[] = {
+    0xF0, SYSEX_MANUFACTURER_ID, SYSEX_DEVICE_ID, SYSEX_ACK,
+    command, _sysEx.sequence(), _sysEx.status(),
+    (byte)(_score.count() & 0x7F), (byte)((_score.count() >> 7) & 0x7F),
+    0xF7
+  };
+  sendSysEx(ack, sizeof(ack));
+}
+
+// decoupe un SysEx complet (F0 ... F7) en paquets USB-MIDI : CIN 4 puis CIN 5, 6 ou 7 pour la fin
+void MidiHandler::sendSysEx(const byte *data, byte length) {
+  for (byte i = 0; i < length; i += 3) {
+    byte count = min(length - i, 3);
+    byte cin = (i + 3 >= length) ? 0x4 + count : 0x4;
+    midiEventPacket_t packet = { cin, data[i], count > 1 ? data[i + 1] : (byte)0, count > 2 ? data[i + 2] : (byte)0 };
+    MidiUSB.sendMIDI(packet);
   }
+  MidiUSB.flush();
 }
 
 
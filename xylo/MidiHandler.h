@@ -11,12 +11,25 @@ MidiHandler est le cerveau du système,
 il reçoit les messages et décide de l'action à faire effectuer par l'instrument.
 Commence par vérifier si on lit tous les channels ou seulement un seul.
 
+La reception et l'actionnement sont separés : handleMidiEvent() lit tous les paquets USB-MIDI
+disponibles, les decode selon leur Code Index Number (CIN) et range les notes/CC dans une
+EventRing, puis traite toute la file d'un coup. Les notes d'un accord arrivées dans la meme trame
+USB partent donc dans la meme ecriture vers les mcp.
+Les SysEx sont decodés octet par octet par SysExParser, sans buffer de message : demande
+d'identification, chargement d'une partition pré-minutée (Score) en blocs acquittés et
+lecture des compteurs de fonctionnement (Health.h).
+Une fois chargée, la partition est jouée par handleMidiEvent() avec l'horloge de la carte.
+
 noteOn : Demande à xylophone l'activation de la note si la note est dans l'intervalle
          de notes jouées (et prend en compte le switch extraOctave)
 noteOff : Enregistre le noteOff pour gérer les compteurs de notes actives
 controle change :
   - CC 121 : Réinitialisation de tous les contrôleurs
   - CC 123 : Désactiver toutes les notes
+  - CC THERMAL_REPORT_CC : envoie l'echauffement de chaque bobine en JSON sur Serial
+  - CC CALIBRATION_CC : valeur > 0 lance la calibration automatique des lames, 0 l'arrete
+  - CC ROLL_CC / ROLL_SHAPE_CC : cadence et forme des roulements generés par la carte (voir Roll.h),
+    les notes tenues sont refrappées jusqu'a leur note off
 
 MidiHandler initialise tous les objets nécessaires utilisés, dans ce cas : xylophone 
 
@@ -26,7 +39,13 @@ MidiHandler initialise tous les objets nécessaires utilisés, dans ce cas : xyl
 #define MIDI_HANDLER_H
 
 
+#include <MIDIUSB.h>
 #include "Xylophone.h"
+#include "EventRing.h"
+#include "Score.h"
+#include "SysExParser.h"
+#include "Calibration.h"
+#include "Roll.h"
 
 
 class MidiHandler {
@@ -35,11 +54,34 @@ public:
   void handleMidiEvent();// traite les messages midi recu et appel les differentes fonctions
   void begin (); //initialise tout ce qui doit l'etre
   void test(bool playMelody);
+  void benchmark();// mesure latence/gigue sur des charges de reference (BENCHMARK_ENABLED)
   void update();
 
 private:
   Xylophone& _xylophone;
   bool _extraOctaveEnabled;  //lit si le switch extra octave est actif ou non
+  unsigned long _rxTime;     //instant de reception du message en cours (halMicros)
+  unsigned long _lastUpdate; //debut du tour de loop() precedent, pour health.maxLoopTime
+//------------------------------------------------------------------
+//reception : paquets USB-MIDI -> file d'evenements
+  EventRing<MidiEvent, MIDI_RING_SIZE> _events;
+  void receiveMidi();// vide le buffer USB dans _events
+  void receivePacket(const midiEventPacket_t &midiPacket);// un paquet USB-MIDI
+  void processEvents();// traite tous les evenements de _events
+//------------------------------------------------------------------
+//SysEx et partition chargée en memoire
+  Score _score;
+  SysExParser _sysEx;
+  void playScore();// joue les evenements de la partition arrivés a echeance
+  void sendSysEx(const byte *data, byte length);// F0 ... F7 en paquets USB-MIDI
+  void sendAck(byte command);
+//------------------------------------------------------------------
+//calibration automatique, avancée par update()
+  Calibration _calibration;
+//------------------------------------------------------------------
+//roulements generés par la carte
+  Roll _roll;
+  void playRoll();// refrappe les notes tenues arrivées a echeance
 //------------------------------------------------------------------
 //gestion des messages NoteOn, NoteOff
   void handleNoteOn( byte note, byte velocity);
@@ -49,7 +91,12 @@ private:
   void handleControlChange( byte control, byte value);//gestion des CC
   
   ///fonction de gestion des messages System Exclusive  
-  void handleSysEx(byte *data, unsigned int length);
+  void handleSysEx(SysExCommand command);
+
+  //charges de reference du benchmark, injectées dans la reception comme des paquets USB-MIDI
+  void benchNoteOn(byte note, byte velocity);
+  void benchControl(byte control, byte value);
+  void benchWait(unsigned long until);// fait tourner la boucle jusqu'a l'instant indiqué
 
   };
 
@@ -0,0 +1,69 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+----------------------------------------     SCORE.CPP     ----------------------------------------------
+_________________________________________________________________________________________________________
+Partition pré-minutée chargée en memoire par SysEx et jouée avec l'horloge de la carte
+
+***********************************************************************************************************/
+
+#include "Score.h"
+
+Score::Score() {
+  clear();
+}
+
+void Score::clear() {
+  _count = 0;
+  _staged = 0;
+  _playing = false;
+  _position = 0;
+}
+
+//*********************************************************************************************
+//******************          UPLOAD
+
+bool Score::stage(const ScoreEvent &event) {
+  if (_staged >= SCORE_MAX_EVENTS) {
+    return false;
+  }
+  _events[_staged++] = event;
+  return true;
+}
+
+void Score::commit() {
+  _count = _staged;
+}
+
+void Score::rollback() {
+  _staged = _count;
+}
+
+//*********************************************************************************************
+//******************          PLAYBACK
+
+void Score::play(unsigned long now) {
+  _position = 0;
+  _playing = _count > 0;
+  if (_playing) {
+    _nextTime = now + _events[0].delta * 1000UL;
+  }
+}
+
+void Score::stop() {
+  _playing = false;
+}
+
+bool Score::next(unsigned long now, ScoreEvent &event, unsigned long &time) {
+  if (!_playing || (long)(now - _nextTime) < 0) {
+    return false;
+  }
+  time = _nextTime;
+  event = _events[_position++];
+  if (_position < _count) {
+    _nextTime += _events[_position].delta * 1000UL;
+  } else {
+    _playing = false; // fin de la partition
+  }
+  return true;
+}
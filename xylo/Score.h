@@ -0,0 +1,54 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+-----------------------------------------     SCORE.H     -----------------------------------------------
+_________________________________________________________________________________________________________
+Partition pré-minutée chargée en memoire par SysEx (voir SysExParser.h) et jouée avec l'horloge
+de la carte : une fois la piece envoyée, la latence du transport ne compte plus.
+
+Chaque evenement donne le delai en ms depuis l'evenement precedent (0 = accord), la note et la
+vélocité. Les evenements d'un bloc sont d'abord ajoutés provisoirement (stage()), puis validés
+(commit()) ou annulés (rollback()) quand la fin du bloc a été verifiée : un bloc corrompu ne
+laisse rien dans la partition et l'hote peut le renvoyer.
+
+next() renvoie les evenements arrivés a echeance avec leur echeance, les delais sont cumulés a
+partir de l'echeance precedente (et non de l'instant de traitement) : pas de derive sur toute la
+piece, et la note est programmée a son echeance (scheduleNote) quel que soit le retard de la boucle.
+***********************************************************************************************************/
+
+#ifndef SCORE_H
+#define SCORE_H
+
+#include <Arduino.h>
+#include "settings.h"
+
+struct ScoreEvent {
+  uint16_t delta;  // ms depuis l'evenement precedent
+  byte note;
+  byte velocity;
+};
+
+class Score {
+public:
+  Score();
+  void clear();                         // vide la partition et arrete la lecture
+  bool stage(const ScoreEvent &event);  // ajout provisoire, false si la partition est pleine
+  void commit();                        // valide les evenements ajoutés depuis le dernier commit
+  void rollback();                      // les oublie
+  uint16_t count() const { return _count; }
+
+  void play(unsigned long now);         // demarre la lecture du debut
+  void stop();
+  bool playing() const { return _playing; }
+  bool next(unsigned long now, ScoreEvent &event, unsigned long &time);// prochain evenement si son echeance est passée
+
+private:
+  ScoreEvent _events[SCORE_MAX_EVENTS];
+  uint16_t _count;                      // evenements validés
+  uint16_t _staged;                     // evenements validés + provisoires
+  bool _playing;
+  uint16_t _position;                   // prochain evenement a jouer
+  unsigned long _nextTime;              // son echeance (halMicros)
+};
+
+#endif // SCORE_H
@@ -0,0 +1,162 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+-------------------------------------     SYSEXPARSER.CPP    --------------------------------------------
+_________________________________________________________________________________________________________
+Decodage des SysEx octet par octet et protocole de chargement de partition
+
+***********************************************************************************************************/
+
+#include "SysExParser.h"
+
+SysExParser::SysExParser(Score &score) : _score(score) {
+  _state = IDLE;
+  _position = 0;
+  _command = SYSEX_NONE;
+  _status = SYSEX_OK;
+  _sequence = 0;
+  _expected = 0;
+  _committed = false;
+}
+
+// ----------------------------------      PUBLIC  --------------------------------------------
+
+SysExCommand SysExParser::feed(byte data) {
+  if (data >= 0xF8) {
+    return SYSEX_NONE; // messages temps reel : peuvent s'intercaler dans un SysEx
+  }
+  if (data == 0xF7) {
+    SysExCommand command = end();
+    _state = IDLE;
+    return command;
+  }
+  if (data & 0x80) {
+    // F0 ou autre octet de statut : le message en cours est interrompu
+    if (_state == PAYLOAD && _command == SYSEX_UPLOAD_CHUNK) {
+      _score.rollback();
+    }
+    _state = data == 0xF0 ? START : IDLE;
+    return SYSEX_NONE;
+  }
+
+  switch (_state) {
+    case START:
+      if (data == 0x7E) {
+        _state = UNIVERSAL;
+        _position = 0;
+      } else if (data == SYSEX_MANUFACTURER_ID) {
+        _state = DEVICE;
+      } else {
+        _state = SKIP;
+      }
+      break;
+    case UNIVERSAL:
+      // <dev> quelconque, puis 06 01 : rien d'autre ne doit suivre
+      if ((_position == 1 && data != 0x06) || (_position == 2 && data != 0x01) || _position >= 3) {
+        _state = SKIP;
+      }
+      _position++;
+      break;
+    case DEVICE:
+      _state = (data == SYSEX_DEVICE_ID || data == 0x7F) ? COMMAND : SKIP;
+      break;
+    case COMMAND:
+      if (data >= SYSEX_UPLOAD_BEGIN && data <= SYSEX_HEALTH) {
+        _state = PAYLOAD;
+        _command = (SysExCommand)data;
+        _status = SYSEX_OK;
+        _position = 0;
+        _hasPending = false;
+        _checksum = 0;
+        _groupLength = 0;
+        _full = false;
+      } else {
+        _state = SKIP;
+      }
+      break;
+    case PAYLOAD:
+      payload(data);
+      break;
+    default:
+      break;
+  }
+  return SYSEX_NONE;
+}
+
+// ----------------------------------      PRIVATE  --------------------------------------------
+
+//*********************************************************************************************
+//******************          CHUNK PAYLOAD
+
+void SysExParser::payload(byte data) {
+  if (_command != SYSEX_UPLOAD_CHUNK) {
+    _status = SYSEX_BAD_LENGTH; // les autres commandes n'ont pas de contenu
+    return;
+  }
+  if (_hasPending) {
+    byte value = _pending;      // l'octet precedent n'etait pas la somme
+    _checksum ^= value;
+    if (_position == 0) {
+      _sequence = value;
+      _position = 1;
+    } else {
+      _group[_groupLength++] = value;
+      if (_groupLength == 4) {
+        ScoreEvent event = { (uint16_t)(_group[0] | (_group[1] << 7)), _group[2], _group[3] };
+        if (!_score.stage(event)) {
+          _full = true;
+        }
+        _groupLength = 0;
+      }
+    }
+  }
+  _pending = data;
+  _hasPending = true;
+}
+
+//*********************************************************************************************
+//******************          END OF MESSAGE (F7)
+
+SysExCommand SysExParser::end() {
+  if (_state == UNIVERSAL) {
+    return _position == 3 ? SYSEX_IDENTITY_REQUEST : SYSEX_NONE;
+  }
+  if (_state != PAYLOAD) {
+    return SYSEX_NONE;
+  }
+
+  switch (_command) {
+    case SYSEX_UPLOAD_BEGIN:
+      if (_status == SYSEX_OK) {
+        _score.clear();
+        _expected = 0;
+        _committed = false;
+      }
+      break;
+    case SYSEX_UPLOAD_CHUNK:
+      if (!_hasPending || _position == 0 || _groupLength != 0) {
+        _status = SYSEX_BAD_LENGTH;
+      } else if (_pending != _checksum) {
+        _status = SYSEX_BAD_CHECKSUM;
+      } else if (_committed && _sequence == ((_expected - 1) & 0x7F)) {
+        _status = SYSEX_OK;     // bloc renvoyé car l'accusé s'est perdu : deja dans la partition
+        _score.rollback();
+        break;
+      } else if (_sequence != _expected) {
+        _status = SYSEX_BAD_SEQUENCE;
+      } else if (_full) {
+        _status = SYSEX_SCORE_FULL;
+      }
+      if (_status == SYSEX_OK) {
+        _score.commit();
+        _expected = (_expected + 1) & 0x7F;
+        _committed = true;
+      } else {
+        _score.rollback();
+      }
+      break;
+    default:
+      break;
+  }
+  return _command;
+}
@@ -0,0 +1,96 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+--------------------------------------     SYSEXPARSER.H    ---------------------------------------------
+_________________________________________________________________________________________________________
+Decodage des SysEx octet par octet, au fil des paquets USB-MIDI : aucun message n'est mis en
+buffer en entier, la longueur d'un SysEx n'est donc pas limitée.
+
+Messages reconnus :
+  F0 7E <dev> 06 01 F7                         demande d'identification
+  F0 SYSEX_MANUFACTURER_ID SYSEX_DEVICE_ID <commande> ... F7
+    01                                         debut de chargement : vide la partition
+    02 <seq> <evenements...> <somme>           bloc de partition
+    03                                         fin de chargement
+    04                                         joue la partition
+    05                                         arrete la lecture
+    06                                         lecture des compteurs de fonctionnement (Health.h)
+
+Un bloc contient un numero de sequence (0..127, modulo 128) puis des evenements de 4 octets :
+delai en ms sur 14 bits (7 bits de poids faible puis 7 bits de poids fort), note, vélocité.
+Le dernier octet avant F7 est le XOR de <seq> et de tous les octets d'evenement.
+Les evenements sont ajoutés a la partition des qu'ils sont complets, puis validés ou annulés
+a la reception de F7 selon la sequence, la somme et la longueur.
+
+feed() renvoie la commande terminée par F7 (SYSEX_NONE sinon) ; status() et sequence() donnent
+le resultat a renvoyer a l'hote dans l'accusé de reception.
+***********************************************************************************************************/
+
+#ifndef SYSEX_PARSER_H
+#define SYSEX_PARSER_H
+
+#include <Arduino.h>
+#include "settings.h"
+#include "Score.h"
+#include "Health.h"
+
+enum SysExCommand : byte {
+  SYSEX_NONE = 0x00,
+  SYSEX_UPLOAD_BEGIN = 0x01,
+  SYSEX_UPLOAD_CHUNK = 0x02,
+  SYSEX_UPLOAD_END = 0x03,
+  SYSEX_PLAY = 0x04,
+  SYSEX_STOP = 0x05,
+  SYSEX_HEALTH = HEALTH_SYSEX_COMMAND,
+  SYSEX_ACK = 0x7F,               // reponse de la carte
+  SYSEX_IDENTITY_REQUEST = 0x80   // hors protocole : demande d'identification universelle
+};
+
+enum SysExStatus : byte {
+  SYSEX_OK = 0,
+  SYSEX_BAD_SEQUENCE = 1,
+  SYSEX_BAD_CHECKSUM = 2,
+  SYSEX_SCORE_FULL = 3,
+  SYSEX_BAD_LENGTH = 4
+};
+
+class SysExParser {
+public:
+  SysExParser(Score &score);
+  SysExCommand feed(byte data);   // un octet du flux SysEx (F0 et F7 compris)
+  SysExStatus status() const { return _status; }
+  byte sequence() const { return _sequence; }
+
+private:
+  enum State : byte {
+    IDLE,          // attend F0
+    START,         // premier octet : 7E ou identifiant fabricant
+    UNIVERSAL,     // 7E <dev> 06 01
+    DEVICE,        // identifiant de l'appareil
+    COMMAND,
+    PAYLOAD,       // contenu de la commande
+    SKIP           // message d'un autre appareil ou invalide : ignoré jusqu'a F7
+  };
+
+  Score &_score;
+  State _state;
+  byte _position;           // octets reçus dans l'etat courant
+  SysExCommand _command;
+  SysExStatus _status;
+  byte _sequence;           // sequence du dernier bloc traité
+  byte _expected;           // sequence attendue pour le prochain bloc
+  bool _committed;          // un bloc a été validé depuis le debut du chargement
+
+  // bloc en cours : l'octet le plus recent n'est traité qu'a l'arrivée du suivant (il peut etre la somme)
+  bool _hasPending;
+  byte _pending;
+  byte _checksum;
+  byte _group[4];
+  byte _groupLength;
+  bool _full;
+
+  void payload(byte data);
+  SysExCommand end();
+};
+
+#endif // SYSEX_PARSER_H
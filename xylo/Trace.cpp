@@ -0,0 +1,85 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+----------------------------------------     TRACE.CPP     ----------------------------------------------
+_________________________________________________________________________________________________________
+Traces binaires des evenements
+
+***********************************************************************************************************/
+
+#include "Trace.h"
+
+#if TRACE_LEVEL > 0
+
+#include "Hal.h"
+
+struct TraceRecord {
+  byte id;
+  byte a;
+  uint16_t b;
+  unsigned long time;
+};
+
+static_assert((TRACE_BUFFER_SIZE & (TRACE_BUFFER_SIZE - 1)) == 0, "TRACE_BUFFER_SIZE doit etre une puissance de 2");
+
+static TraceRecord traceBuffer[TRACE_BUFFER_SIZE];
+static unsigned int traceHead = 0;    // prochaine case a ecrire
+static unsigned int traceTail = 0;    // prochaine case a envoyer
+static uint16_t traceLost = 0;
+
+// plusieurs producteurs (loop, interruption du timer, taches ESP32) : section critique tres courte
+void traceRecord(byte id, byte a, uint16_t b) {
+  unsigned long now = halMicros();
+  halLock();
+  unsigned int next = (traceHead + 1) & (TRACE_BUFFER_SIZE - 1);
+  if (next == traceTail) {
+    if (traceLost < 0xFFFF) {
+      traceLost++;
+    }
+  } else {
+    traceBuffer[traceHead].id = id;
+    traceBuffer[traceHead].a = a;
+    traceBuffer[traceHead].b = b;
+    traceBuffer[traceHead].time = now;
+    traceHead = next;
+  }
+  halUnlock();
+}
+
+void traceDrain() {
+  while (Serial.availableForWrite() >= TRACE_FRAME_SIZE) {
+    TraceRecord record;
+    bool found = true;
+    halLock();
+    if (traceLost > 0) {
+      // signalé a sa place dans le flux : les enregistrements suivants sont ceux d'apres la perte
+      record.id = TRACE_LOST;
+      record.a = 0;
+      record.b = traceLost;
+      record.time = halMicros();
+      traceLost = 0;
+    } else if (traceTail != traceHead) {
+      record = traceBuffer[traceTail];
+      traceTail = (traceTail + 1) & (TRACE_BUFFER_SIZE - 1);
+    } else {
+      found = false;
+    }
+    halUnlock();
+    if (!found) {
+      return;
+    }
+
+    byte frame[TRACE_FRAME_SIZE] = {
+      TRACE_SYNC, record.id, record.a,
+      (byte)record.b, (byte)(record.b >> 8),
+      (byte)record.time, (byte)(record.time >> 8), (byte)(record.time >> 16), (byte)(record.time >> 24),
+      0
+    };
+    for (byte i = 1; i < TRACE_FRAME_SIZE - 1; i++) {
+      frame[TRACE_FRAME_SIZE - 1] ^= frame[i];
+    }
+    Serial.write(frame, TRACE_FRAME_SIZE);
+  }
+}
+
+#endif // TRACE_LEVEL > 0
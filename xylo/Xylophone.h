@@ -1,12 +1,70 @@
 /***********************************************************************************************************
 ---------------------------------------------------------------------------------------------------------
-------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ---------------------------- 
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
 ---------------------------------------     XYLOPHONE.H    ----------------------------------------------
 _________________________________________________________________________________________________________
 Classe pour gérer les actions sur le xylophone
 Le xylophone gère les notes on et off avec un timer pour désactiver les électroaimants
 après un temps défini sans bloquer le code.
 
+La coupure des electroaimants est faite par un timer materiel (Timer1 sur AVR, esp_timer sur ESP32)
+programmé sur l'echeance exacte du prochain electroaimant a couper : la durée de frappe ne depend
+plus de la boucle loop(). Quand plus aucune note n'est active le PWM est coupé immediatement.
+Le callback du timer ecrit lui meme les coupures (writeReleases() depuis l'interruption sur
+AVR, flushOutputs() sur ESP32) : une coupure ne depend ni de loop() ni des autres notes d'un
+accord. L'ecriture ne bloque pas : Hal envoie les octets en arriere plan (interruption TWI sur
+AVR, tache du bus sur ESP32).
+
+Les echeances des electroaimants actifs sont rangées dans une DeadlineQueue (tas minimum) :
+chaque passage du timer ne traite que les notes arrivées a echeance, et nextDeadline() donne
+l'heure du prochain reveil necessaire.
+
+Precompensation de la latence mecanique : scheduleNote() ne frappe pas tout de suite mais a
+inputTime + STRIKE_DELAY - latence de la lame (table par note et par tranche de vélocité, en
+unités de STRIKE_LATENCY_UNIT µs), pour que chaque lame sonne exactement STRIKE_DELAY ms apres
+l'entrée. Les frappes en attente sont dans une seconde DeadlineQueue, servie par le meme timer
+quand il peut frapper (ESP32, HAL_TIMER_CAN_STRIKE), sinon par update() (AVR).
+Une frappe dont l'heure est deja passée part tout de suite.
+
+Notes repetées : chaque lame passe par prete (IDLE) -> electroaimant actif (PENDING, SENDING,
+ACTIVE) -> mailloche en retour (RETRACTING) pendant STRIKE_RECOVERY ms -> prete. Une frappe
+demandée avant que la lame soit prete n'est ni perdue ni comptée deux fois : elle est gardée
+(une par lame, la plus recente) et part a la fin du retour, au plus tot ou la mailloche peut
+refrapper. Une lame tient donc au mieux une frappe toutes les durée de frappe + STRIKE_RECOVERY ms.
+
+Alimentation commune : une note demandée n'est allumée (bit mis dans l'image des mcp) qu'a
+l'ecriture qui l'admet. Au plus COIL_MAX_ACTIVE electroaimants alimentés ensemble, dont la somme
+des courants (COIL_CURRENT au prorata du PWM) reste sous SUPPLY_CURRENT, et au plus
+COIL_STAGGER_GROUP allumages par ecriture : le reste d'un accord part COIL_STAGGER_US µs plus
+tard, ou a la coupure d'un electroaimant si la limite est atteinte. Les notes sont admises par
+priorité (note la plus haute ou vélocité la plus forte, COIL_PRIORITY_MELODY) : un accord dense
+est etalé de quelques centaines de µs au lieu de faire chuter l'alimentation.
+
+Echauffement : chaque frappe envoyée chauffe sa bobine (CoilThermal). Une bobine qui approche
+de sa limite frappe plus court, une frappe qui la depasserait attend que la bobine ait refroidi
+(la lame reste en RETRACTING, la frappe est gardée comme une refrappe). coilLoad() et
+thermalReport() donnent l'etat de chaque bobine.
+
+Reglages par lame (durée de frappe, PWM de la vélocité 0) : TIME_HIT et MIN_PWM_VALUE par
+defaut, remplacés par ceux de la calibration automatique (voir Calibration.h).
+
+Profil de frappe par lame (DRIVE_PROFILE) : l'electroaimant est alimenté au PWM de la frappe
+pendant une impulsion (une part de la durée de frappe) qui lance la mailloche, puis soit maintenu
+a un PWM reduit jusqu'a la fin de la frappe, soit coupé tout de suite. La fin de l'impulsion est
+une echeance de plus dans _releaseQueue : la sortie passe au PWM de maintien (PWM par sortie,
+COIL_DRIVER_PCA9685) et son courant est retiré de l'alimentation commune. Moins de temps a pleine
+puissance : la bobine chauffe moins, l'appel de courant d'un accord est plus court, et une
+coupure anticipée raccourcit le temps entre deux frappes de la lame.
+
+Nuances par la durée de frappe (VELOCITY_DWELL) : avec un seul PWM_PIN commun, le PWM d'une note
+change celui de toutes les notes alimentées. Dans ce mode le PWM reste a DWELL_PWM et la vélocité
+donne la durée de frappe de la lame, DWELL_CURVE % de sa durée calibrée : chaque note d'un accord
+garde sa nuance. Les durées sont en µs jusqu'a l'echeance de coupure (DeadlineQueue et timer).
+
+Aucun Serial.print dans le chemin des notes : frappes, allumages et coupures sont notés par
+Trace.h (quelques cycles, supprimés a la compilation selon TRACE_LEVEL).
+
+Tout acces au materiel passe par Hal.h, les sorties des electroaimants par CoilDriver.h.
 Les différents paramètres et réglages des notes sont dans settings.h
 ***********************************************************************************************************/
 
@@ -14,38 +72,108 @@ Les différents paramètres et réglages des notes sont dans settings.h
 #define XYLOPHONE_H
 
 #include <Arduino.h>
-#include <Wire.h>
-#include <Adafruit_MCP23X17.h>
 #include "settings.h"
-#include "Ticker.h"
+#include "Hal.h"
+#include "CoilDriver.h"
+#include "CoilMap.h"
+#include "DeadlineQueue.h"
+#include "Benchmark.h"
+#include "CoilThermal.h"
+#include "Trace.h"
+#include "Health.h"
 
 class Xylophone {
 public:
-  Xylophone(); // initialise le xylophone et le timer pour la gestion de l'extinction des electromaimants
-  void begin(); // initialise les pins en sorties
+  Xylophone(); // initialise le xylophone
+  void begin(); // initialise les pins en sorties et le timer de coupure des electroaimants
   void playNote(byte note, byte velocity);// active la note selectionné
+  void strike(byte note, int pwmValue, byte hitTime);// frappe avec un PWM et une durée en ms imposés (calibration)
+  void strikeDwell(byte note, int pwmValue, unsigned long dwell);// frappe avec une durée en µs
+  void scheduleNote(byte note, byte velocity, unsigned long inputTime);// frappe precompensée pour sonner a inputTime + STRIKE_DELAY
+  void setStrikeLatency(byte note, byte bucket, byte latency);// latence de la lame en unités de STRIKE_LATENCY_UNIT µs
+  byte strikeLatency(byte note, byte bucket) const;
+  void setHitTime(byte note, byte hitTime);// durée de frappe de la lame en ms
+  void setMinPwm(byte note, int pwmValue);// PWM de la lame pour la vélocité 0
   void reset();//desactive toutes les notes
-  void checkNoteOff();// boucle pour arreter les elecroaimants après le temps indiqué
-  void update();
+  void checkNoteOff();// coupe les elecroaimants dont l'echeance est passée et reprogramme le timer
+  void update();// envoie les sorties modifiées aux mcp
+  bool nextDeadline(unsigned long &time);// prochaine echeance de coupure en µs, false si aucune note active
+  byte activeCoils() const { return _energizedCount; }// electroaimants alimentés (compteurs de Health.h)
+  bool idle();// aucune note en cours ni en attente : le temps peut servir a autre chose (traces)
+  byte coilLoad(byte note);// echauffement de la bobine en % de sa limite
+  void thermalReport();// echauffement de toutes les bobines en une ligne JSON sur Serial
 
 private:
-  int _noteToMcpPin(byte note); // renvoi le numero de sortie du mcp en fct de la note
   void stopNote(byte midiNote);
-  //boucle du timer interupt
-  Ticker _electromagnetTicker;
-  static void _electromagnetTickerCallback();
-  
-  //parties gestions des notes 
-  Adafruit_MCP23X17 _mcp1;
-  Adafruit_MCP23X17 _mcp2;  
-  void getMaxMagnetPinBelow16();//init the hightest number used on mcp1
-  int _maxMcp1;
+  unsigned long velocityDwell(byte slot, byte velocity) const;// durée de frappe en µs (VELOCITY_DWELL)
+
+  //timer materiel de coupure des electroaimants
+  static void _releaseTimerCallback();
+  void armReleaseTimer();// programme le timer sur la prochaine echeance (coupure ou frappe) ou l'arrete
+
+  //frappes precompensées en attente : slot de la DeadlineQueue = case de _strikes
+  struct PendingStrike {
+    byte note;
+    byte velocity;
+  };
+  PendingStrike _strikes[STRIKE_QUEUE_SIZE];
+  DeadlineQueue<STRIKE_QUEUE_SIZE> _strikeQueue;
+  byte _strikeLatency[INSTRUMENT_RANGE][STRIKE_VELOCITY_BUCKETS];// copie modifiable de STRIKE_LATENCY
+  void checkStrikes();// frappe les notes dont l'heure est arrivée
+
+  //refrappe demandée pendant que la lame n'est pas prete, jouée a la fin du retour de la mailloche
+  struct Retrigger {
+    bool pending;
+    byte pwm;
+    unsigned long dwell;// µs
+  };
+  Retrigger _retriggers[INSTRUMENT_RANGE];
+  DeadlineQueue<INSTRUMENT_RANGE> _recoveryQueue;// fin du retour des mailloches des lames en RETRACTING
+  void checkRecovery();// lames redevenues pretes : joue leur refrappe en attente
+
+  //image en RAM des sorties par banques de 16 (registres OLATA/OLATB d'un mcp), envoyée par CoilDriver
+  volatile uint16_t _outputs[COIL_BANKS];
+  volatile bool _outputsDirty[COIL_BANKS];
+  byte _outputDuty[COIL_BANKS * 16];// PWM de chaque sortie allumée (COIL_DRIVER_PWM)
+  bool _releasePending;// une coupure est dans l'image, pas encore ecrite
+  unsigned long _releaseDeadline;// echeance de la plus ancienne de ces coupures
+  void setMagnet(byte slot, bool state);// modifie l'image des sorties sans acces au bus (COIL_MAP)
+  void flushOutputs();// admet les notes demandées et ecrit les images modifiées (une transaction par banque)
+  void writeReleases();// ecrit les images modifiées sans rien admettre (coupures depuis le timer AVR)
+  bool takeOutputs(uint16_t *outputs, bool *dirty, unsigned long &releaseDeadline);// sous halLock()
+  void holdMagnet(byte slot);// fin de l'impulsion : sortie au PWM de maintien
+
+  //admission des notes demandées selon l'alimentation
+  byte _strikePwm[INSTRUMENT_RANGE];// PWM demandé par la frappe en cours
+  unsigned long _kickDwell[INSTRUMENT_RANGE];// durée de l'impulsion en µs (= _strikeDwell sans maintien)
+  byte _holdPwm[INSTRUMENT_RANGE];// PWM de maintien apres l'impulsion
+  volatile bool _holding[INSTRUMENT_RANGE];// impulsion finie, sortie au PWM de maintien
+  byte _energizedCount;// electroaimants alimentés (SENDING et ACTIVE)
+  unsigned long _energizedCurrent;// somme de leurs courants en mA
+  bool _staggered;// reste d'un accord en attente du prochain groupe d'allumages
+  unsigned long _admissionTime;// heure du prochain groupe si _staggered
+  unsigned long coilCurrent(byte slot) const;
+  bool before(byte a, byte b) const;// a passe avant b
+  byte admitPending(unsigned long now);// allume les notes admises, en tete de _pendingSlots
+
+  //echauffement des bobines, sous halBusLock() (jamais sous halLock() : exp() est lent) : sur ESP32
+  //le callback du timer peut frapper dans une autre tache que celle de strikeDwell()
+  CoilThermal _thermal;
+
+  //etat d'une lame : prete (IDLE), demandée (PENDING), en cours d'envoi aux mcp (SENDING),
+  //electroaimant actif (ACTIVE), mailloche en retour apres la coupure (RETRACTING)
+  enum NoteState : byte { NOTE_IDLE, NOTE_PENDING, NOTE_SENDING, NOTE_ACTIVE, NOTE_RETRACTING };
 
   static const byte _instrumentStartNote= INSTRUMENT_START_NOTE;
   static const byte _instrumentRange = INSTRUMENT_RANGE;
-  unsigned long _noteStartTime[INSTRUMENT_RANGE];
-  bool _noteActive[INSTRUMENT_RANGE];
-  int _playingNotesCount = 0;// nombre de notes/electroaimants actif
+  DeadlineQueue<INSTRUMENT_RANGE> _releaseQueue;// echeances de coupure en µs des notes actives
+  volatile byte _noteState[INSTRUMENT_RANGE];
+  byte _hitTime[INSTRUMENT_RANGE];// durée de frappe de chaque lame en ms
+  byte _minPwm[INSTRUMENT_RANGE];// PWM de chaque lame pour la vélocité 0
+  unsigned long _strikeDwell[INSTRUMENT_RANGE];// durée de la frappe en cours, en µs
+  byte _pendingSlots[INSTRUMENT_RANGE];// notes demandées, dans l'ordre
+  volatile byte _pendingCount = 0;
+  volatile int _playingNotesCount = 0;// nombre de notes/electroaimants actif
 };
 
 #endif // XYLOPHONE_H
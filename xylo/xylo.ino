@@ -24,10 +24,11 @@ void setup() {
  //   delay(10); // Attendre que la connexion série soit établie
  // }
   midiHandler.begin();//definition de tout les pins etc
-  Serial.println("Orchestrion : Xylophone MIDI Controller");  
+  Serial.println(F("Orchestrion : Xylophone MIDI Controller"));  
  
   // midiHandler.test(true); // Joue la mélodie spécifiée dans INIT_MELODY
    midiHandler.test(false);  // Joue toutes les notes l'une après l'autre avec 200 ms entre chaque note
+  // midiHandler.benchmark(); // Mesure latence/gigue (BENCHMARK_ENABLED dans settings.h), resultats JSON sur Serial
 
 }
 
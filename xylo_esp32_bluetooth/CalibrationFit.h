@@ -0,0 +1,78 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+------------------------------------    CALIBRATIONFIT.H    ---------------------------------------------
+_________________________________________________________________________________________________________
+Calculs de la calibration automatique, sans aucun acces au materiel
+
+EnvelopeDetector analyse le signal du capteur (piezo ou micro) echantillon par echantillon,
+sans garder la trace : niveau de repos moyen avant la frappe, puis instant ou l'ecart au repos
+depasse le seuil (interpolé entre deux echantillons) et amplitude crete.
+LinearFit ajuste une droite par moindres carrés (crete ou latence en fonction du PWM).
+Les fonctions calibration*() tirent de ces droites les reglages d'une lame.
+
+Rien ici ne depend d'Arduino.h, de Hal.h ni des mcp : ces calculs se verifient sur PC avec des
+traces ADC synthetiques (sim/test_calibration_fit.cpp), comme Xylophone avec sim/Hal.cpp.
+***********************************************************************************************************/
+
+#ifndef CALIBRATION_FIT_H
+#define CALIBRATION_FIT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// resultat de la calibration d'une lame, tel qu'enregistré en EEPROM/NVS
+struct NoteCalibration {
+  float levelOffset;      // crete = levelOffset + levelSlope * pwm (unités ADC)
+  float levelSlope;
+  float latencyOffset;    // latence commande -> son = latencyOffset + latencySlope * pwm (µs)
+  float latencySlope;
+  uint8_t hitTime;        // durée d'activation retenue en ms
+  uint8_t valid;          // 1 si la lame a été calibrée
+};
+
+class EnvelopeDetector {
+public:
+  EnvelopeDetector();
+  void reset(int threshold);                    // nouvelle mesure, seuil en unités ADC au dessus du repos
+  void baseline(int sample);                    // echantillon au repos, avant la frappe
+  void feed(unsigned long elapsed, int sample); // echantillon apres la commande, elapsed en µs
+  bool detected() const { return _detected; }
+  unsigned long onset() const { return _onset; }// µs entre la commande et le son
+  int peak() const { return _peak; }            // ecart crete au repos
+
+private:
+  long _sum;
+  unsigned int _count;
+  int _threshold;
+  bool _detected;
+  unsigned long _onset;
+  int _peak;
+  unsigned long _lastElapsed;
+  int _lastLevel;
+};
+
+class LinearFit {
+public:
+  LinearFit();
+  void reset();
+  void add(float x, float y);
+  uint8_t count() const { return _count; }
+  bool solve(float &offset, float &slope) const;// false s'il n'y a pas deux x differents
+
+private:
+  uint8_t _count;
+  float _sx;
+  float _sy;
+  float _sxx;
+  float _sxy;
+};
+
+// plus courte durée dont la crete atteint (100 - tolerance)% de la meilleure, 0 si aucun son
+uint8_t calibrationDwell(const int *peaks, const uint8_t *dwells, uint8_t count, uint8_t tolerance);
+// PWM qui donne la crete level, borné a [0, 255] ; fallback si la crete ne croit pas avec le PWM
+int calibrationMinPwm(const NoteCalibration &calibration, int level, int fallback);
+// latence prevue en µs pour ce PWM (jamais negative)
+unsigned long calibrationLatency(const NoteCalibration &calibration, int pwm);
+
+#endif // CALIBRATION_FIT_H
@@ -0,0 +1,56 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+--------------------------------------    COILDRIVER.H    -----------------------------------------------
+_________________________________________________________________________________________________________
+Cartes de sortie des electroaimants, choisies dans settings.h par COIL_DRIVER
+
+Xylophone garde l'image des sorties en COIL_BANKS banques de 16 bits (la sortie n de magnetPins
+est le bit n & 15 de la banque n >> 4, voir CoilMap.h) et ne connait que coilDriverBegin(), coilDriverWrite() et
+coilDriverSync(). Chaque carte traduit ces banques a sa facon :
+
+- COIL_DRIVER_MCP23017 : un mcp23017 I2C par banque (MCP_BASE_ADDR + banque), ecritures en
+  arriere plan par Hal (halExpanderWrite)
+- COIL_DRIVER_MCP23S17 : un mcp23s17 SPI par banque sur le meme COIL_SPI_CS_PIN, adresse
+  materielle (A2..A0) = numero de banque, GPIOA/GPIOB en une trame de 4 octets
+- COIL_DRIVER_74HC595  : COIL_595_COUNT registres a decalage chainés, poussés en une seule trame
+  SPI a chaque ecriture ; COIL_SPI_CS_PIN est le verrou (RCLK) de la chaine. Le premier registre
+  (sortie 0 a 7) est celui relié a MOSI : il est envoyé en dernier
+- COIL_DRIVER_GPIO     : une broche par sortie, la sortie n est COIL_GPIO_PINS[n] ; seules les
+  broches qui changent sont ecrites
+- COIL_DRIVER_PCA9685  : un pca9685 I2C par banque (PCA9685_BASE_ADDR + banque), chaque sortie
+  allumée avec son propre rapport cyclique (duty[]). Les voies modifiées d'une carte partent en
+  une seule trame (registres LEDn consecutifs, auto incrément), en arriere plan comme les mcp
+
+Les cartes SPI ecrivent tout de suite (quelques µs a COIL_SPI_FREQ), coilDriverSync() n'attend
+que le bus I2C. Une trame I2C abandonnée apres HAL_I2C_RETRIES essais (halI2cLost()) fait
+réécrire l'image de sa carte a l'appel suivant de coilDriverWrite(), meme sans modification.
+
+Rien ici ne touche directement au materiel : tout passe par Hal.h. Chaque carte est verifiée sur
+PC par sim/test_coil_driver.cpp, compilé une fois par valeur de COIL_DRIVER avec sim/Hal.cpp qui
+enregistre les trames I2C/SPI et les broches.
+***********************************************************************************************************/
+
+#ifndef COIL_DRIVER_H
+#define COIL_DRIVER_H
+
+#include <Arduino.h>
+#include "settings.h"
+
+#define COIL_BANKS COIL_EXPANDERS             // banques de 16 sorties de l'image de Xylophone
+
+// PWM par sortie (pca9685) : le PWM commun PWM_PIN reste au maximum pendant les frappes
+#define COIL_DRIVER_PWM (COIL_DRIVER == COIL_DRIVER_PCA9685)
+
+#if COIL_DRIVER == COIL_DRIVER_74HC595
+static_assert(COIL_595_COUNT <= COIL_BANKS * 2, "COIL_595_COUNT depasse les sorties de l'image");
+#endif
+
+bool coilDriverBegin();                       // toutes les sorties a LOW, false si une carte ne repond pas
+// envoie les banques modifiées (dirty[i]), outputs[] est l'image complete et duty[] le PWM (0..255)
+// de chaque sortie, lu seulement si COIL_DRIVER_PWM. Appelé sous halBusLock(), jamais sous halLock() ;
+// ne bloque que le temps d'une trame SPI
+void coilDriverWrite(const uint16_t *outputs, const bool *dirty, const byte *duty);
+bool coilDriverSync();                        // attend la fin des ecritures, false si une carte n'a pas repondu
+
+#endif // COIL_DRIVER_H
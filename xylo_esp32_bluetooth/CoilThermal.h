@@ -0,0 +1,43 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+--------------------------------------    COILTHERMAL.H    ----------------------------------------------
+_________________________________________________________________________________________________________
+Echauffement de chaque electroaimant, pour jouer longtemps au maximum sans le griller
+
+Modele du premier ordre : chaque frappe apporte une chaleur egale a sa durée en ms multipliée
+par (PWM / 255)² (la puissance varie comme le carré de la tension), et la chaleur de chaque
+bobine decroit en exp(-t / COIL_THERMAL_TAU). Une bobine frappée sans arret avec un rapport
+cyclique d a pleine puissance tend vers d * COIL_THERMAL_TAU : la limite est donc fixée par le
+rapport cyclique tenu en continu, COIL_DUTY_LIMIT % de COIL_THERMAL_TAU.
+
+Au dessus de COIL_DERATE_START % de la limite la durée de frappe est reduite progressivement,
+jusqu'a COIL_DERATE_MIN_HIT % a la limite ; une frappe qui depasserait encore la limite est
+retardée du temps de refroidissement necessaire (voir allow()).
+
+Une seule date pour toutes les bobines : cool() les refroidit toutes d'un seul exp().
+Rien ici ne depend de Hal.h, comme CalibrationFit.
+***********************************************************************************************************/
+
+#ifndef COIL_THERMAL_H
+#define COIL_THERMAL_H
+
+#include <Arduino.h>
+#include "settings.h"
+
+class CoilThermal {
+public:
+  CoilThermal();
+  void clear();                                 // bobines froides
+  void cool(unsigned long now);                 // refroidit jusqu'a now (µs)
+  void heat(byte slot, unsigned long dwell, byte pwm);// frappe de dwell µs envoyée a la bobine
+  // durée de frappe permise (µs) et attente avant la frappe (µs, 0 = tout de suite), apres cool()
+  unsigned long allow(byte slot, unsigned long dwell, byte pwm, unsigned long &wait) const;
+  byte load(byte slot) const;                   // chaleur en % de la limite, 255 au plus
+
+private:
+  float _heat[INSTRUMENT_RANGE];                // chaleur en ms de frappe a pleine puissance
+  unsigned long _time;                          // date du dernier cool()
+};
+
+#endif // COIL_THERMAL_H
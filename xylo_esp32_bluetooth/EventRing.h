@@ -0,0 +1,85 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+---------------------------------------     EVENTRING.H    ----------------------------------------------
+_________________________________________________________________________________________________________
+File circulaire sans verrou entre la reception MIDI et l'actionnement des electroaimants.
+Un seul producteur (reception) et un seul consommateur (actionnement) : chacun ne modifie que
+son propre index, publié avec un store "release" et lu avec un load "acquire", ce qui suffit
+sur AVR (index sur un octet) comme sur ESP32 (deux coeurs).
+
+N doit etre une puissance de 2. Une case reste toujours vide pour distinguer plein et vide.
+***********************************************************************************************************/
+
+#ifndef EVENT_RING_H
+#define EVENT_RING_H
+
+#include <Arduino.h>
+
+// evenement MIDI compact, deja filtré sur le canal
+struct MidiEvent {
+  byte type;          // 0x80 note off, 0x90 note on, 0xB0 control change
+  byte data1;
+  byte data2;
+  unsigned long time; // instant de reception, ou instant de jeu prévu si playout (halMicros)
+};
+
+template <typename T, byte N>
+class EventRing {
+public:
+  EventRing() : _head(0), _tail(0), _dropped(0) {}
+
+  // coté producteur
+  bool push(const T &item) {
+    byte head = __atomic_load_n(&_head, __ATOMIC_RELAXED);
+    byte next = (head + 1) & (N - 1);
+    if (next == __atomic_load_n(&_tail, __ATOMIC_ACQUIRE)) {
+      _dropped++;
+      return false;
+    }
+    _items[head] = item;
+    __atomic_store_n(&_head, next, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  bool full() const {
+    byte next = (__atomic_load_n(&_head, __ATOMIC_RELAXED) + 1) & (N - 1);
+    return next == __atomic_load_n(&_tail, __ATOMIC_ACQUIRE);
+  }
+
+  // coté consommateur
+  bool pop(T &item) {
+    byte tail = __atomic_load_n(&_tail, __ATOMIC_RELAXED);
+    if (tail == __atomic_load_n(&_head, __ATOMIC_ACQUIRE)) {
+      return false;
+    }
+    item = _items[tail];
+    __atomic_store_n(&_tail, (byte)((tail + 1) & (N - 1)), __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // lit le prochain evenement sans le retirer de la file
+  bool peek(T &item) const {
+    byte tail = __atomic_load_n(&_tail, __ATOMIC_RELAXED);
+    if (tail == __atomic_load_n(&_head, __ATOMIC_ACQUIRE)) {
+      return false;
+    }
+    item = _items[tail];
+    return true;
+  }
+
+  bool empty() const {
+    return __atomic_load_n(&_tail, __ATOMIC_RELAXED) == __atomic_load_n(&_head, __ATOMIC_ACQUIRE);
+  }
+
+  unsigned int dropped() const { return _dropped; }// evenements perdus car la file etait pleine
+
+private:
+  static_assert(N >= 2 && N <= 128 && (N & (N - 1)) == 0, "EventRing : N doit etre une puissance de 2");
+  T _items[N];
+  byte _head;          // prochaine case a ecrire, modifié seulement par le producteur
+  byte _tail;          // prochaine case a lire, modifié seulement par le consommateur
+  unsigned int _dropped;
+};
+
+#endif // EVENT_RING_H
@@ -0,0 +1,46 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+---------------------------------------     HEALTH.CPP     ----------------------------------------------
+_________________________________________________________________________________________________________
+Compteurs de fonctionnement
+
+***********************************************************************************************************/
+
+#include "Health.h"
+#include "Hal.h"
+
+HealthCounters health = {};
+
+void healthMax(uint32_t &counter, unsigned long value) {
+  halLock();
+  if (value > counter) {
+    counter = value;
+  }
+  halUnlock();
+}
+
+void healthMessage(byte *message, byte activeCoils) {
+  HealthCounters counters;
+  halLock();
+  counters = health;
+  halUnlock();
+  counters.activeCoils = activeCoils;
+
+  const uint32_t *values = (const uint32_t *)&counters;
+  byte length = 0;
+  message[length++] = 0xF0;
+  message[length++] = SYSEX_MANUFACTURER_ID;
+  message[length++] = SYSEX_DEVICE_ID;
+  message[length++] = HEALTH_SYSEX_COMMAND;
+  message[length++] = HEALTH_VERSION;
+  message[length++] = HEALTH_COUNTERS;
+  for (byte i = 0; i < HEALTH_COUNTERS; i++) {
+    uint32_t value = values[i];
+    for (byte j = 0; j < 5; j++) {
+      message[length++] = value & 0x7F;
+      value >>= 7;
+    }
+  }
+  message[length] = 0xF7;
+}
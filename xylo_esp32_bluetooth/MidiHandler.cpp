@@ -12,18 +12,26 @@ Version ESP32
 #include <Arduino.h>
 #include "settings.h"
 
+#define SMF_MARK_EVENT 0x00   // type de la marque d'une demande SMF_CONTROL_CC dans _fileEvents (data1 : sequence)
+
 // Instance statique pour les callbacks
 MidiHandler* MidiHandler::_instance = nullptr;
 
 // ----------------------------------      PUBLIC  --------------------------------------------
 
-MidiHandler::MidiHandler(Xylophone &xylophone) : _xylophone(xylophone), _bleConnected(false), _bleEnabled(BLE_ENABLED_BY_DEFAULT) {
+MidiHandler::MidiHandler(Xylophone &xylophone) : _xylophone(xylophone), _bleConnected(false), _bleEnabled(BLE_ENABLED_BY_DEFAULT), _calibration(xylophone) {
   _extraOctaveEnabled = digitalRead(EXTRA_OCTAVE_SWITCH_PIN) == LOW;
   _buttonPressTime = 0;
   _buttonPressed = false;
   _lastLedToggle = 0;
   _ledState = false;
+  _playoutSynced = false;
   _instance = this;
+  _fileRequest = 0;
+  _fileSequence = 0;
+  _fileSequenceSeen = 0;
+  _fileSequenceDone = 0;
+  _fileMarkPending = false;
 
   if(DEBUG_HANDLER){
     Serial.println(F("constructor handler (ESP32 BLE)"));
@@ -45,6 +53,8 @@ void MidiHandler::begin() {
   #endif
 
   _xylophone.begin();
+  _player.begin();
+  _calibration.begin();           // reglages de la derniere calibration
 
   // Initialisation BLE selon la configuration
   if (_bleEnabled) {
@@ -65,6 +75,7 @@ void MidiHandler::begin() {
 void MidiHandler::onConnected() {
   if(_instance) {
     _instance->_bleConnected = true;
+    _instance->_playoutSynced = false; // nouvel emetteur, nouvelle horloge
     Serial.println("BLE MIDI Connecté!");
   }
 }
@@ -72,18 +83,24 @@ void MidiHandler::onConnected() {
 void MidiHandler::onDisconnected() {
   if(_instance) {
     _instance->_bleConnected = false;
-    _instance->_xylophone.reset();
+    _instance->queueEvent(0xB0, 123, 0, halMicros()); // all notes off, executé par la tache d'actionnement
     Serial.println("BLE MIDI Déconnecté!");
   }
 }
 
 void MidiHandler::onNoteOn(uint8_t channel, uint8_t note, uint8_t velocity, uint16_t timestamp) {
   if(_instance) {
+    if (velocity > 0) {
+      health.notesReceived++;
+    }
     // Vérification du canal
     if (!ALL_CHANNEL && channel != CHANNEL_XYLO) {
+      if (velocity > 0) {
+        health.notesFiltered++;
+      }
       return;
     }
-    _instance->handleNoteOn(note, velocity);
+    _instance->queueEvent(0x90, note, velocity, _instance->eventTime(timestamp));
   }
 }
 
@@ -93,7 +110,7 @@ void MidiHandler::onNoteOff(uint8_t channel, uint8_t note, uint8_t velocity, uin
     if (!ALL_CHANNEL && channel != CHANNEL_XYLO) {
       return;
     }
-    _instance->handleNoteOff(note);
+    _instance->queueEvent(0x80, note, velocity, _instance->eventTime(timestamp));
   }
 }
 
@@ -103,7 +120,7 @@ void MidiHandler::onControlChange(uint8_t channel, uint8_t control, uint8_t valu
     if (!ALL_CHANNEL && channel != CHANNEL_XYLO) {
       return;
     }
-    _instance->handleControlChange(control, value);
+    _instance->queueEvent(0xB0, control, value, _instance->eventTime(timestamp));
   }
 }
 
@@ -113,14 +130,18 @@ void MidiHandler::onControlChange(uint8_t channel, uint8_t control, uint8_t valu
 void MidiHandler::test(bool playMelody) {
   if (playMelody) {
     for (size_t i = 0; i < sizeof(INIT_MELODY) / sizeof(INIT_MELODY[0]); i++) {
-      handleNoteOn(INIT_MELODY[i], 127);
-      delay(INIT_MELODY_DELAY[i]);
-      handleNoteOff(INIT_MELODY[i]);
+      _rxTime = halMicros() - STRIKE_DELAY * 1000UL; // deja en retard : frappe immediate, sans precompensation
+      handleNoteOn(pgm_read_byte(&INIT_MELODY[i]), 127);
+      _xylophone.update(); // envoie la note aux mcp
+      delay(pgm_read_byte(&INIT_MELODY_DELAY[i]));
+      handleNoteOff(pgm_read_byte(&INIT_MELODY[i]));
     }
   } else {
     // Joue toutes les notes l'une après l'autre
     for (byte note = INSTRUMENT_START_NOTE; note < INSTRUMENT_START_NOTE + INSTRUMENT_RANGE; note++) {
+      _rxTime = halMicros() - STRIKE_DELAY * 1000UL; // deja en retard : frappe immediate, sans precompensation
       handleNoteOn(note, 127);
+      _xylophone.update(); // envoie la note aux mcp
       delay(20);
       _xylophone.update();
       handleNoteOff(note);
@@ -133,12 +154,272 @@ void MidiHandler::test(bool playMelody) {
   }
 }
 
-void MidiHandler::update() {
+//*********************************************************************************************
+//******************          LATENCY BENCHMARK
+
+// rejoue des charges de reference a travers le handler et envoie les histogrammes sur Serial
+void MidiHandler::benchmark() {
+  if (!BENCHMARK_ENABLED) {
+    Serial.println(F("benchmark : mettre BENCHMARK_ENABLED a true dans settings.h"));
+    return;
+  }
+  unsigned long t;
+
+  // notes seules : toutes les notes de l'instrument a 100ms d'intervalle
+  benchReset();
+  t = halMicros();
+  for (byte i = 0; i < INSTRUMENT_RANGE; i++) {
+    benchWait(t += 100000UL);
+    benchNoteOn(INSTRUMENT_START_NOTE + i, 100);
+  }
+  benchWait(t + 100000UL);
+  benchReport("single_notes");
+
+  // accords denses : 20 accords de 6 notes a 150ms, vélocités differentes
+  benchReset();
+  t = halMicros();
+  for (byte c = 0; c < 20; c++) {
+    benchWait(t += 150000UL);
+    for (byte i = 0; i < 6; i++) {
+      benchNoteOn(INSTRUMENT_START_NOTE + (c + i * 4) % INSTRUMENT_RANGE, 70 + i * 10);
+    }
+  }
+  benchWait(t + 150000UL);
+  benchReport("dense_chords");
+
+  // notes repetées rapides : 50 frappes de la meme note toutes les 40ms
+  benchReset();
+  t = halMicros();
+  for (byte i = 0; i < 50; i++) {
+    benchWait(t += 40000UL);
+    benchNoteOn(INSTRUMENT_START_NOTE + INSTRUMENT_RANGE / 2, 100);
+  }
+  benchWait(t + 100000UL);
+  benchReport("fast_repeats");
+
+  // salves : accord de 8 notes coupé 5ms plus tard par un all notes off (CC 123)
+  benchReset();
+  t = halMicros();
+  for (byte c = 0; c < 10; c++) {
+    benchWait(t += 200000UL);
+    for (byte i = 0; i < 8; i++) {
+      benchNoteOn(INSTRUMENT_START_NOTE + (c + i * 3) % INSTRUMENT_RANGE, 100);
+    }
+    benchWait(t + 5000UL);          // all notes off au milieu des frappes
+    benchControl(123, 0);
+  }
+  benchWait(t + 200000UL);
+  benchReport("all_notes_off_bursts");
+}
+
+// les charges passent par les callbacks de la bibliotheque MIDI, puis par la file d'evenements
+void MidiHandler::benchNoteOn(byte note, byte velocity) {
+  onNoteOn(CHANNEL_XYLO, note, velocity, benchTimestamp());
+}
+
+void MidiHandler::benchControl(byte control, byte value) {
+  onControlChange(CHANNEL_XYLO, control, value, benchTimestamp());
+}
+
+// horloge de l'emetteur = horloge locale : le chemin du timestamp BLE est parcouru sans gigue
+uint16_t MidiHandler::benchTimestamp() {
+  return (uint16_t)((halMicros() / 1000UL) & 0x1FFF);
+}
+
+// la tache d'actionnement n'est pas encore lancée : on fait son travail ici
+void MidiHandler::benchWait(unsigned long until) {
+  while ((long)(halMicros() - until) < 0) {
+    processEvents();
+    _xylophone.update();
+  }
+}
+
+//*********************************************************************************************
+//******************          START THE PIPELINE
+
+void MidiHandler::start() {
+  halActuationBegin(actuationTask);  // coeur ACTUATION_CORE : seule tache a toucher aux mcp et au PWM
+  halTransportBegin(transportTask);  // coeur TRANSPORT_CORE : bouton d'appairage et LED (la pile BLE tourne deja sur le coeur 0)
+}
+
+// appelé par la tache d'actionnement a chaque reveil (evenement en file ou echeance du timer)
+void MidiHandler::actuationTask() {
+  unsigned long start = halMicros();
+  _instance->processEvents();
+  _instance->playFile();
+  _instance->playRoll();
+  _instance->calibrate();
+  _instance->_xylophone.update();
+  healthMax(health.maxLoopTime, halMicros() - start);
+}
+
+void MidiHandler::transportTask() {
+  _instance->pollTransport();
+}
+
+//*********************************************************************************************
+//******************          QUEUE BETWEEN TRANSPORT AND ACTUATION
+
+// coté transport : un seul producteur (les callbacks de la pile BLE)
+void MidiHandler::queueEvent(byte type, byte data1, byte data2, unsigned long time) {
+  MidiEvent event = { type, data1, data2, time };
+  if (_events.push(event)) {
+    halActuationWake();
+  }
+}
+
+// coté actionnement : traite tous les evenements en file dont l'heure de jeu est arrivée,
+// ils partent dans la meme ecriture
+void MidiHandler::processEvents() {
+  MidiEvent event;
+  while (_events.peek(event)) {
+    if (BLE_PLAYOUT_ENABLED) {
+      long wait = (long)(event.time - halMicros());
+      if (wait > 0) {
+        halActuationWakeAt(wait); // les evenements suivants sont plus tardifs
+        break;
+      }
+    }
+    _events.pop(event);
+    _rxTime = event.time;
+    switch (event.type) {
+      case 0x80: // Note Off
+        handleNoteOff(event.data1);
+        break;
+      case 0x90: // Note On
+        handleNoteOn(event.data1, event.data2);
+        break;
+      case 0xB0: // Control Change
+        handleControlChange(event.data1, event.data2);
+        break;
+    }
+  }
+}
+
+// coté transport : applique le dernier CC SMF_CONTROL_CC, puis decode le fichier jusqu'a
+// SMF_LOOKAHEAD ms en avance ; les lectures LittleFS restent hors du coeur des electroaimants
+void MidiHandler::feedFile() {
+  uint16_t request = __atomic_load_n(&_fileRequest, __ATOMIC_ACQUIRE);
+  if ((byte)(request >> 8) != _fileSequenceDone) {
+    _fileSequenceDone = request >> 8;
+    _player.stop();
+    byte value = request & 0x7F;
+    if (value > 0) {
+      char path[16];
+      snprintf(path, sizeof(path), "/midi/%d.mid", value);
+      _player.play(path, halMicros());
+    }
+    _fileMarkPending = true;
+  }
+
+  bool queued = false;
+  if (_fileMarkPending) {
+    // marque de la demande : la tache d'actionnement jette les notes d'avant (fichier remplacé)
+    MidiEvent mark = { SMF_MARK_EVENT, _fileSequenceDone, 0, 0 };
+    if (!_fileEvents.push(mark)) {
+      return;
+    }
+    _fileMarkPending = false;
+    queued = true;
+  }
+  MidiEvent event;
+  while (!_fileEvents.full() && _player.next(halMicros() + SMF_LOOKAHEAD * 1000UL, event)) {
+    _fileEvents.push(event);
+    queued = true;
+  }
+  if (queued) {
+    halActuationWake();
+  }
+}
+
+// coté actionnement : joue les notes du fichier arrivées a echeance et programme le reveil suivant
+void MidiHandler::playFile() {
+  MidiEvent event;
+  while (_fileEvents.peek(event)) {
+    if (event.type == SMF_MARK_EVENT) {
+      _fileSequenceSeen = event.data1;
+    } else if (_fileSequenceSeen == _fileSequence) {
+      long wait = (long)(event.time - halMicros());
+      if (wait > 0) {
+        halActuationWakeAt(wait); // les notes suivantes sont plus tardives
+        break;
+      }
+      _rxTime = event.time;
+      if (event.type == 0x90) {
+        handleNoteOn(event.data1, event.data2);
+      } else {
+        handleNoteOff(event.data1);
+      }
+    }
+    _fileEvents.pop(event);       // sinon : note d'une demande remplacée, jetée
+  }
+}
+
+// coté actionnement : coups des roulements arrivés a echeance, puis reveil sur le suivant
+void MidiHandler::playRoll() {
+  byte note;
+  byte velocity;
+  unsigned long time;
+  while (_roll.next(halMicros(), note, velocity, time)) {
+    _xylophone.scheduleNote(note, velocity, time);
+  }
+  unsigned long next;
+  if (_roll.nextTime(next)) {
+    long wait = (long)(next - halMicros());
+    halActuationWakeAt(wait > 0 ? wait : 0);
+  }
+}
+
+// coté actionnement : une lecture du capteur par reveil, reveil suivant a l'echantillon d'apres
+void MidiHandler::calibrate() {
+  if (_calibration.running()) {
+    _calibration.update(halMicros());
+    halActuationWakeAt(CALIBRATION_SAMPLE_INTERVAL);
+  }
+}
+
+// heure de jeu d'un evenement BLE-MIDI : immediate, ou heure emetteur + BLE_PLAYOUT_LATENCY
+unsigned long MidiHandler::eventTime(uint16_t timestamp) {
+  unsigned long now = halMicros();
+  if (!BLE_PLAYOUT_ENABLED) {
+    return now;
+  }
+  timestamp &= 0x1FFF;
+
+  if (!_playoutSynced) {
+    _senderTime = 0;
+    _playoutOffset = now;
+    _playoutSynced = true;
+  } else {
+    // timestamp attendu d'apres le temps ecoulé localement, l'ecart reel est pris modulo 8192ms
+    // dans [-4096, 4095] : le rebouclage du timestamp est ainsi deroulé
+    unsigned long elapsed = (now - _lastArrival) / 1000;
+    int delta = (int)((timestamp - _lastTimestamp - elapsed) & 0x1FFF);
+    if (delta >= 4096) {
+      delta -= 8192;
+    }
+    _senderTime += (elapsed + delta) * 1000UL;
+  }
+  _lastTimestamp = timestamp;
+  _lastArrival = now;
+
+  // retard de ce paquet par rapport au moins retardé : negatif on suit le nouveau minimum,
+  // au dela de BLE_PLAYOUT_LATENCY le paquet serait joué en retard, on se recale dessus
+  long lag = (long)(now - (_senderTime + _playoutOffset));
+  if (lag < 0 || lag > BLE_PLAYOUT_LATENCY * 1000L) {
+    _playoutOffset += lag;
+  }
+  return _senderTime + _playoutOffset + BLE_PLAYOUT_LATENCY * 1000UL;
+}
+
+void MidiHandler::pollTransport() {
   #if USE_PAIRING_BUTTON
   updatePairingButton();  // Gestion du bouton d'appairage (si activé)
   updateStatusLed();      // Gestion de la LED de statut (si activé)
   #endif
-  _xylophone.update();
+
+  feedFile();             // lectures LittleFS du fichier MIDI en cours
+  traceDrain();           // hors du coeur des electroaimants, sans attendre le port serie
 }
 
 // ----------------------------------      PRIVATE  --------------------------------------------
@@ -166,12 +447,17 @@ void MidiHandler::handleNoteOn(byte note, byte velocity) {
   // Vérifiez si la note est dans la plage jouable du xylophone
   if (isNotePlayable(note)) {
     if(velocity > 0) {
-      if(DEBUG_HANDLER){
-        Serial.print(F("MIDIHandler noteOn = "));
-        Serial.println(note);
+      TRACE_EVENT(TRACE_NOTE_ON, note, velocity);
+      if (BENCHMARK_ENABLED) {
+        benchNoteReceived(note - INSTRUMENT_START_NOTE, _rxTime);
       }
-      _xylophone.playNote(note, velocity);
+      _xylophone.scheduleNote(note, velocity, _rxTime);
+      _roll.noteOn(note, velocity, _rxTime); // refrappée tant qu'elle est tenue si le roulement est armé
+    } else {
+      _roll.noteOff(note);            // note on de vélocité 0 = note off
     }
+  } else if (velocity > 0) {
+    health.notesOutOfRange++;
   }
 }
 
@@ -188,10 +474,8 @@ void MidiHandler::handleNoteOff(byte note) {
   }
 
   if (isNotePlayable(note)) {
-    if(DEBUG_HANDLER){
-      Serial.print(F("MIDIHandler noteOff = "));
-      Serial.println(note);
-    }
+    TRACE_EVENT(TRACE_NOTE_OFF, note, 0);
+    _roll.noteOff(note);              // fin du roulement de cette note
   }
 }
 
@@ -201,11 +485,34 @@ void MidiHandler::handleNoteOff(byte note) {
 void MidiHandler::handleControlChange(byte control, byte value) {
   switch (control) {
     case 121: // Réinitialisation de tous les contrôleurs
+      _roll.setRate(0, halMicros());
+      _roll.setShape(64);
       _xylophone.reset();
       break;
     case 123: // Désactiver toutes les notes
+      _roll.clear();
       _xylophone.reset();
       break;
+    case ROLL_CC: // cadence des roulements, 0 = desarmé
+      _roll.setRate(value, halMicros());
+      break;
+    case ROLL_SHAPE_CC: // forme de la vélocité des roulements
+      _roll.setShape(value);
+      break;
+    case THERMAL_REPORT_CC: // echauffement des bobines (voir CoilThermal.h)
+      _xylophone.thermalReport();
+      break;
+    case CALIBRATION_CC: // calibration automatique avec le capteur (voir Calibration.h)
+      if (value == 0) {
+        _calibration.stop();
+      } else {
+        _calibration.start(halMicros());
+      }
+      break;
+    case SMF_CONTROL_CC: // lecture d'un fichier MIDI de LittleFS, par la tache de transport
+      _fileSequence++;            // les notes deja en file pour la demande precedente seront jetées
+      __atomic_store_n(&_fileRequest, (uint16_t)((_fileSequence << 8) | value), __ATOMIC_RELEASE);
+      break;
   }
 }
 
@@ -17,6 +17,28 @@ noteOff : Enregistre le noteOff pour gérer les compteurs de notes actives
 controle change :
   - CC 121 : Réinitialisation de tous les contrôleurs
   - CC 123 : Désactiver toutes les notes
+  - CC THERMAL_REPORT_CC : envoie l'echauffement de chaque bobine en JSON sur Serial
+  - CC CALIBRATION_CC : valeur > 0 lance la calibration automatique des lames, 0 l'arrete
+  - CC ROLL_CC / ROLL_SHAPE_CC : cadence et forme des roulements generés par la carte (voir Roll.h),
+    les notes tenues sont refrappées jusqu'a leur note off
+
+Pipeline FreeRTOS (demarré par start()) :
+  - tache de transport sur TRANSPORT_CORE : la radio et les callbacks MIDI ne font que
+    ranger les messages dans une EventRing (file sans verrou, un producteur/un consommateur)
+  - tache d'actionnement sur ACTUATION_CORE, plus prioritaire : vide la file, joue les notes et
+    ecrit les mcp. C'est la seule tache qui touche aux mcp, au PWM et a l'etat des notes.
+test() et benchmark() s'utilisent avant start(), depuis setup().
+
+Fichiers MIDI : CC SMF_CONTROL_CC de valeur n joue /midi/<n>.mid depuis LittleFS (0 = arret).
+Le fichier est lu et decodé par la tache de transport, SMF_LOOKAHEAD ms avant l'heure de jeu, et
+les notes datées passent par une seconde EventRing : la tache d'actionnement ne touche jamais a
+LittleFS, elle joue chaque note a son heure (voir SmfPlayer.h).
+
+Playout (BLE_PLAYOUT_ENABLED) : les timestamps BLE-MIDI (13 bits en ms, rebouclent toutes les 8.192s)
+sont deroulés pour reconstruire la chronologie de l'emetteur. Chaque evenement est rangé dans la file
+avec son heure de jeu = heure emetteur + decalage d'horloge + BLE_PLAYOUT_LATENCY, et la tache
+d'actionnement attend cette heure avant de le traiter. Le decalage suit le paquet le moins retardé,
+et se recale si un paquet arrive trop tard pour etre joué a l'heure.
 
 MidiHandler initialise tous les objets nécessaires utilisés, dans ce cas : xylophone
 
@@ -25,6 +47,10 @@ MidiHandler initialise tous les objets nécessaires utilisés, dans ce cas : xyl
 #define MIDI_HANDLER_H
 
 #include "Xylophone.h"
+#include "EventRing.h"
+#include "SmfPlayer.h"
+#include "Calibration.h"
+#include "Roll.h"
 #include <BLEMidi.h>
 
 class MidiHandler {
@@ -32,11 +58,13 @@ public:
   MidiHandler(Xylophone &xylophone);
   void begin(); // initialise tout ce qui doit l'etre
   void test(bool playMelody);
-  void update();
+  void benchmark(); // mesure latence/gigue sur des charges de reference (BENCHMARK_ENABLED)
+  void start(); // demarre les taches de transport (coeur 0) et d'actionnement (coeur 1)
 
 private:
   Xylophone& _xylophone;
   bool _extraOctaveEnabled;  // lit si le switch extra octave est actif ou non
+  unsigned long _rxTime;     // instant de reception du message en cours (halMicros)
   bool _bleConnected;        // statut de connexion BLE
   bool _bleEnabled;          // BLE activé ou non
 
@@ -61,6 +89,37 @@ private:
   // Instance statique pour les callbacks
   static MidiHandler* _instance;
 
+  // Pipeline : file sans verrou entre la tache de transport et la tache d'actionnement
+  EventRing<MidiEvent, MIDI_RING_SIZE> _events;
+  void queueEvent(byte type, byte data1, byte data2, unsigned long time); // coté transport
+  void processEvents();                                // coté actionnement
+
+  // Fichiers MIDI : decodés par la tache de transport, joués par la tache d'actionnement
+  SmfPlayer _player;                                   // coté transport
+  EventRing<MidiEvent, SMF_RING_SIZE> _fileEvents;     // notes datées, SMF_LOOKAHEAD ms d'avance au plus
+  uint16_t _fileRequest;     // sequence << 8 | valeur du dernier CC SMF_CONTROL_CC, ecrit par l'actionnement
+  byte _fileSequence;        // coté actionnement : sequence de la derniere demande
+  byte _fileSequenceSeen;    // coté actionnement : sequence de la derniere marque lue dans _fileEvents
+  byte _fileSequenceDone;    // coté transport : sequence de la derniere demande traitée
+  bool _fileMarkPending;     // coté transport : marque de la demande pas encore en file (file pleine)
+  void feedFile();                                     // coté transport : decode le fichier en avance
+  void playFile();                                     // coté actionnement : notes du fichier arrivées a echeance
+  Calibration _calibration;
+  void calibrate();                                    // coté actionnement : avance la calibration
+  Roll _roll;
+  void playRoll();                                     // coté actionnement : coups des roulements
+  static void actuationTask();
+  static void transportTask();
+  void pollTransport();
+
+  // Playout : reconstruction de la chronologie de l'emetteur (coté transport)
+  bool _playoutSynced;                 // false jusqu'au premier timestamp apres (re)connexion
+  uint16_t _lastTimestamp;             // dernier timestamp BLE-MIDI reçu (13 bits)
+  unsigned long _lastArrival;          // instant de reception de ce timestamp (halMicros)
+  unsigned long _senderTime;           // heure emetteur deroulée en µs (deborde, comparer par difference)
+  unsigned long _playoutOffset;        // heure locale - heure emetteur du paquet le moins retardé, en µs
+  unsigned long eventTime(uint16_t timestamp); // heure de jeu de l'evenement (halMicros)
+
   // Gestion des messages NoteOn, NoteOff
   void handleNoteOn(byte note, byte velocity);
   void handleNoteOff(byte note);
@@ -68,6 +127,12 @@ private:
 
   // Gestion des Controls change
   void handleControlChange(byte control, byte value); // gestion des CC
+
+  // Charges de reference du benchmark
+  void benchNoteOn(byte note, byte velocity);
+  void benchControl(byte control, byte value);
+  uint16_t benchTimestamp();
+  void benchWait(unsigned long until); // fait tourner la file et update() jusqu'a l'instant indiqué
 };
 
 #endif
@@ -0,0 +1,80 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+----------------------------------------    SMFPLAYER.H    ----------------------------------------------
+_________________________________________________________________________________________________________
+Lecture de fichiers MIDI standard (.mid, formats 0 et 1) stockés sur LittleFS
+
+Le fichier n'est jamais chargé en entier : chaque piste garde sa position dans le fichier et une
+fenetre de SMF_READ_AHEAD octets, rechargée quand elle est vide. Un seul fichier est ouvert,
+quel que soit le nombre de pistes. La taille des fichiers n'est limitée que par la flash.
+
+Chaque piste a au plus un evenement decodé en attente. Les pistes sont fusionnées par une
+DeadlineQueue (tas minimum) indexée par le tick de cet evenement : next() prend toujours la
+piste dont l'evenement est le plus proche, puis decode le suivant de cette piste.
+Les changements de tempo (FF 51) passent par la meme fusion, ils s'appliquent donc au bon tick
+meme s'ils sont sur une autre piste que les notes.
+
+Les instants sont calculés avec l'horloge de la carte (halMicros) depuis play() : le reseau
+n'intervient plus dans le timing. next() accepte un now en avance pour decoder avant l'heure de
+jeu (MidiHandler decode SMF_LOOKAHEAD ms d'avance dans la tache de transport). Seuls les note on/off du canal joué (ALL_CHANNEL /
+CHANNEL_XYLO) sont renvoyés, les autres evenements sont sautés.
+***********************************************************************************************************/
+
+#ifndef SMF_PLAYER_H
+#define SMF_PLAYER_H
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include "settings.h"
+#include "DeadlineQueue.h"
+#include "EventRing.h"
+
+class SmfPlayer {
+public:
+  SmfPlayer();
+  bool begin();                                 // monte LittleFS
+  bool play(const char *path, unsigned long now);// ouvre le fichier et demarre la lecture
+  void stop();
+  bool playing() const { return _playing; }
+  bool next(unsigned long now, MidiEvent &event);// prochain note on/off arrivé a echeance
+  bool nextTime(unsigned long &time) const;     // echeance du prochain evenement, false si arreté
+
+private:
+  struct Track {
+    uint32_t next;                  // position dans le fichier du premier octet non chargé
+    uint32_t end;                   // fin du chunk MTrk
+    byte window[SMF_READ_AHEAD];    // octets chargés d'avance
+    byte position;
+    byte length;
+    byte runningStatus;
+    unsigned long tick;             // tick absolu de l'evenement en attente
+    byte status;                    // evenement en attente (0xFF = tempo)
+    byte data1;
+    byte data2;
+    unsigned long tempo;            // nouveau tempo si status = 0xFF
+  };
+
+  File _file;
+  Track _tracks[SMF_MAX_TRACKS];
+  byte _trackCount;
+  DeadlineQueue<SMF_MAX_TRACKS> _queue; // pistes ordonnées par tick de leur evenement en attente
+  bool _playing;
+
+  // conversion tick -> µs : base du dernier changement de tempo
+  unsigned long _startTime;
+  unsigned long _division;              // ticks par noire (ou par seconde / 1e6 en SMPTE)
+  bool _smpte;
+  unsigned long _tempo;                 // µs par noire
+  unsigned long _tempoTick;
+  unsigned long _tempoTime;             // µs depuis le debut au tick _tempoTick
+
+  bool readHeader();
+  bool readByte(Track &track, byte &value);
+  bool readVarLen(Track &track, unsigned long &value);
+  bool skip(Track &track, unsigned long count);
+  bool readEvent(byte index);           // decode l'evenement suivant de la piste et la remet dans la file
+  unsigned long timeOf(unsigned long tick) const;
+};
+
+#endif // SMF_PLAYER_H
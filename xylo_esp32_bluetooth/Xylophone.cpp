@@ -3,21 +3,46 @@
 ------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
 ---------------------------------------    XYLOPHONE.CPP   ----------------------------------------------
 _________________________________________________________________________________________________________
-Classe pour gérer les actions sur le xylophone - Version ESP32
+classe pour gerer les actions sur le xylophone
 
 ***********************************************************************************************************/
 
+
 #include "Xylophone.h"
 
+// sinon admitPending() n'admet jamais une note seule au PWM maximum : elle reste en attente
+static_assert(COIL_CURRENT <= SUPPLY_CURRENT, "COIL_CURRENT depasse SUPPLY_CURRENT");
+
 // ----------------------------------      PUBLIC  --------------------------------------------
 
 static Xylophone* XylophoneInstance;
 
-Xylophone::Xylophone(): _electromagnetTicker(_electromagnetTickerCallback, 5, 0, MILLIS)   {
-  getMaxMagnetPinBelow16();
+Xylophone::Xylophone() {
+  for (byte i = 0; i < INSTRUMENT_RANGE; i++) {
+    _noteState[i] = NOTE_IDLE;
+    _hitTime[i] = TIME_HIT;
+    _minPwm[i] = MIN_PWM_VALUE;
+    _strikeDwell[i] = TIME_HIT * 1000UL;
+    _kickDwell[i] = TIME_HIT * 1000UL;
+    _holdPwm[i] = 0;
+    _holding[i] = false;
+    _retriggers[i].pending = false;
+  }
+  for (byte i = 0; i < COIL_BANKS; i++) {
+    _outputs[i] = 0;
+    _outputsDirty[i] = false;
+  }
+  for (byte i = 0; i < COIL_BANKS * 16; i++) {
+    _outputDuty[i] = 0;
+  }
+  _releasePending = false;
+  _energizedCount = 0;
+  _energizedCurrent = 0;
+  _staggered = false;
   for (byte i = 0; i < INSTRUMENT_RANGE; i++) {
-    _noteStartTime[i] = 0;
-    _noteActive[i] = false;
+    for (byte j = 0; j < STRIKE_VELOCITY_BUCKETS; j++) {
+      _strikeLatency[i][j] = pgm_read_byte(&STRIKE_LATENCY[i][j]);
+    }
   }
   XylophoneInstance = this;
 }
@@ -26,181 +51,602 @@ Xylophone::Xylophone(): _electromagnetTicker(_electromagnetTickerCallback, 5, 0,
 //******************             INITIALISE THE OBJECTS AND SETINGS
 
 void Xylophone::begin() {
-  // Initialisation I2C avec les pins spécifiques pour ESP32
-  Wire.begin(I2C_SDA, I2C_SCL);
-
-  if(DEBUG_XYLO){
-    Serial.println("start Xylophone init (ESP32)");
-  }
-
-  if (!_mcp1.begin_I2C(MCP1_ADDR)) {
-    Serial.println("Error mcp1");
+  halBegin();
+  TRACE_DETAIL(TRACE_BOOT, 0, 0);
+  if (!coilDriverBegin()) {
+    Serial.println(F("Error coil driver"));
     while (1);
   }
+  halTimerBegin(_releaseTimerCallback);
+  TRACE_DETAIL(TRACE_BOOT, 1, 0);
+}
 
-  if (!_mcp2.begin_I2C(MCP2_ADDR)) {
-    Serial.println("Error mcp2");
-    while (1);
-  }
+//*********************************************************************************************
+//******************          PLAY THE NOTE ON THE XYLOPHONE
 
-  for (byte i = 0; i < 16; i++) {
-    _mcp1.pinMode(i, OUTPUT);
-    _mcp2.pinMode(i, OUTPUT);
-    _mcp1.digitalWrite(i, LOW);
-    _mcp2.digitalWrite(i, LOW);
+void Xylophone::playNote(byte note, byte velocity) {
+  int noteIndex = note - INSTRUMENT_START_NOTE;
+  if (noteIndex >= 0 && noteIndex < INSTRUMENT_RANGE) {
+    if (VELOCITY_DWELL) {
+      // PWM fixe, la vélocité donne la durée de frappe : chaque note d'un accord garde sa nuance
+      strikeDwell(note, DWELL_PWM, velocityDwell(noteIndex, velocity));
+    } else {
+      // PWM en fonction de la vélocité, a partir du minimum de la lame
+      strike(note, map(velocity, 0, 127, _minPwm[noteIndex], 255), _hitTime[noteIndex]);
+    }
   }
+}
 
-  // Configuration PWM pour ESP32 avec LEDC
-  ledcSetup(PWM_CHANNEL, PWM_FREQ, PWM_RESOLUTION);
-  ledcAttachPin(PWM_PIN, PWM_CHANNEL);
-  ledcWrite(PWM_CHANNEL, 0); // Initialisation à 0
+void Xylophone::strike(byte note, int pwmValue, byte hitTime) {
+  strikeDwell(note, pwmValue, hitTime * 1000UL);
+}
 
-  if(DEBUG_XYLO){
-    Serial.println("end Xylophone init");
+// durée de frappe de la lame pour une vélocité : DWELL_CURVE interpolée, en % de _hitTime
+unsigned long Xylophone::velocityDwell(byte slot, byte velocity) const {
+  const byte points = sizeof(DWELL_CURVE) / sizeof(DWELL_CURVE[0]);
+  unsigned int position = (unsigned int)velocity * (points - 1);
+  byte index = position / 127;
+  byte fraction = position % 127;
+  unsigned int percent = pgm_read_byte(&DWELL_CURVE[index]) * 127U;
+  if (index + 1 < points) {
+    percent = pgm_read_byte(&DWELL_CURVE[index]) * (127U - fraction)
+            + pgm_read_byte(&DWELL_CURVE[index + 1]) * (unsigned int)fraction;
   }
+  return max(1UL, _hitTime[slot] * 10UL * percent / 127);
 }
 
-//*********************************************************************************************
-//******************         GET THE LAST PIN USED ON MCP1
+void Xylophone::strikeDwell(byte note, int pwmValue, unsigned long dwell) {
+  int noteIndex = note - INSTRUMENT_START_NOTE;
+  if (noteIndex >= 0 && noteIndex < INSTRUMENT_RANGE) {
+    byte slot = noteIndex;        // meme lame que pour la coupure (stopNote) et les files
+
+    // bobine chaude : frappe raccourcie, ou retardée le temps qu'elle refroidisse
+    unsigned long wait;
+    halBusLock();
+    _thermal.cool(halMicros());
+    unsigned long allowedDwell = _thermal.allow(slot, dwell, pwmValue, wait);
+    halBusUnlock();
+
+    // profil de la lame : impulsion, puis maintien a PWM reduit ou coupure a la fin de l'impulsion
+    unsigned long kickDwell = allowedDwell;
+    byte holdPwm = 0;
+    byte kickPercent = pgm_read_byte(&DRIVE_PROFILE[slot][0]);
+    if (kickPercent < 100) {
+      kickDwell = max(1UL, allowedDwell * kickPercent / 100);
+      holdPwm = (unsigned int)pwmValue * pgm_read_byte(&DRIVE_PROFILE[slot][1]) / 100;
+      if (holdPwm == 0) {
+        allowedDwell = kickDwell;     // coupure anticipée, la mailloche finit sa course seule
+      } else if (!COIL_DRIVER_PWM) {
+        kickDwell = allowedDwell;     // PWM_PIN commun : pas de maintien propre a la lame
+        holdPwm = 0;
+      }
+    }
 
-void Xylophone::getMaxMagnetPinBelow16() {
-  int maxPin = -1;
-  for (byte i = 0; i < INSTRUMENT_RANGE; i++) {
-    if (magnetPins[i] < 16 && magnetPins[i] > maxPin) {
-      maxPin = magnetPins[i];
+    halLock();
+    bool ready = (_noteState[slot] == NOTE_IDLE || _noteState[slot] == NOTE_PENDING) && wait == 0;
+    if (ready) {
+      // l'electroaimant est allumé par flushOutputs quand l'alimentation le permet
+      _strikeDwell[slot] = allowedDwell;
+      _kickDwell[slot] = kickDwell;
+      _holdPwm[slot] = holdPwm;
+      _strikePwm[slot] = pwmValue;
+      if (_noteState[slot] == NOTE_IDLE) {
+        // le temps de frappe demarre quand la sortie est reellement envoyée
+        _playingNotesCount++;
+        _pendingSlots[_pendingCount++] = slot;
+        _noteState[slot] = NOTE_PENDING;
+      }
+    } else {
+      if (_noteState[slot] == NOTE_IDLE) {
+        // trop chaude : la lame attend comme pendant le retour de la mailloche
+        _noteState[slot] = NOTE_RETRACTING;
+        _recoveryQueue.push(slot, halMicros() + wait);
+        armReleaseTimer();
+      }
+      // electroaimant encore actif, mailloche en retour ou bobine trop chaude : refrappe des que la lame est prete
+      _retriggers[slot].pending = true;
+      _retriggers[slot].pwm = pwmValue;
+      _retriggers[slot].dwell = dwell;
+    }
+    halUnlock();
+
+    if (ready) {
+      // avant l'ecriture des sorties, faite au prochain update. Avec un PWM par sortie, la vélocité
+      // part avec la sortie de la lame et l'alimentation commune reste au maximum
+      halPwmWrite(COIL_DRIVER_PWM ? 255 : pwmValue);
+      TRACE_EVENT(TRACE_STRIKE, slot, pwmValue);
+    } else if (wait > 0) {
+      TRACE_EVENT(TRACE_COOLING, slot, min(wait / 1000, 0xFFFFUL));
+    } else {
+      health.retriggers++;
+      TRACE_EVENT(TRACE_RETRIGGER, slot, pwmValue);
     }
   }
-  _maxMcp1 = maxPin;
 }
 
 //*********************************************************************************************
-//******************          PLAY THE NOTE ON THE XYLOPHONE
+//******************          SCHEDULE A PRE-COMPENSATED STRIKE
 
-void Xylophone::playNote(byte note, byte velocity) {
-  int mcpPin = _noteToMcpPin(note);
-  if (mcpPin != -1) {
-    if(_playingNotesCount == 0)  {
-      _electromagnetTicker.start();
+void Xylophone::scheduleNote(byte note, byte velocity, unsigned long inputTime) {
+  int noteIndex = note - INSTRUMENT_START_NOTE;
+  if (noteIndex < 0 || noteIndex >= INSTRUMENT_RANGE) {
+    return;
+  }
+  byte bucket = (unsigned int)velocity * STRIKE_VELOCITY_BUCKETS / 128;
+  unsigned long strikeTime = inputTime + STRIKE_DELAY * 1000UL
+                             - (unsigned long)_strikeLatency[noteIndex][bucket] * STRIKE_LATENCY_UNIT;
+
+  halLock();
+  byte slot = DeadlineQueue<STRIKE_QUEUE_SIZE>::NONE;
+  if ((long)(strikeTime - halMicros()) > 0) {
+    for (byte i = 0; i < STRIKE_QUEUE_SIZE; i++) {
+      if (!_strikeQueue.contains(i)) {
+        slot = i;
+        break;
+      }
     }
+  }
+  if (slot != DeadlineQueue<STRIKE_QUEUE_SIZE>::NONE) {
+    _strikes[slot].note = note;
+    _strikes[slot].velocity = velocity;
+    _strikeQueue.push(slot, strikeTime);
+    armReleaseTimer();
+  }
+  halUnlock();
 
-    // Mettre à jour le PWM en fonction de la vélocité (ESP32 utilise ledc)
-    int pwmValue = map(velocity, 0, 127, MIN_PWM_VALUE, 255);
-    ledcWrite(PWM_CHANNEL, pwmValue);
-
-    // Active l'électroaimant
-    if (mcpPin < 16) {
-      _mcp1.digitalWrite(mcpPin, HIGH);
-      _noteStartTime[mcpPin] = millis();
-      _noteActive[mcpPin] = true;
-    } else {
-      _mcp2.digitalWrite(mcpPin - 16, HIGH);
-      _noteStartTime[mcpPin - 16 + _maxMcp1 + 1] = millis();
-      _noteActive[mcpPin - 16 + _maxMcp1 + 1] = true;
+  if (slot == DeadlineQueue<STRIKE_QUEUE_SIZE>::NONE) {
+    if (_strikeQueue.size() == STRIKE_QUEUE_SIZE) {
+      TRACE_ERROR(TRACE_QUEUE_FULL, noteIndex, 0);
     }
+    playNote(note, velocity);     // deja en retard (ou file pleine) : frappe tout de suite
+  }
+}
+
+void Xylophone::setStrikeLatency(byte note, byte bucket, byte latency) {
+  int noteIndex = note - INSTRUMENT_START_NOTE;
+  if (noteIndex >= 0 && noteIndex < INSTRUMENT_RANGE && bucket < STRIKE_VELOCITY_BUCKETS) {
+    _strikeLatency[noteIndex][bucket] = latency;
+  }
+}
+
+void Xylophone::setHitTime(byte note, byte hitTime) {
+  int noteIndex = note - INSTRUMENT_START_NOTE;
+  if (noteIndex >= 0 && noteIndex < INSTRUMENT_RANGE && hitTime > 0) {
+    _hitTime[noteIndex] = hitTime;
+  }
+}
+
+void Xylophone::setMinPwm(byte note, int pwmValue) {
+  int noteIndex = note - INSTRUMENT_START_NOTE;
+  if (noteIndex >= 0 && noteIndex < INSTRUMENT_RANGE) {
+    _minPwm[noteIndex] = constrain(pwmValue, 0, 255);
+  }
+}
 
-    _playingNotesCount++;
+byte Xylophone::strikeLatency(byte note, byte bucket) const {
+  int noteIndex = note - INSTRUMENT_START_NOTE;
+  if (noteIndex >= 0 && noteIndex < INSTRUMENT_RANGE && bucket < STRIKE_VELOCITY_BUCKETS) {
+    return _strikeLatency[noteIndex][bucket];
+  }
+  return 0;
+}
+
+// pas depuis l'interruption du timer sur AVR (HAL_TIMER_CAN_STRIKE) : la frappe calcule
+// l'echauffement de la bobine (exp() est lent) et ses sorties ne partent qu'avec flushOutputs().
+// Les frappes sont retirées de la file sous halLock() mais jouées hors de la section critique
+void Xylophone::checkStrikes() {
+  while (true) {
+    PendingStrike strike;
+    halLock();
+    bool due = _strikeQueue.due(halMicros());
+    if (due) {
+      strike = _strikes[_strikeQueue.pop()];
+    }
+    halUnlock();
+    if (!due) {
+      break;
+    }
+    playNote(strike.note, strike.velocity);
+  }
+}
 
-    if(DEBUG_XYLO){
-      Serial.print("playNote: ");
-      Serial.print("note: ");
-      Serial.print(note);
-      Serial.print(", mcpPin: ");
-      Serial.println(mcpPin);
-      Serial.print("_playingNotesCount: ");
-      Serial.println(_playingNotesCount);
+//*********************************************************************************************
+//******************          END OF THE MALLET RECOVERY
+
+void Xylophone::checkRecovery() {
+  while (true) {
+    Retrigger retrigger = { false, 0, 0 };
+    byte slot = 0;
+    halLock();
+    bool due = _recoveryQueue.due(halMicros());
+    if (due) {
+      slot = _recoveryQueue.pop();
+      _noteState[slot] = NOTE_IDLE;
+      retrigger = _retriggers[slot];
+      _retriggers[slot].pending = false;
+    }
+    halUnlock();
+    if (!due) {
+      break;
+    }
+    if (retrigger.pending) {
+      strikeDwell(slot + INSTRUMENT_START_NOTE, retrigger.pwm, retrigger.dwell);
     }
   }
 }
 
 //*********************************************************************************************
-//******************            UPDATE THE TICKER FOR MAGNETS
+//******************            SEND THE OUTPUTS TO THE MCP
 
 void Xylophone::update() {
-  _electromagnetTicker.update();
+  checkRecovery();                // lames redevenues pretes et leurs refrappes
+  checkStrikes();                 // frappes precompensées arrivées a echeance
+  flushOutputs();                 // envoie les notes on et les coupures faites par le timer
 }
 
 //*********************************************************************************************
 //******************            RESET THE SETTINGS
 
-void Xylophone::reset(){
-  delay(20);
-  checkNoteOff();
+// coupe tout sans attendre les echeances : une frappe longue (VELOCITY_DWELL, maintien) serait
+// sinon encore alimentée, et une note en attente d'admission partirait a l'ecriture suivante
+void Xylophone:: reset (){
+  halBusLock();                   // pas d'ecriture des sorties en cours
+  halLock();
+  // oublie les frappes pas encore parties, les refrappes, les notes en attente et les lames a refroidir
+  _strikeQueue.clear();
+  _recoveryQueue.clear();
+  _releaseQueue.clear();
+  _pendingCount = 0;
+  _staggered = false;
+  for (byte i = 0; i < INSTRUMENT_RANGE; i++) {
+    _retriggers[i].pending = false;
+    if (_noteState[i] == NOTE_SENDING || _noteState[i] == NOTE_ACTIVE) {
+      setMagnet(i, LOW);
+    }
+    _holding[i] = false;
+    _noteState[i] = NOTE_IDLE;
+  }
+  _playingNotesCount = 0;
+  _energizedCount = 0;
+  _energizedCurrent = 0;
+  halPwmWrite(PWM_OFF_VALUE);
+  armReleaseTimer();              // plus aucune echeance : arrete le timer
+  halUnlock();
+  halBusUnlock();
+  flushOutputs();
+  coilDriverSync();// les coupures sont parties avant de rendre la main
+  delay(STRIKE_RECOVERY);// retour des mailloches coupées avant la prochaine note
 }
 
 //*********************************************************************************************
 //******************             CHECK NOTE TO TURN OFF
 
 void Xylophone::checkNoteOff() {
-  unsigned long time = 0;
-  if (_playingNotesCount > 0){
-    for (byte i = 0; i < _instrumentRange; i++) {
-      if(_noteActive[i]){
-        time = millis() - _noteStartTime[i];
-
-        if(DEBUG_XYLO){
-          Serial.print("time Note = ");
-          Serial.println(time);
-        }
-
-        if (time >= TIME_HIT) {
-          if(DEBUG_XYLO){
-            Serial.print("checkNoteOff: Appel stopNote : ");
-            Serial.println(i);
-          }
-          stopNote(i + INSTRUMENT_START_NOTE);
-        }
-      }
+  halLock();                      // appelé depuis le timer de coupure ou depuis reset()
+  unsigned long now = halMicros();
+  while (_releaseQueue.due(now)) {  // seulement les notes dont l'echeance est passée
+    unsigned long deadline = _releaseQueue.topTime();
+    byte slot = _releaseQueue.pop();
+    if (!_holding[slot] && _kickDwell[slot] < _strikeDwell[slot]) {
+      // fin de l'impulsion : la lame reste alimentée au PWM de maintien jusqu'a la fin de la frappe
+      holdMagnet(slot);
+      _releaseQueue.push(slot, deadline + _strikeDwell[slot] - _kickDwell[slot]);
+      TRACE_DETAIL(TRACE_COIL_HOLD, slot, _holdPwm[slot]);
+      continue;
+    }
+    stopNote( slot+INSTRUMENT_START_NOTE );// on coupe l'alim de la note
+    TRACE_DETAIL(TRACE_COIL_OFF, slot, min(now - deadline, 0xFFFFUL));
+    if (!_releasePending) {
+      _releasePending = true;     // retard mesuré quand la trame de coupure est posée
+      _releaseDeadline = deadline;
+    }
+    if (BENCHMARK_ENABLED) {
+      benchCoilOff(slot, halMicros(), deadline);
     }
   }
+  armReleaseTimer();
+  halUnlock();
 }
 
-// ----------------------------------    PRIVATE   --------------------------------------------
+bool Xylophone::idle() {
+  return _playingNotesCount == 0 && _strikeQueue.empty() && _recoveryQueue.empty();
+}
+
+bool Xylophone::nextDeadline(unsigned long &time) {
+  bool found;
+  halLock();
+  found = !_releaseQueue.empty();
+  if (found) {
+    time = _releaseQueue.topTime();
+  }
+  halUnlock();
+  return found;
+}
 
 //*********************************************************************************************
-//******************             GET MCP OUTPUT NUMBER
+//******************             THERMAL STATE OF THE COILS
 
-int Xylophone::_noteToMcpPin(byte note) {
+byte Xylophone::coilLoad(byte note) {
   int noteIndex = note - INSTRUMENT_START_NOTE;
-  if (noteIndex >= 0 && noteIndex < INSTRUMENT_RANGE) {
-    return magnetPins[noteIndex];
+  if (noteIndex < 0 || noteIndex >= INSTRUMENT_RANGE) {
+    return 0;
   }
-  return -1;
+  halBusLock();
+  _thermal.cool(halMicros());
+  byte load = _thermal.load(noteIndex);
+  halBusUnlock();
+  return load;
 }
 
+// une ligne JSON, comme benchReport() : {"thermal":[% de la limite de chaque lame]}
+void Xylophone::thermalReport() {
+  byte loads[INSTRUMENT_RANGE];
+  halBusLock();                   // copie, le port serie n'est pas ecrit sous le verrou
+  _thermal.cool(halMicros());
+  for (byte i = 0; i < INSTRUMENT_RANGE; i++) {
+    loads[i] = _thermal.load(i);
+  }
+  halBusUnlock();
+  Serial.print(F("{\"thermal\":["));
+  for (byte i = 0; i < INSTRUMENT_RANGE; i++) {
+    if (i > 0) {
+      Serial.print(F(","));
+    }
+    Serial.print(loads[i]);
+  }
+  Serial.println(F("]}"));
+}
+
+// ----------------------------------    PRIVATE   --------------------------------------------
+
 //*********************************************************************************************
 //******************             STOP NOTE
 
+// appelé sous halLock()
 void Xylophone::stopNote(byte midiNote) {
-  int noteIndex = midiNote - INSTRUMENT_START_NOTE;
+int noteIndex = midiNote - INSTRUMENT_START_NOTE;
   if (noteIndex >= 0 && noteIndex < INSTRUMENT_RANGE) {
-    byte mcpPin = magnetPins[noteIndex];
+    setMagnet(noteIndex, LOW);
+    // la mailloche revient : la lame ne peut pas refrapper avant STRIKE_RECOVERY ms
+    _noteState[noteIndex] = NOTE_RETRACTING;
+    _recoveryQueue.push(noteIndex, halMicros() + STRIKE_RECOVERY * 1000UL);
+    _playingNotesCount--;
+    _energizedCount--;
+    _energizedCurrent -= coilCurrent(noteIndex);
+    _holding[noteIndex] = false;
+
+    if(_playingNotesCount==0)  {
+      // plus aucun electroaimant actif : coupe l'alimentation tout de suite,
+      // sans attendre l'ecriture I2C des mcp
+      halPwmWrite(PWM_OFF_VALUE);
+    }
+  }
+}
 
-    if (mcpPin != -1) {
-      if (mcpPin < 16) {
-        _mcp1.digitalWrite(mcpPin, LOW);
-      } else {
-        _mcp2.digitalWrite(mcpPin - 16, LOW);
-      }
-      _noteActive[noteIndex] = false;
-      _playingNotesCount--;
+//*********************************************************************************************
+//******************             SHADOW REGISTERS OF THE OUTPUTS
+
+void Xylophone::setMagnet(byte slot, bool state) {
+  CoilOutput output = COIL_MAP[slot];   // banque et bit calculés a la compilation, lus en flash
+  if (state) {
+    _outputDuty[output.output] = _strikePwm[slot];
+    _outputs[output.bank] |= output.mask;
+  } else {
+    _outputs[output.bank] &= ~output.mask;
+  }
+  _outputsDirty[output.bank] = true;
+}
 
-      if(_playingNotesCount == 0)  {
-        _electromagnetTicker.pause();
-      }
+// appelé sous halLock() : passe la sortie de la lame au PWM de maintien (COIL_DRIVER_PWM)
+void Xylophone::holdMagnet(byte slot) {
+  CoilOutput output = COIL_MAP[slot];
+  _energizedCurrent -= coilCurrent(slot);
+  _holding[slot] = true;
+  _energizedCurrent += coilCurrent(slot);// le courant liberé peut admettre les notes en attente
+  _outputDuty[output.output] = _holdPwm[slot];
+  _outputsDirty[output.bank] = true;
+}
 
-      if(DEBUG_XYLO){
-        Serial.print("stopNote: ");
-        Serial.print("midiNote: ");
-        Serial.print(midiNote);
-        Serial.print(", mcpPin: ");
-        Serial.println(mcpPin);
-        Serial.print("_playingNotesCount: ");
-        Serial.println(_playingNotesCount);
+// appelé sous halLock() : copie les images modifiées, et l'echeance de la plus ancienne coupure
+// qu'elles portent (false si aucune)
+bool Xylophone::takeOutputs(uint16_t *outputs, bool *dirty, unsigned long &releaseDeadline) {
+  for (byte i = 0; i < COIL_BANKS; i++) {
+    outputs[i] = _outputs[i];
+    dirty[i] = _outputsDirty[i];
+    _outputsDirty[i] = false;
+  }
+  bool released = _releasePending;
+  releaseDeadline = _releaseDeadline;
+  _releasePending = false;
+  return released;
+}
+
+void Xylophone::flushOutputs() {
+  uint16_t outputs[COIL_BANKS];
+  bool dirty[COIL_BANKS];
+  unsigned long releaseDeadline;
+  bool released;
+  byte sent;
+
+  halBusLock();
+  halLock();
+  // les notes admises parmi celles demandées partent dans cette ecriture
+  sent = admitPending(halMicros());
+  released = takeOutputs(outputs, dirty, releaseDeadline);
+  if (!HAL_TIMER_CAN_STRIKE) {
+    // AVR : l'interruption du timer ecrit aussi (writeReleases()), l'image copiée part donc avant
+    // qu'elle ne puisse la changer : une coupure n'est jamais remplacée par une image plus ancienne
+    coilDriverWrite(outputs, dirty, _outputDuty);
+  }
+  halUnlock();
+
+  // une seule ecriture par banque modifiée : un accord = une transaction par mcp (ou une trame SPI)
+  // (le PWM par sortie est modifié par admitPending(), sous halBusLock(), et par holdMagnet() depuis le
+  // timer : le pca9685 renvoie les voies dont le PWM differe de celui deja envoyé, et un maintien
+  // arrivé pendant l'ecriture marque la banque, renvoyée au passage suivant)
+  if (HAL_TIMER_CAN_STRIKE) {
+    coilDriverWrite(outputs, dirty, _outputDuty);// ESP32 : le timer passe aussi par halBusLock()
+  }
+  if (released) {
+    healthMax(health.maxDwellOvershoot, halMicros() - releaseDeadline);
+  }
+
+  // les electroaimants sont alimentés : le temps de frappe commence maintenant
+  if (sent > 0) {
+    byte energized[COIL_STAGGER_GROUP];
+    byte energizedCount = 0;
+    halLock();
+    unsigned long now = halMicros();
+    for (byte i = 0; i < sent; i++) {
+      byte slot = _pendingSlots[i];
+      if (_noteState[slot] == NOTE_SENDING) {
+        _noteState[slot] = NOTE_ACTIVE;
+        _releaseQueue.push(slot, now + _kickDwell[slot]);// fin de l'impulsion, ou coupure
+        energized[energizedCount++] = slot;
+        health.notesPlayed++;
+        TRACE_DETAIL(TRACE_COIL_ON, slot, min(_strikeDwell[slot] / 10, 0xFFFFUL));
+        if (BENCHMARK_ENABLED) {
+          benchCoilOn(slot, now);
+        }
       }
     }
+    // garde les notes non admises et celles demandées pendant l'ecriture pour le prochain passage
+    _pendingCount -= sent;
+    for (byte i = 0; i < _pendingCount; i++) {
+      _pendingSlots[i] = _pendingSlots[i + sent];
+    }
+    armReleaseTimer();
+    halUnlock();
+
+    // echauffement compté a l'allumage, sous halBusLock() mais hors section critique : exp() est lent sur AVR
+    _thermal.cool(now);
+    for (byte i = 0; i < energizedCount; i++) {
+      byte slot = energized[i];
+      _thermal.heat(slot, _kickDwell[slot], _strikePwm[slot]);
+      _thermal.heat(slot, _strikeDwell[slot] - _kickDwell[slot], _holdPwm[slot]);
+    }
+  }
+  halBusUnlock();
+}
+
+//*********************************************************************************************
+//******************             SUPPLY-AWARE ADMISSION OF THE COILS
+
+unsigned long Xylophone::coilCurrent(byte slot) const {
+  return (unsigned long)COIL_CURRENT * (_holding[slot] ? _holdPwm[slot] : _strikePwm[slot]) / 255;
+}
+
+bool Xylophone::before(byte a, byte b) const {
+  if (COIL_PRIORITY_MELODY && a != b) {
+    return a > b;                 // note la plus haute : la melodie d'abord
+  }
+  return _strikePwm[a] > _strikePwm[b];
+}
+
+// appelé sous halLock()
+byte Xylophone::admitPending(unsigned long now) {
+  if (_pendingCount == 0) {
+    return 0;
+  }
+  if (_staggered) {
+    if ((long)(now - _admissionTime) < 0) {
+      return 0;                   // laisse passer l'appel de courant du groupe precedent
+    }
+    _staggered = false;
+  }
+
+  // tri par insertion des notes demandées, la plus prioritaire en tete
+  for (byte i = 1; i < _pendingCount; i++) {
+    byte slot = _pendingSlots[i];
+    byte j = i;
+    while (j > 0 && before(slot, _pendingSlots[j - 1])) {
+      _pendingSlots[j] = _pendingSlots[j - 1];
+      j--;
+    }
+    _pendingSlots[j] = slot;
+  }
+
+  // dans l'ordre, tant que l'alimentation le permet : une note refusée bloque les suivantes
+  byte admitted = 0;
+  while (admitted < _pendingCount && admitted < COIL_STAGGER_GROUP) {
+    byte slot = _pendingSlots[admitted];
+    if (_energizedCount >= COIL_MAX_ACTIVE || _energizedCurrent + coilCurrent(slot) > SUPPLY_CURRENT) {
+      break;                      // repart a la coupure d'un electroaimant
+    }
+    setMagnet(slot, HIGH);
+    _noteState[slot] = NOTE_SENDING;
+    _energizedCount++;
+    _energizedCurrent += coilCurrent(slot);
+    admitted++;
+  }
+  if (admitted > 0 && admitted < _pendingCount) {
+    _staggered = true;
+    _admissionTime = now + COIL_STAGGER_US;
+    TRACE_DETAIL(TRACE_STAGGER, admitted, _pendingCount - admitted);
+  }
+  return admitted;
+}
+
+//*********************************************************************************************
+//******************             HARDWARE TIMER FOR THE NOTES OFF
+
+template <byte N>
+static void earliestDeadline(const DeadlineQueue<N> &queue, unsigned long &deadline, bool &found) {
+  if (!queue.empty() && (!found || (long)(queue.topTime() - deadline) < 0)) {
+    deadline = queue.topTime();
+    found = true;
+  }
+}
+
+// appelé sous halLock()
+void Xylophone::armReleaseTimer() {
+  unsigned long deadline = 0;
+  bool found = false;
+  earliestDeadline(_releaseQueue, deadline, found);
+  // sur AVR les frappes et les fins de retour sont servies par update() : le timer ne les attend pas
+  if (HAL_TIMER_CAN_STRIKE) {
+    earliestDeadline(_strikeQueue, deadline, found);
+    earliestDeadline(_recoveryQueue, deadline, found);
+    if (_staggered && (!found || (long)(_admissionTime - deadline) < 0)) {
+      deadline = _admissionTime;  // groupe d'allumages suivant
+      found = true;
+    }
+  }
+  if (!found) {
+    halTimerStop();
+    return;
   }
+  unsigned long next = deadline - halMicros();
+  if ((long)next < 0) {
+    next = 0;
+  }
+  halTimerArm(next);
 }
 
-void Xylophone::_electromagnetTickerCallback() {
-  XylophoneInstance->checkNoteOff();
+// AVR, depuis l'interruption du timer : les coupures (et les passages au maintien) partent sans
+// attendre loop(). Rien n'est admis ici : l'admission et l'echauffement restent dans update()
+void Xylophone::writeReleases() {
+  uint16_t outputs[COIL_BANKS];
+  bool dirty[COIL_BANKS];
+  unsigned long releaseDeadline;
+  halLock();
+  bool released = takeOutputs(outputs, dirty, releaseDeadline);
+  coilDriverWrite(outputs, dirty, _outputDuty);// trames posées, envoyées en arriere plan
+  if (released) {
+    healthMax(health.maxDwellOvershoot, halMicros() - releaseDeadline);
+  }
+  halUnlock();
+}
+
+void Xylophone::_releaseTimerCallback() {
+  if (HAL_TIMER_CAN_STRIKE) {
+    XylophoneInstance->checkRecovery();
+    XylophoneInstance->checkStrikes();
+  }
+  XylophoneInstance->checkNoteOff();// reprogramme le timer sur ce qui reste
+  if (HAL_TIMER_CAN_STRIKE) {
+    XylophoneInstance->flushOutputs();// ecrit les coupures et les frappes sans attendre update()
+  } else {
+    XylophoneInstance->writeReleases();
+  }
 }
@@ -11,7 +11,9 @@ Configuration pour ESP32 avec MIDI Bluetooth (BLE)
 #define SETTINGS_H
 #include <Arduino.h>
 #define DEBUG_HANDLER false
-#define DEBUG_XYLO 1
+// traces binaires (voir Trace.h) : 0 aucune, 1 erreurs, 2 notes et frappes, 3 allumages et coupures
+#define TRACE_LEVEL 2
+#define TRACE_BUFFER_SIZE 128         // enregistrements de 8 octets en attente d'envoi (puissance de 2)
 
 // Nom du dispositif Bluetooth
 #define BLE_DEVICE_NAME "Xylophone-BLE"
@@ -44,27 +46,196 @@ const byte INSTRUMENT_RANGE = 25;
 
 // temps d'activation electroaimant en ms
 #define TIME_HIT 20
+// temps de retour de la mailloche apres la coupure en ms : une note repetée plus tot est
+// gardée et rejouée a la fin de ce temps (voir Xylophone.h)
+#define STRIKE_RECOVERY 15
+
+// alimentation commune des electroaimants (voir Xylophone.h) : les accords trop gros pour
+// l'alimentation sont etalés au lieu de la faire chuter
+#define COIL_MAX_ACTIVE 8           // electroaimants alimentés en meme temps au plus
+#define COIL_CURRENT 1500           // mA d'un electroaimant au PWM maximum
+#define SUPPLY_CURRENT 12000        // mA que l'alimentation fournit sans chuter
+#define COIL_STAGGER_GROUP 4        // electroaimants allumés dans la meme ecriture au plus
+#define COIL_STAGGER_US 300         // µs entre deux groupes d'allumages
+#define COIL_PRIORITY_MELODY true   // true : la note la plus haute part en premier, false : la plus forte
+
+// echauffement des bobines (voir CoilThermal.h) : une bobine chaude frappe plus court, puis attend
+#define COIL_THERMAL_TAU 30000      // constante de temps thermique d'une bobine en ms
+#define COIL_DUTY_LIMIT 25          // rapport cyclique tenu en continu a pleine puissance, en %
+#define COIL_DERATE_START 70        // % de la limite a partir duquel la frappe est raccourcie
+#define COIL_DERATE_MIN_HIT 50      // % de la durée de frappe gardé a la limite
+#define THERMAL_REPORT_CC 83        // CC (toute valeur) : etat thermique des bobines en JSON sur Serial
+
+// precompensation de la latence mecanique (voir Xylophone.h) : chaque lame est frappée en avance
+// de sa latence pour sonner STRIKE_DELAY ms apres la reception. STRIKE_DELAY doit etre plus grand
+// que la plus grande latence de la table, sinon les lames les plus lentes partent en retard.
+// Table a zero et STRIKE_DELAY 0 : frappe immediate, comme sans precompensation.
+#define STRIKE_DELAY 0              // retard global en ms
+#define STRIKE_LATENCY_UNIT 100     // µs par unité de la table
+#define STRIKE_VELOCITY_BUCKETS 4   // tranches de vélocité : 0-31, 32-63, 64-95, 96-127
+#define STRIKE_QUEUE_SIZE 16        // frappes en attente au maximum
+// latence commande -> son par note et par tranche de vélocité, en unités de STRIKE_LATENCY_UNIT
+const byte STRIKE_LATENCY[INSTRUMENT_RANGE][STRIKE_VELOCITY_BUCKETS] PROGMEM = {
+  {0, 0, 0, 0},   // note 65
+  {0, 0, 0, 0},   // note 66
+  {0, 0, 0, 0},   // note 67
+  {0, 0, 0, 0},   // note 68
+  {0, 0, 0, 0},   // note 69
+  {0, 0, 0, 0},   // note 70
+  {0, 0, 0, 0},   // note 71
+  {0, 0, 0, 0},   // note 72
+  {0, 0, 0, 0},   // note 73
+  {0, 0, 0, 0},   // note 74
+  {0, 0, 0, 0},   // note 75
+  {0, 0, 0, 0},   // note 76
+  {0, 0, 0, 0},   // note 77
+  {0, 0, 0, 0},   // note 78
+  {0, 0, 0, 0},   // note 79
+  {0, 0, 0, 0},   // note 80
+  {0, 0, 0, 0},   // note 81
+  {0, 0, 0, 0},   // note 82
+  {0, 0, 0, 0},   // note 83
+  {0, 0, 0, 0},   // note 84
+  {0, 0, 0, 0},   // note 85
+  {0, 0, 0, 0},   // note 86
+  {0, 0, 0, 0},   // note 87
+  {0, 0, 0, 0},   // note 88
+  {0, 0, 0, 0},   // note 89
+};
+
+// calibration automatique des lames (voir Calibration.h), lancée par CC CALIBRATION_CC
+#define CALIBRATION_CC 81                // valeur > 0 : lance la calibration, 0 : l'arrete
+#define CALIBRATION_PICKUP_PIN 34        // entrée analogique du piezo/micro (ADC1, utilisable avec la radio)
+const byte CALIBRATION_DWELLS[] PROGMEM = {10, 15, 20, 25, 30}; // durées de frappe essayées en ms
+#define CALIBRATION_DWELL_TOLERANCE 5    // % de crete toléré pour garder une durée plus courte
+#define CALIBRATION_PWM_START 60         // premier PWM du balayage (le dernier est 255)
+#define CALIBRATION_PWM_STEPS 6          // nombre de PWM essayés par lame
+#define CALIBRATION_SETTLE 400           // ms de silence avant chaque frappe
+#define CALIBRATION_WINDOW 50            // ms d'ecoute apres chaque frappe
+#define CALIBRATION_SAMPLE_INTERVAL 250  // µs entre deux lectures du capteur
+#define CALIBRATION_THRESHOLD 120        // ecart au repos (unités ADC 12 bits) qui marque le debut du son
+#define CALIBRATION_MIN_LEVEL 160        // crete visée pour la vélocité 0 (unités ADC 12 bits)
+#define CALIBRATION_STORE_ADDR 0         // adresse des resultats en EEPROM/NVS
+
+// roulements generés par la carte (voir Roll.h)
+#define ROLL_CC 1                        // molette de modulation : 0 desarmé, 1..127 cadence
+#define ROLL_SHAPE_CC 82                 // 64 vélocité constante, au dessus crescendo, en dessous decrescendo
+#define ROLL_MIN_RATE 4                  // coups par seconde pour la valeur 1
+#define ROLL_MAX_RATE 25                 // coups par seconde pour la valeur 127 (une lame tient au mieux 1000 / (TIME_HIT + STRIKE_RECOVERY))
 
 // valeur minimale pour le PWM (ESP32 utilise 0-255 pour analogWrite avec ledc)
 const int MIN_PWM_VALUE = 100; //pwm minimum pour activer l'electroaimant
 const int PWM_OFF_VALUE = 0; // valeur pour désactiver le PWM
 
+// profil de frappe de chaque lame (voir Xylophone.h), {impulsion, maintien} : PWM de la frappe
+// pendant impulsion % de la durée de frappe, puis maintien % de ce PWM jusqu'a la fin, ou coupure
+// a la fin de l'impulsion si maintien = 0. {100, 0} : frappe au meme PWM sur toute la durée.
+// Le maintien a PWM reduit demande un PWM par sortie (COIL_DRIVER_PCA9685) : avec PWM_PIN commun
+// seule la coupure anticipée s'applique. Ex. {40, 30} : impulsion courte puis maintien leger
+const byte DRIVE_PROFILE[INSTRUMENT_RANGE][2] PROGMEM = {
+  {100, 0},   // note 65
+  {100, 0},   // note 66
+  {100, 0},   // note 67
+  {100, 0},   // note 68
+  {100, 0},   // note 69
+  {100, 0},   // note 70
+  {100, 0},   // note 71
+  {100, 0},   // note 72
+  {100, 0},   // note 73
+  {100, 0},   // note 74
+  {100, 0},   // note 75
+  {100, 0},   // note 76
+  {100, 0},   // note 77
+  {100, 0},   // note 78
+  {100, 0},   // note 79
+  {100, 0},   // note 80
+  {100, 0},   // note 81
+  {100, 0},   // note 82
+  {100, 0},   // note 83
+  {100, 0},   // note 84
+  {100, 0},   // note 85
+  {100, 0},   // note 86
+  {100, 0},   // note 87
+  {100, 0},   // note 88
+  {100, 0},   // note 89
+};
+
+// nuances par la durée de frappe (voir Xylophone.h) : PWM fixe, la vélocité raccourcit la frappe.
+// Pour un seul PWM_PIN commun, chaque note d'un accord garde alors sa propre nuance
+#define VELOCITY_DWELL false
+#define DWELL_PWM 255                    // PWM de toutes les frappes dans ce mode
+// durée de frappe en % de celle de la lame, pour des vélocités regulierement espacées de 0 a 127
+const byte DWELL_CURVE[] PROGMEM = {20, 35, 50, 62, 74, 84, 93, 100};
+
 // Configuration PWM pour ESP32
 const int PWM_CHANNEL = 0;  // Canal PWM (0-15)
 const int PWM_FREQ = 5000;  // Fréquence PWM en Hz
 const int PWM_RESOLUTION = 8; // Résolution 8 bits (0-255)
 
-//**** Définition des broches des MCP utilisé pour les electroaiamants
-const int magnetPins[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12,            // 1er mcp
-                         16, 17, 18, 19, 20, 21, 22, 23, 24, 25 ,26 ,27 };     // 2nd mcp
-
-//adresses des mcp
-#define MCP1_ADDR  0x20
-#define MCP2_ADDR  0x21
+//**** sortie de chaque electroaimant, de la premiere a la derniere note : carte * 16 + broche de la
+// carte (mcp : GPA0..GPA7 = 0..7, GPB0..GPB7 = 8..15). Table des notes calculée a la compilation (CoilMap.h)
+constexpr byte magnetPins[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12,            // 1er mcp
+                               16, 17, 18, 19, 20, 21, 22, 23, 24, 25 ,26 ,27 };     // 2nd mcp
+#define COIL_EXPANDERS 2            // cartes de 16 sorties (mcp, paires de 74HC595), 8 au plus
+
+//adresses des mcp : le mcp n est a MCP_BASE_ADDR + n (broches A2..A0)
+#define MCP_BASE_ADDR  0x20
+
+// bus I2C des mcp : 1 MHz (fast mode plus du mcp23017), il faut des pull-ups de 2.2k ou moins
+// sur SDA/SCL ; mettre 400000 si le cablage est long ou si les erreurs I2C montent (Health.h)
+#define HAL_I2C_FREQ 1000000
+#define HAL_I2C_RETRIES 3   // essais d'une ecriture non acquittée avant de l'abandonner
+
+// carte de sortie des electroaimants (voir CoilDriver.h) : COIL_DRIVER_MCP23017 (I2C, ci dessus),
+// COIL_DRIVER_MCP23S17 (SPI), COIL_DRIVER_74HC595 (chaine SPI), COIL_DRIVER_GPIO ou
+// COIL_DRIVER_PCA9685 (I2C, un PWM par electroaimant : les notes d'un accord gardent leur vélocité).
+// magnetPins donne alors le numero de sortie de chaque note : bit des mcp, des registres, voie des
+// pca9685 ou index de COIL_GPIO_PINS
+#define COIL_DRIVER_MCP23017 1
+#define COIL_DRIVER_MCP23S17 2
+#define COIL_DRIVER_74HC595 3
+#define COIL_DRIVER_GPIO 4
+#define COIL_DRIVER_PCA9685 5
+#define COIL_DRIVER COIL_DRIVER_MCP23017
+#define COIL_SPI_FREQ 10000000      // mcp23s17 : 10 MHz maximum
+#define COIL_SPI_CS_PIN 5           // CS des mcp23s17 ou verrou (RCLK) des 74HC595
+#define COIL_595_COUNT 4            // 74HC595 de la chaine (8 sorties chacun, COIL_EXPANDERS * 2 au plus)
+#define PCA9685_BASE_ADDR 0x40      // le pca9685 n est a PCA9685_BASE_ADDR + n (broches A5..A0)
+#define PCA9685_PWM_FREQ 1500       // fréquence du PWM des pca9685 en Hz (24 a 1526)
+const byte COIL_GPIO_PINS[] PROGMEM = {13, 14, 15, 16, 17, 18, 19, 23, 26, 27, 32, 33};
 
 // meloldie joué par la fonction test au demmarage si on utilise test(true) au setup
-const byte INIT_MELODY[] = {60, 62, 64, 65, 67, 69, 71, 72};
-const byte INIT_MELODY_DELAY[] = {200, 200, 200, 200, 200, 200, 200, 200};
+const byte INIT_MELODY[] PROGMEM = {60, 62, 64, 65, 67, 69, 71, 72};
+const byte INIT_MELODY_DELAY[] PROGMEM = {200, 200, 200, 200, 200, 200, 200, 200};
+
+// pipeline sur les deux coeurs : radio et decodage MIDI sur TRANSPORT_CORE,
+// mcp et PWM sur ACTUATION_CORE (tache plus prioritaire), reliés par une file sans verrou
+#define TRANSPORT_CORE 0
+#define ACTUATION_CORE 1
+#define TRANSPORT_TASK_PRIORITY 5
+#define ACTUATION_TASK_PRIORITY 20
+#define TRANSPORT_TASK_STACK 4096
+#define ACTUATION_TASK_STACK 4096
+#define MIDI_RING_SIZE 32 // taille de la file entre les deux taches (puissance de 2)
+
+// playout BLE-MIDI : chaque note est jouée a l'heure de l'emetteur (timestamp BLE-MIDI) + un retard fixe,
+// ce qui supprime la gigue due a l'intervalle de connexion (7.5 a 30ms) au prix d'un retard constant
+#define BLE_PLAYOUT_ENABLED false
+#define BLE_PLAYOUT_LATENCY 30 // retard fixe en ms, doit couvrir l'intervalle de connexion BLE
+
+// lecture de fichiers MIDI stockés sur LittleFS (/midi/<n>.mid), voir SmfPlayer.h
+#define SMF_CONTROL_CC 80   // CC valeur n : joue /midi/<n>.mid, valeur 0 : arret
+#define SMF_MAX_TRACKS 16   // pistes lues au maximum par fichier
+#define SMF_READ_AHEAD 64   // octets chargés d'avance par piste
+#define SMF_LOOKAHEAD 50    // ms d'avance du decodage (tache de transport) sur l'heure de jeu
+#define SMF_RING_SIZE 64    // notes du fichier en file vers la tache d'actionnement (puissance de 2)
+
+// identifiants SysEx de la carte (compteurs de fonctionnement, voir Health.h)
+#define SYSEX_MANUFACTURER_ID 0x7D // identifiant reservé a l'usage non commercial
+#define SYSEX_DEVICE_ID 0x01
+
+// mesures de latence/gigue MIDI -> electroaimant (voir Benchmark.h et MidiHandler::benchmark())
+#define BENCHMARK_ENABLED false
 
 // ... autres variables a venir ...
 #endif // SETTINGS_H
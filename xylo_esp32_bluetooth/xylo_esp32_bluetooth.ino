@@ -9,7 +9,6 @@ Les différents paramètres et réglages du système sont dans settings.h
 
 Bibliothèques requises:
 - Adafruit_MCP23X17
-- Ticker (ESP32)
 - ESP32-BLE-MIDI (https://github.com/lathoub/Arduino-BLE-MIDI)
 
 ***********************************************************************************************************/
@@ -37,14 +36,16 @@ void setup() {
   // Test optionnel - décommenter pour tester au démarrage
   // midiHandler.test(true);  // Joue la mélodie spécifiée dans INIT_MELODY
   // midiHandler.test(false); // Joue toutes les notes l'une après l'autre
+  // midiHandler.benchmark(); // Mesure latence/gigue (BENCHMARK_ENABLED dans settings.h), resultats JSON sur Serial
+
+  // Demarre les taches : transport MIDI sur le coeur 0, electroaimants sur le coeur 1
+  midiHandler.start();
 
   Serial.println("Système prêt - En attente de connexion BLE MIDI...");
 }
 
 void loop() {
   // Mise à jour pour la gestion des électroaimants
-  midiHandler.update();
-
-  // Petite pause pour éviter de surcharger le CPU
-  delay(1);
+  // Tout tourne dans les taches demarrées par midiHandler.start() : la tache loop() n'est plus utile
+  vTaskDelete(NULL);
 }
@@ -0,0 +1,162 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+--------------------------------------     BENCHMARK.CPP    ---------------------------------------------
+_________________________________________________________________________________________________________
+Mesures de latence et de gigue entre la reception MIDI et l'electroaimant
+
+***********************************************************************************************************/
+
+#include "Benchmark.h"
+
+static LatencyHistogram benchLatency;
+static LatencyHistogram benchDwellError;
+static LatencyHistogram benchJitter;
+static unsigned long benchArrival[INSTRUMENT_RANGE];// reception du dernier note on de chaque slot
+static unsigned long benchLastArrival;
+static unsigned long benchLastOn;
+static bool benchHasLast = false;
+
+// ----------------------------------      HISTOGRAM  -----------------------------------------
+
+LatencyHistogram::LatencyHistogram() {
+  reset();
+}
+
+void LatencyHistogram::reset() {
+  for (byte i = 0; i < BENCH_BUCKETS; i++) {
+    _buckets[i] = 0;
+  }
+  _count = 0;
+  _max = 0;
+}
+
+// classes 0..3 : 0..3µs, puis 4 classes par puissance de 2
+byte LatencyHistogram::bucketOf(unsigned long us) {
+  if (us < 4) {
+    return us;
+  }
+  byte msb = 0;
+  for (unsigned long v = us; v > 1; v >>= 1) {
+    msb++;
+  }
+  unsigned int index = (msb - 1) * 4 + ((us >> (msb - 2)) & 3);
+  return index < BENCH_BUCKETS ? index : BENCH_BUCKETS - 1;
+}
+
+unsigned long LatencyHistogram::bucketLow(byte index) {
+  if (index < 4) {
+    return index;
+  }
+  byte msb = index / 4 + 1;
+  return (unsigned long)(4 + index % 4) << (msb - 2);
+}
+
+unsigned long LatencyHistogram::bucketHigh(byte index) {
+  if (index < 4) {
+    return index;
+  }
+  return bucketLow(index) + (1UL << (index / 4 - 1)) - 1;
+}
+
+void LatencyHistogram::add(unsigned long us) {
+  byte index = bucketOf(us);
+  if (_buckets[index] < 0xFFFF) {
+    _buckets[index]++;
+  }
+  if (_count < 0xFFFF) {
+    _count++;
+  }
+  if (us > _max) {
+    _max = us;
+  }
+}
+
+unsigned long LatencyHistogram::percentile(byte p) const {
+  if (_count == 0) {
+    return 0;
+  }
+  unsigned long rank = ((unsigned long)_count * p + 99) / 100;
+  unsigned long seen = 0;
+  for (byte i = 0; i < BENCH_BUCKETS; i++) {
+    seen += _buckets[i];
+    if (seen >= rank) {
+      return min(bucketHigh(i), _max);
+    }
+  }
+  return _max;
+}
+
+void LatencyHistogram::report(const char* workload, const char* metric) const {
+  Serial.print(F("{\"workload\":\""));
+  Serial.print(workload);
+  Serial.print(F("\",\"metric\":\""));
+  Serial.print(metric);
+  Serial.print(F("\",\"count\":"));
+  Serial.print(_count);
+  Serial.print(F(",\"p50\":"));
+  Serial.print(percentile(50));
+  Serial.print(F(",\"p99\":"));
+  Serial.print(percentile(99));
+  Serial.print(F(",\"max\":"));
+  Serial.print(_max);
+  Serial.print(F(",\"buckets\":["));
+  bool first = true;
+  for (byte i = 0; i < BENCH_BUCKETS; i++) {
+    if (_buckets[i] == 0) {
+      continue;
+    }
+    if (!first) {
+      Serial.print(',');
+    }
+    first = false;
+    Serial.print('[');
+    Serial.print(bucketLow(i));
+    Serial.print(',');
+    Serial.print(_buckets[i]);
+    Serial.print(']');
+  }
+  Serial.println(F("]}"));
+}
+
+// ----------------------------------      PROBES  --------------------------------------------
+
+void benchReset() {
+  benchLatency.reset();
+  benchDwellError.reset();
+  benchJitter.reset();
+  benchHasLast = false;
+}
+
+void benchNoteReceived(byte slot, unsigned long time) {
+  if (slot < INSTRUMENT_RANGE) {
+    benchArrival[slot] = time;
+  }
+}
+
+void benchCoilOn(byte slot, unsigned long time) {
+  if (slot >= INSTRUMENT_RANGE) {
+    return;
+  }
+  unsigned long arrival = benchArrival[slot];
+  benchLatency.add(time - arrival);
+  if (benchHasLast) {
+    long inputInterval = arrival - benchLastArrival;
+    long outputInterval = time - benchLastOn;
+    benchJitter.add(labs(outputInterval - inputInterval));
+  }
+  benchLastArrival = arrival;
+  benchLastOn = time;
+  benchHasLast = true;
+}
+
+void benchCoilOff(byte slot, unsigned long time, unsigned long deadline) {
+  long error = time - deadline;
+  benchDwellError.add(error > 0 ? error : 0);
+}
+
+void benchReport(const char* workload) {
+  benchLatency.report(workload, "latency_us");
+  benchDwellError.report(workload, "dwell_error_us");
+  benchJitter.report(workload, "jitter_us");
+}
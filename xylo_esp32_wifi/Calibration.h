@@ -0,0 +1,85 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+--------------------------------------    CALIBRATION.H    ----------------------------------------------
+_________________________________________________________________________________________________________
+Calibration automatique des lames avec un capteur analogique (piezo ou micro sur
+CALIBRATION_PICKUP_PIN)
+
+Pour chaque lame de INSTRUMENT_RANGE :
+  1. frappe au PWM maximum avec chacune des durées de CALIBRATION_DWELLS et garde la plus
+     courte qui sonne presque aussi fort que la meilleure (hitTime de la lame)
+  2. frappe avec cette durée sur CALIBRATION_PWM_STEPS valeurs de PWM, de CALIBRATION_PWM_START
+     a 255, et ajuste deux droites : crete du capteur et latence commande -> son en fonction du PWM
+Avant chaque frappe le capteur est lu au repos pendant CALIBRATION_SETTLE ms (niveau de
+reference), puis ecouté pendant CALIBRATION_WINDOW ms.
+
+Les resultats sont enregistrés lame par lame (EEPROM sur AVR, NVS sur ESP32, via Hal.h) et
+appliqués a Xylophone : durée de frappe, PWM de la vélocité 0 (crete CALIBRATION_MIN_LEVEL) et
+table de latence de la precompensation pour chaque tranche de vélocité. begin() recharge ceux
+qui sont deja enregistrés ; une calibration arretée en cours garde les lames deja faites.
+
+update() ne bloque jamais : il lit au plus un echantillon et fait avancer le balayage, la
+reception MIDI continue pendant la calibration (l'instrument doit rester silencieux pour ne
+pas fausser les mesures). Les ecritures non plus : halStoreWrite() prend un octet a la fois, sur
+AVR un seul octet modifié par passage (~3,3 ms de programmation chacun, l'effacement du debut
+dure ~1,5 s), et la lame suivante attend la fin de l'ecriture. Les calculs sont dans
+CalibrationFit.h.
+***********************************************************************************************************/
+
+#ifndef CALIBRATION_H
+#define CALIBRATION_H
+
+#include <Arduino.h>
+#include "settings.h"
+#include "Hal.h"
+#include "Xylophone.h"
+#include "CalibrationFit.h"
+
+class Calibration {
+public:
+  Calibration(Xylophone &xylophone);
+  void begin();                   // applique les resultats enregistrés
+  void start(unsigned long now);  // calibre toutes les lames, depuis la premiere
+  void stop();
+  bool running() const { return _state != IDLE; }
+  void update(unsigned long now); // echantillonne le capteur et avance le balayage
+
+private:
+  enum State : byte {
+    IDLE,
+    STORE,        // attend la fin de l'ecriture avant de passer a la lame
+    SETTLE,       // capteur au repos avant la frappe
+    LISTEN        // ecoute apres la frappe
+  };
+
+  Xylophone &_xylophone;
+  State _state;
+  byte _note;                     // index de la lame en cours
+  byte _step;                     // etape : d'abord les durées, puis les PWM
+  byte _dwell;                    // durée retenue pour la lame en cours (ms)
+  unsigned long _stepTime;        // debut de l'etat en cours
+  unsigned long _lastSample;
+  EnvelopeDetector _envelope;
+  int _dwellPeaks[sizeof(CALIBRATION_DWELLS)];
+  LinearFit _levelFit;
+  LinearFit _latencyFit;
+  // ecriture en cours en EEPROM/NVS (_storeAddress == _storeEnd : rien a ecrire)
+  int _storeAddress;              // prochain octet
+  int _storeEnd;
+  bool _storeWipe;                // efface toutes les lames, puis ecrit l'en tete
+  NoteCalibration _storeRecord;   // resultat de la lame en cours d'ecriture
+
+  int stepPwm() const;
+  void settle();                  // attend le silence avant la prochaine frappe
+  void strike();
+  void endStep();
+  void endNote();
+  void apply(byte noteIndex, const NoteCalibration &calibration);
+  int recordAddress(byte noteIndex) const;
+  byte storeByte() const;
+  void storeUpdate();             // ecrit ce que la memoire accepte sans attendre
+  void report(byte noteIndex, const NoteCalibration &calibration);
+};
+
+#endif // CALIBRATION_H
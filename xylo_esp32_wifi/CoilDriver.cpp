@@ -0,0 +1,263 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+-------------------------------------    COILDRIVER.CPP    ----------------------------------------------
+_________________________________________________________________________________________________________
+Cartes de sortie des electroaimants
+
+***********************************************************************************************************/
+
+#include "CoilDriver.h"
+#include "Hal.h"
+
+#if COIL_DRIVER == COIL_DRIVER_MCP23017
+
+//*********************************************************************************************
+//******************             MCP23017 (I2C)
+
+bool coilDriverBegin() {
+  bool found = true;
+  for (byte i = 0; i < COIL_BANKS; i++) {
+    found = halExpanderBegin(i, MCP_BASE_ADDR + i) && found;
+  }
+  return found;
+}
+
+// une transaction par mcp modifié, envoyée en arriere plan (les coupures passent par la meme
+// file : la durée de frappe est gardée). Un mcp dont la trame a été abandonnée est réécrit
+void coilDriverWrite(const uint16_t *outputs, const bool *dirty, const byte *duty) {
+  byte lost = halI2cLost();
+  for (byte i = 0; i < COIL_BANKS; i++) {
+    if (dirty[i] || (lost & (1 << i))) {
+      halExpanderWrite(i, outputs[i]);
+    }
+  }
+}
+
+bool coilDriverSync() {
+  return halI2cSync();
+}
+
+#elif COIL_DRIVER == COIL_DRIVER_MCP23S17
+
+//*********************************************************************************************
+//******************             MCP23S17 (SPI)
+
+#define MCP23S17_OPCODE 0x40          // 0100 A2 A1 A0 R/W
+#define MCP23S17_IODIR 0x00
+#define MCP23S17_IOCON 0x0A
+#define MCP23S17_GPIO 0x12
+#define MCP23S17_HAEN 0x08            // adresses materielles actives
+
+// ecrit deux registres consecutifs (A puis B, IOCON.BANK = 0)
+static void mcp23s17Write(byte address, byte reg, uint16_t value) {
+  byte frame[4] = {(byte)(MCP23S17_OPCODE | (address << 1)), reg, (byte)value, (byte)(value >> 8)};
+  halSpiTransfer(COIL_SPI_CS_PIN, frame, sizeof(frame));
+}
+
+bool coilDriverBegin() {
+  halSpiBegin(COIL_SPI_CS_PIN);
+  // HAEN est a 0 a la mise sous tension : cette ecriture a l'adresse 0 touche tous les mcp
+  mcp23s17Write(0, MCP23S17_IOCON, MCP23S17_HAEN | (MCP23S17_HAEN << 8));
+  bool found = true;
+  for (byte i = 0; i < COIL_BANKS; i++) {
+    mcp23s17Write(i, MCP23S17_GPIO, 0);   // sorties a LOW avant de passer les broches en sortie
+    mcp23s17Write(i, MCP23S17_IODIR, 0);
+    // relecture d'IOCON : un mcp absent laisse MISO en l'air
+    byte frame[3] = {(byte)(MCP23S17_OPCODE | (i << 1) | 1), MCP23S17_IOCON, 0};
+    halSpiTransfer(COIL_SPI_CS_PIN, frame, sizeof(frame));
+    found = found && frame[2] == MCP23S17_HAEN;
+  }
+  return found;
+}
+
+void coilDriverWrite(const uint16_t *outputs, const bool *dirty, const byte *duty) {
+  for (byte i = 0; i < COIL_BANKS; i++) {
+    if (dirty[i]) {
+      mcp23s17Write(i, MCP23S17_GPIO, outputs[i]);
+    }
+  }
+}
+
+bool coilDriverSync() {
+  return true;                    // trames SPI deja envoyées
+}
+
+#elif COIL_DRIVER == COIL_DRIVER_74HC595
+
+//*********************************************************************************************
+//******************             74HC595 CHAIN (SPI)
+
+// toute la chaine a chaque ecriture : la sortie 0 est dans le dernier octet envoyé
+static void shiftChain(const uint16_t *outputs) {
+  byte frame[COIL_595_COUNT];
+  for (byte i = 0; i < COIL_595_COUNT; i++) {
+    uint16_t bank = outputs[i >> 1];
+    frame[COIL_595_COUNT - 1 - i] = (i & 1) ? (byte)(bank >> 8) : (byte)bank;
+  }
+  halSpiTransfer(COIL_SPI_CS_PIN, frame, COIL_595_COUNT);// le front montant de COIL_SPI_CS_PIN verrouille
+}
+
+bool coilDriverBegin() {
+  const uint16_t off[COIL_BANKS] = {};
+  halSpiBegin(COIL_SPI_CS_PIN);
+  shiftChain(off);
+  return true;                    // rien a relire sur un 74HC595
+}
+
+void coilDriverWrite(const uint16_t *outputs, const bool *dirty, const byte *duty) {
+  for (byte i = 0; i < COIL_BANKS; i++) {
+    if (dirty[i]) {
+      shiftChain(outputs);        // une seule trame meme si plusieurs banques ont changé
+      return;
+    }
+  }
+}
+
+bool coilDriverSync() {
+  return true;
+}
+
+#elif COIL_DRIVER == COIL_DRIVER_GPIO
+
+//*********************************************************************************************
+//******************             DIRECT GPIO
+
+#define COIL_GPIO_COUNT (sizeof(COIL_GPIO_PINS) / sizeof(COIL_GPIO_PINS[0]))
+static_assert(COIL_GPIO_COUNT <= COIL_BANKS * 16, "COIL_GPIO_PINS depasse les sorties de l'image");
+
+static uint16_t coilGpioLevels[COIL_BANKS];   // niveaux deja ecrits
+
+bool coilDriverBegin() {
+  for (byte n = 0; n < COIL_GPIO_COUNT; n++) {
+    byte pin = pgm_read_byte(&COIL_GPIO_PINS[n]);
+    halPinWrite(pin, LOW);
+    halPinOutput(pin);
+  }
+  for (byte i = 0; i < COIL_BANKS; i++) {
+    coilGpioLevels[i] = 0;
+  }
+  return true;
+}
+
+void coilDriverWrite(const uint16_t *outputs, const bool *dirty, const byte *duty) {
+  for (byte i = 0; i < COIL_BANKS; i++) {
+    uint16_t changed = outputs[i] ^ coilGpioLevels[i];
+    if (!dirty[i] || changed == 0) {
+      continue;
+    }
+    for (byte bit = 0; bit < 16; bit++) {
+      byte n = (i << 4) | bit;
+      if ((changed & (1U << bit)) && n < COIL_GPIO_COUNT) {
+        halPinWrite(pgm_read_byte(&COIL_GPIO_PINS[n]), (outputs[i] >> bit) & 1);
+      }
+    }
+    coilGpioLevels[i] = outputs[i];
+  }
+}
+
+bool coilDriverSync() {
+  return true;
+}
+
+#elif COIL_DRIVER == COIL_DRIVER_PCA9685
+
+//*********************************************************************************************
+//******************             PCA9685 (I2C, PWM PER COIL)
+
+#define PCA9685_MODE1 0x00
+#define PCA9685_MODE2 0x01
+#define PCA9685_LED0 0x06             // LEDn_ON_L, ON_H, OFF_L, OFF_H a 0x06 + 4 * n
+#define PCA9685_ALL_LED_OFF_H 0xFD
+#define PCA9685_PRESCALE 0xFE
+#define PCA9685_SLEEP 0x10
+#define PCA9685_AUTO_INCREMENT 0x20
+#define PCA9685_OUTDRV 0x04           // sorties totem pole (grilles des mosfets, entrées des ULN2803)
+#define PCA9685_FULL 0x10             // bit 4 de ON_H / OFF_H : voie toujours allumée / eteinte
+#define PCA9685_PRESCALE_VALUE ((25000000UL + 2048UL * PCA9685_PWM_FREQ) / (4096UL * PCA9685_PWM_FREQ) - 1)
+static_assert(PCA9685_PRESCALE_VALUE >= 3 && PCA9685_PRESCALE_VALUE <= 255, "PCA9685_PWM_FREQ de 24 a 1526 Hz");
+
+static uint16_t pcaLevels[COIL_BANKS];        // voies allumées deja envoyées
+static byte pcaDuty[COIL_BANKS * 16];         // rapport cyclique deja envoyé de chaque voie allumée
+
+static bool pcaRegister(byte bank, byte reg, byte value) {
+  const byte frame[] = {reg, value};
+  halI2cWrite(bank, PCA9685_BASE_ADDR + bank, frame, sizeof(frame));
+  return halI2cSync();
+}
+
+bool coilDriverBegin() {
+  bool found = true;
+  for (byte i = 0; i < COIL_BANKS; i++) {
+    // le prescaler ne s'ecrit qu'en sommeil, puis reveil avec l'auto incrément des registres
+    found = pcaRegister(i, PCA9685_ALL_LED_OFF_H, PCA9685_FULL) && found;
+    found = pcaRegister(i, PCA9685_MODE1, PCA9685_SLEEP | PCA9685_AUTO_INCREMENT) && found;
+    found = pcaRegister(i, PCA9685_PRESCALE, PCA9685_PRESCALE_VALUE) && found;
+    found = pcaRegister(i, PCA9685_MODE2, PCA9685_OUTDRV) && found;
+    found = pcaRegister(i, PCA9685_MODE1, PCA9685_AUTO_INCREMENT) && found;
+    pcaLevels[i] = 0;
+  }
+  memset(pcaDuty, 0, sizeof(pcaDuty));
+  delayMicroseconds(500);         // redemarrage de l'oscillateur
+  return found;
+}
+
+// voies lowest..highest d'une carte en une trame : ON a 0, OFF au rapport cyclique sur 4096.
+// Une voie change si elle s'allume, s'eteint ou si elle reste allumée avec un autre rapport
+// cyclique (PWM de maintien). Une carte dont la trame a été abandonnée est réécrite en entier
+void coilDriverWrite(const uint16_t *outputs, const bool *dirty, const byte *duty) {
+  byte lost = halI2cLost();
+  for (byte i = 0; i < COIL_BANKS; i++) {
+    if (!dirty[i] && !(lost & (1 << i))) {
+      continue;
+    }
+    uint16_t changed = (lost & (1 << i)) ? 0xFFFF : outputs[i] ^ pcaLevels[i];
+    uint16_t kept = outputs[i] & pcaLevels[i];
+    for (byte channel = 0; channel < 16; channel++) {
+      if ((kept & (1U << channel)) && duty[(i << 4) | channel] != pcaDuty[(i << 4) | channel]) {
+        changed |= 1U << channel;
+      }
+    }
+    if (changed == 0) {
+      continue;
+    }
+    byte lowest = 0;
+    byte highest = 15;
+    while (!(changed & (1U << lowest))) {
+      lowest++;
+    }
+    while (!(changed & (1U << highest))) {
+      highest--;
+    }
+    byte frame[HAL_I2C_FRAME_MAX];
+    byte length = 0;
+    frame[length++] = PCA9685_LED0 + 4 * lowest;
+    for (byte channel = lowest; channel <= highest; channel++) {
+      byte value = duty[(i << 4) | channel];// lu une fois : holdMagnet() peut le changer depuis le timer
+      uint16_t off = 0;
+      byte full = 0;
+      if (!(outputs[i] & (1U << channel))) {
+        off = PCA9685_FULL << 8;  // eteinte
+      } else if (value == 255) {
+        full = PCA9685_FULL;      // toujours allumée
+      } else {
+        off = (uint16_t)value << 4;
+      }
+      pcaDuty[(i << 4) | channel] = value;
+      frame[length++] = 0;
+      frame[length++] = full;
+      frame[length++] = (byte)off;
+      frame[length++] = (byte)(off >> 8);
+    }
+    halI2cWrite(i, PCA9685_BASE_ADDR + i, frame, length);
+    pcaLevels[i] = outputs[i];
+  }
+}
+
+bool coilDriverSync() {
+  return halI2cSync();
+}
+
+#else
+#error "COIL_DRIVER inconnu (voir CoilDriver.h)"
+#endif
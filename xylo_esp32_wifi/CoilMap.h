@@ -0,0 +1,76 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+----------------------------------------    COILMAP.H    ------------------------------------------------
+_________________________________________________________________________________________________________
+Table note -> sortie des electroaimants, calculée a la compilation depuis magnetPins (settings.h)
+
+magnetPins donne, de la premiere a la derniere note de l'instrument, le numero de sortie de
+chaque electroaimant : carte * 16 + broche de la carte. COIL_MAP en tire pour chaque lame la
+banque de l'image des sorties (la carte) et le masque du bit, sans aucun calcul ni test a
+l'execution : une note coute le meme temps sur 2 ou sur 8 cartes, de 1 a 128 notes.
+La lame (slot des files et des tableaux par note) est l'index de la note dans l'instrument.
+
+Les erreurs de magnetPins (nombre de notes, sortie au dela de COIL_EXPANDERS cartes, sortie
+utilisée deux fois) arretent la compilation.
+
+COIL_MAP est rangée en flash (PROGMEM) : sur AVR elle ne prend pas de RAM, et COIL_MAP[slot]
+rend une copie lue par pgm_read_byte()/pgm_read_word() (lecture directe sur ESP32).
+***********************************************************************************************************/
+
+#ifndef COIL_MAP_H
+#define COIL_MAP_H
+
+#include <Arduino.h>
+#include "settings.h"
+
+struct CoilOutput {
+  byte bank;          // carte (banque de 16 sorties de l'image)
+  uint16_t mask;      // bit de la sortie dans la banque
+  byte output;        // numero de sortie (magnetPins), index du PWM par sortie
+};
+
+template <byte N>
+struct CoilMap {
+  CoilOutput outputs[N];
+  CoilOutput operator[](byte slot) const {
+    return CoilOutput{pgm_read_byte(&outputs[slot].bank), pgm_read_word(&outputs[slot].mask), pgm_read_byte(&outputs[slot].output)};
+  }
+};
+
+// suite d'index 0..N-1 pour remplir la table en une expression (C++11, sans <utility> sur AVR)
+template <byte... I> struct CoilIndexes {};
+template <byte N, byte... I> struct CoilMakeIndexes : CoilMakeIndexes<N - 1, N - 1, I...> {};
+template <byte... I> struct CoilMakeIndexes<0, I...> { typedef CoilIndexes<I...> type; };
+
+constexpr CoilOutput coilOutput(byte output) {
+  return CoilOutput{(byte)(output >> 4), (uint16_t)(1U << (output & 0x0F)), output};
+}
+
+template <byte... I>
+constexpr CoilMap<sizeof...(I)> coilMapBuild(CoilIndexes<I...>) {
+  return CoilMap<sizeof...(I)>{{coilOutput(magnetPins[I])...}};
+}
+
+// verifications de magnetPins (fonctions recursives : constexpr C++11)
+constexpr bool coilMapInRange(byte i) {
+  return i == INSTRUMENT_RANGE || (magnetPins[i] < COIL_EXPANDERS * 16 && coilMapInRange(i + 1));
+}
+
+constexpr bool coilMapNotAfter(byte i, byte j) {
+  return j == INSTRUMENT_RANGE || (magnetPins[i] != magnetPins[j] && coilMapNotAfter(i, j + 1));
+}
+
+constexpr bool coilMapUnique(byte i) {
+  return i == INSTRUMENT_RANGE || (coilMapNotAfter(i, i + 1) && coilMapUnique(i + 1));
+}
+
+static_assert(INSTRUMENT_RANGE >= 1 && INSTRUMENT_RANGE <= 128, "INSTRUMENT_RANGE de 1 a 128 notes");
+static_assert(COIL_EXPANDERS >= 1 && COIL_EXPANDERS <= 8, "COIL_EXPANDERS de 1 a 8 cartes");
+static_assert(sizeof(magnetPins) / sizeof(magnetPins[0]) == INSTRUMENT_RANGE, "magnetPins doit avoir INSTRUMENT_RANGE sorties");
+static_assert(coilMapInRange(0), "magnetPins : sortie au dela de COIL_EXPANDERS cartes");
+static_assert(coilMapUnique(0), "magnetPins : sortie utilisée par deux notes");
+
+constexpr CoilMap<INSTRUMENT_RANGE> COIL_MAP PROGMEM = coilMapBuild(CoilMakeIndexes<INSTRUMENT_RANGE>::type());
+
+#endif // COIL_MAP_H
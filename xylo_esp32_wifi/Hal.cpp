@@ -0,0 +1,377 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+------------------------------------------     HAL.CPP     ----------------------------------------------
+_________________________________________________________________________________________________________
+Couche d'abstraction materielle - Version ESP32
+
+***********************************************************************************************************/
+
+#include "Hal.h"
+#include "Health.h"
+#include <Wire.h>
+#include <Adafruit_MCP23X17.h>
+#include <driver/i2c.h>
+#include <esp_timer.h>
+#include <EEPROM.h>
+#include <SPI.h>
+
+#define HAL_TIMER_MIN_US 10
+
+#define HAL_BUS_PORT I2C_NUM_0        // port installé par Wire.begin()
+#define HAL_BUS_TIMEOUT_MS 5          // la plus longue trame (HAL_I2C_FRAME_MAX) prend moins de 2 ms a 400 kHz
+#define HAL_BUS_TASK_STACK 2048
+#define HAL_MCP_GPIO 0x12
+
+static Adafruit_MCP23X17 halMcp[COIL_EXPANDERS];
+static byte halMcpAddress[COIL_EXPANDERS];
+static portMUX_TYPE halStateLock = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t halBusMutex = nullptr;
+static esp_timer_handle_t halTimer = nullptr;
+static esp_timer_handle_t halWakeTimer = nullptr;
+static unsigned long halWakeTime = 0;
+static void (*halTimerCallback)() = nullptr;
+static TaskHandle_t halActuationTask = nullptr;
+static void (*halActuationBody)() = nullptr;
+static void (*halTransportBody)() = nullptr;
+static bool halTimerPending = false;
+// une trame en attente par carte, la plus recente remplace la precedente
+static TaskHandle_t halBusTask = nullptr;
+static byte halBusAddress[COIL_EXPANDERS];
+static byte halBusFrame[COIL_EXPANDERS][HAL_I2C_FRAME_MAX];
+static byte halBusLength[COIL_EXPANDERS];
+static byte halBusPendingMask = 0;
+static bool halBusBusy = false;
+static bool halBusFailed = false;     // une carte n'a pas acquitté depuis le dernier halI2cSync()
+static byte halBusLost = 0;           // cartes dont une trame a été abandonnée (halI2cLost())
+// copie de l'EEPROM emulée ecrite par la tache d'actionnement, l'objet EEPROM n'est touché que
+// par la tache de transport qui l'enregistre (EEPROM.commit() ecrit la flash)
+static byte halStore[HAL_STORE_SIZE];
+static bool halStoreDirty = false;
+
+static void halTimerEntry(void* arg) {
+  if (halActuationTask) {
+    // le callback sera executé par la tache d'actionnement, seule a ecrire les mcp
+    __atomic_store_n(&halTimerPending, true, __ATOMIC_RELEASE);
+    xTaskNotifyGive(halActuationTask);
+  } else if (halTimerCallback) {
+    halTimerCallback();
+  }
+}
+
+static void halWakeEntry(void* arg) {
+  halActuationWake();
+}
+
+static void halActuationLoop(void* arg) {
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    if (__atomic_exchange_n(&halTimerPending, false, __ATOMIC_ACQ_REL) && halTimerCallback) {
+      halTimerCallback();
+    }
+    halActuationBody();
+  }
+}
+
+// une trame en une transaction par command link : i2c_master_cmd_begin() bloque cette tache
+// le temps du transfert, pas la tache d'actionnement
+static bool halBusTransfer(byte address, const byte *data, byte length) {
+  i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+  i2c_master_start(cmd);
+  i2c_master_write_byte(cmd, (address << 1) | I2C_MASTER_WRITE, true);
+  i2c_master_write(cmd, data, length, true);
+  i2c_master_stop(cmd);
+  esp_err_t result = i2c_master_cmd_begin(HAL_BUS_PORT, cmd, pdMS_TO_TICKS(HAL_BUS_TIMEOUT_MS));
+  i2c_cmd_link_delete(cmd);
+  return result == ESP_OK;
+}
+
+static void halBusLoop(void* arg) {
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    for (;;) {
+      halLock();
+      if (halBusPendingMask == 0) {
+        halBusBusy = false;
+        halUnlock();
+        break;
+      }
+      byte index = 0;
+      while (!(halBusPendingMask & (1 << index))) {
+        index++;
+      }
+      halBusPendingMask &= ~(1 << index);
+      byte address = halBusAddress[index];
+      byte length = halBusLength[index];
+      byte frame[HAL_I2C_FRAME_MAX];
+      memcpy(frame, halBusFrame[index], length);
+      halUnlock();
+
+      bool lost = true;
+      for (byte attempt = 0; attempt < HAL_I2C_RETRIES; attempt++) {
+        health.i2cWrites++;
+        if (halBusTransfer(address, frame, length)) {
+          lost = false;
+          break;
+        }
+        health.i2cFailures++;
+        halLock();
+        halBusFailed = true;
+        bool newer = halBusPendingMask & (1 << index);
+        halUnlock();
+        if (newer) {
+          lost = false;
+          break;                  // une valeur plus recente part de toute facon
+        }
+      }
+      if (lost) {
+        // abandonnée : la tache d'actionnement renverra l'image de la carte
+        halLock();
+        halBusLost |= 1 << index;
+        halUnlock();
+        halActuationWake();
+      }
+    }
+  }
+}
+
+// coté transport : recopie sous halLock() (pas d'appel FreeRTOS), ecriture en flash en dehors
+static void halStoreCommit() {
+  halLock();
+  bool dirty = halStoreDirty;
+  if (dirty) {
+    EEPROM.writeBytes(0, halStore, HAL_STORE_SIZE);
+    halStoreDirty = false;
+  }
+  halUnlock();
+  if (dirty) {
+    EEPROM.commit();              // ecrit en NVS seulement si le contenu a changé
+  }
+}
+
+static void halTransportLoop(void* arg) {
+  for (;;) {
+    halTransportBody();
+    halStoreCommit();
+    vTaskDelay(1);                // laisse tourner les taches de la radio
+  }
+}
+
+//*********************************************************************************************
+//******************             INITIALISE THE HARDWARE
+
+void halBegin() {
+  // Initialisation I2C avec les pins spécifiques pour ESP32
+  Wire.begin(I2C_SDA, I2C_SCL);
+  Wire.setClock(HAL_I2C_FREQ);
+  halBusMutex = xSemaphoreCreateMutex();
+  // tache du bus sur le coeur d'actionnement, au dessus de la tache d'actionnement : elle
+  // demarre l'ecriture des qu'elle est postée et rend le coeur pendant le transfert
+  xTaskCreatePinnedToCore(halBusLoop, "xylo_i2c", HAL_BUS_TASK_STACK, nullptr,
+                          ACTUATION_TASK_PRIORITY + 1, &halBusTask, ACTUATION_CORE);
+
+  // Configuration PWM pour ESP32 avec LEDC
+  ledcSetup(PWM_CHANNEL, PWM_FREQ, PWM_RESOLUTION);
+  ledcAttachPin(PWM_PIN, PWM_CHANNEL);
+  ledcWrite(PWM_CHANNEL, 0); // Initialisation à 0
+
+  EEPROM.begin(HAL_STORE_SIZE);
+  EEPROM.readBytes(0, halStore, HAL_STORE_SIZE);
+}
+
+unsigned long halMicros() {
+  return micros();
+}
+
+//*********************************************************************************************
+//******************             CRITICAL SECTIONS
+
+void halLock() {
+  portENTER_CRITICAL(&halStateLock);
+}
+
+void halUnlock() {
+  portEXIT_CRITICAL(&halStateLock);
+}
+
+void halBusLock() {
+  xSemaphoreTake(halBusMutex, portMAX_DELAY);
+}
+
+void halBusUnlock() {
+  xSemaphoreGive(halBusMutex);
+}
+
+//*********************************************************************************************
+//******************             PWM OF THE MAGNETS
+
+void halPwmWrite(int value) {
+  ledcWrite(PWM_CHANNEL, value);
+}
+
+//*********************************************************************************************
+//******************             RELEASE TIMER (ESP_TIMER)
+
+void halTimerBegin(void (*callback)()) {
+  halTimerCallback = callback;
+  // timer one shot, reprogrammé a chaque echeance
+  esp_timer_create_args_t timerArgs = {};
+  timerArgs.callback = halTimerEntry;
+  timerArgs.arg = nullptr;
+  timerArgs.dispatch_method = ESP_TIMER_TASK;
+  timerArgs.name = "xylo_release";
+  esp_timer_create(&timerArgs, &halTimer);
+}
+
+void halTimerArm(unsigned long delayUs) {
+  esp_timer_stop(halTimer);       // erreur ignorée si le timer ne tournait pas
+  esp_timer_start_once(halTimer, max(delayUs, (unsigned long)HAL_TIMER_MIN_US));
+}
+
+void halTimerStop() {
+  esp_timer_stop(halTimer);
+}
+
+//*********************************************************************************************
+//******************             I2C OUTPUTS (BUS TASK)
+
+// configuration par Adafruit_MCP23X17, avant les premieres ecritures de la tache du bus
+bool halExpanderBegin(byte index, byte address) {
+  halMcpAddress[index] = address;
+  if (!halMcp[index].begin_I2C(address)) {
+    return false;
+  }
+  for (byte i = 0; i < 16; i++) {
+    halMcp[index].pinMode(i, OUTPUT);
+  }
+  halMcp[index].writeGPIOAB(0);   // toutes les sorties a LOW en une ecriture
+  return true;
+}
+
+void halI2cWrite(byte index, byte address, const byte *data, byte length) {
+  halLock();
+  halBusAddress[index] = address;
+  memcpy(halBusFrame[index], data, length);
+  halBusLength[index] = length;
+  halBusPendingMask |= 1 << index;
+  halBusBusy = true;
+  halUnlock();
+  xTaskNotifyGive(halBusTask);    // hors du spinlock : pas d'appel FreeRTOS en section critique
+}
+
+byte halI2cLost() {
+  halLock();
+  byte lost = halBusLost;
+  halBusLost = 0;
+  halUnlock();
+  return lost;
+}
+
+void halExpanderWrite(byte index, uint16_t outputs) {
+  const byte frame[] = {HAL_MCP_GPIO, (byte)outputs, (byte)(outputs >> 8)};
+  halI2cWrite(index, halMcpAddress[index], frame, sizeof(frame));
+}
+
+bool halI2cSync() {
+  for (;;) {
+    halLock();
+    bool busy = halBusBusy;
+    bool ok = !halBusFailed;
+    if (!busy) {
+      halBusFailed = false;
+    }
+    halUnlock();
+    if (!busy) {
+      return ok;
+    }
+    vTaskDelay(1);
+  }
+}
+
+//*********************************************************************************************
+//******************             SPI AND GPIO OUTPUTS (OTHER COIL DRIVERS)
+
+void halSpiBegin(byte csPin) {
+  digitalWrite(csPin, HIGH);
+  pinMode(csPin, OUTPUT);
+  SPI.begin();
+}
+
+void halSpiTransfer(byte csPin, byte *data, byte length) {
+  SPI.beginTransaction(SPISettings(COIL_SPI_FREQ, MSBFIRST, SPI_MODE0));
+  digitalWrite(csPin, LOW);
+  SPI.transfer(data, length);     // octets reçus a la place des octets envoyés
+  digitalWrite(csPin, HIGH);
+  SPI.endTransaction();
+}
+
+void halPinOutput(byte pin) {
+  pinMode(pin, OUTPUT);
+}
+
+void halPinWrite(byte pin, bool level) {
+  digitalWrite(pin, level);
+}
+
+//*********************************************************************************************
+//******************             CALIBRATION PICKUP AND NVS
+
+int halPickupRead() {
+  return analogRead(CALIBRATION_PICKUP_PIN);
+}
+
+void halStoreRead(int address, byte *data, int length) {
+  halLock();
+  memcpy(data, halStore + address, length);
+  halUnlock();
+}
+
+bool halStoreWrite(int address, byte data) {
+  halLock();
+  halStore[address] = data;
+  halStoreDirty = true;
+  halUnlock();
+  return true;
+}
+
+//*********************************************************************************************
+//******************             PIPELINE TASKS
+
+void halActuationBegin(void (*body)()) {
+  halActuationBody = body;
+  xTaskCreatePinnedToCore(halActuationLoop, "xylo_actuation", ACTUATION_TASK_STACK, nullptr,
+                          ACTUATION_TASK_PRIORITY, &halActuationTask, ACTUATION_CORE);
+  xTaskNotifyGive(halActuationTask); // traite ce qui est deja en file
+}
+
+void halActuationWake() {
+  if (halActuationTask) {
+    xTaskNotifyGive(halActuationTask);
+  }
+}
+
+void halActuationWakeAt(unsigned long delayUs) {
+  if (!halWakeTimer) {
+    esp_timer_create_args_t timerArgs = {};
+    timerArgs.callback = halWakeEntry;
+    timerArgs.arg = nullptr;
+    timerArgs.dispatch_method = ESP_TIMER_TASK;
+    timerArgs.name = "xylo_wake";
+    esp_timer_create(&timerArgs, &halWakeTimer);
+  }
+  // un seul timer pour tous les reveils programmés : le plus proche gagne, la tache reprogramme
+  // les suivants a son reveil
+  unsigned long time = halMicros() + delayUs;
+  if (esp_timer_is_active(halWakeTimer) && (long)(halWakeTime - time) <= 0) {
+    return;
+  }
+  halWakeTime = time;
+  esp_timer_stop(halWakeTimer);   // erreur ignorée si le timer ne tournait pas
+  esp_timer_start_once(halWakeTimer, max(delayUs, (unsigned long)HAL_TIMER_MIN_US));
+}
+
+void halTransportBegin(void (*body)()) {
+  halTransportBody = body;
+  xTaskCreatePinnedToCore(halTransportLoop, "xylo_transport", TRANSPORT_TASK_STACK, nullptr,
+                          TRANSPORT_TASK_PRIORITY, nullptr, TRANSPORT_CORE);
+}
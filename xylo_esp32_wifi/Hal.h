@@ -0,0 +1,93 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+-------------------------------------------     HAL.H     -----------------------------------------------
+_________________________________________________________________________________________________________
+Couche d'abstraction materielle utilisée par Xylophone
+Regroupe tout ce qui touche directement au materiel : horloge, sections critiques, PWM,
+timer de coupure des electroaimants et bus des cartes de sortie (mcp, SPI, broches).
+
+Xylophone ne connait que ces fonctions : pour executer le code hors de la carte (simulation,
+mesures sur PC), il suffit de fournir un autre Hal.cpp avec une horloge virtuelle et des mcp,
+trames SPI et broches factices qui enregistrent chaque ecriture : sim/Hal.cpp le fait pour la
+version Leonardo (voir sim/Sim.h).
+
+Version ESP32 : esp_timer pour les notes off, Wire/Adafruit_MCP23X17 pour configurer les mcp,
+pilote I2C de l'ESP-IDF (command links) pour les ecritures, LEDC pour le PWM.
+
+Les ecritures I2C (mcp, pca9685) partent en arriere plan : halI2cWrite() range la trame et
+reveille la tache du bus, qui fait le transfert pendant que la tache d'actionnement continue.
+Seul halI2cSync() attend (reset, initialisation).
+
+Pipeline sur les deux coeurs : la radio et le decodage MIDI tournent dans la tache de transport
+(TRANSPORT_CORE), les mcp et le PWM ne sont touchés que par la tache d'actionnement
+(ACTUATION_CORE, haute priorité). Une fois cette tache demarrée, le timer de coupure ne fait
+plus que la reveiller : le callback de halTimerBegin() est executé dans la tache d'actionnement.
+***********************************************************************************************************/
+
+#ifndef HAL_H
+#define HAL_H
+
+#include <Arduino.h>
+#include "settings.h"
+
+// le callback du timer tourne dans une tache (esp_timer puis tache d'actionnement) : il fait les
+// coupures et les frappes et ecrit les mcp
+#define HAL_TIMER_CAN_STRIKE true
+
+void halBegin();                              // initialise le bus des mcp, le PWM et le timer
+unsigned long halMicros();                    // horloge en µs (deborde, comparer par difference)
+
+// section critique imbriquable (spinlock partagé entre loop(), les callbacks MIDI et esp_timer)
+void halLock();
+void halUnlock();
+
+// verrou du bus des mcp : une seule ecriture a la fois, dans l'ordre
+void halBusLock();
+void halBusUnlock();
+
+void halPwmWrite(int value);                  // PWM commun d'alimentation des electroaimants
+
+// timer one shot de coupure des electroaimants
+void halTimerBegin(void (*callback)());
+void halTimerArm(unsigned long delayUs);      // declenche le callback dans delayUs µs
+void halTimerStop();
+
+// cartes I2C des electroaimants (index 0 a COIL_EXPANDERS - 1), bus a HAL_I2C_FREQ
+// une trame en attente par carte, ecrite en une transaction en arriere plan : ne bloque pas.
+// Une trame pas encore partie pour la meme carte est remplacée (chaque trame decrit l'etat complet).
+// Une carte qui n'acquitte pas est réessayée HAL_I2C_RETRIES fois (compteurs de Health.h), puis la
+// trame est abandonnée : halI2cLost() le dit a CoilDriver, qui renvoie l'image de la carte
+#if COIL_DRIVER == COIL_DRIVER_PCA9685
+#define HAL_I2C_FRAME_MAX 65                  // registre + 16 sorties de 4 octets
+#else
+#define HAL_I2C_FRAME_MAX 3                   // registre + GPIOA/GPIOB
+#endif
+void halI2cWrite(byte index, byte address, const byte *data, byte length);
+byte halI2cLost();                            // cartes (bit par index) dont une trame a été abandonnée depuis le dernier appel
+bool halI2cSync();                            // attend la fin des ecritures, false si une carte n'a pas acquitté depuis le dernier appel (jamais sous halLock())
+
+// mcp23017 : sorties en OUTPUT a LOW (attend la fin), puis GPIOA/GPIOB par halI2cWrite()
+bool halExpanderBegin(byte index, byte address);
+void halExpanderWrite(byte index, uint16_t outputs);
+
+// autres cartes de sortie (voir CoilDriver.h) : une trame SPI a COIL_SPI_FREQ entre un front
+// descendant et un front montant de csPin, ou une broche par sortie
+void halSpiBegin(byte csPin);
+void halSpiTransfer(byte csPin, byte *data, byte length);// full duplex : data reçoit les octets lus
+void halPinOutput(byte pin);
+void halPinWrite(byte pin, bool level);
+
+// calibration automatique : capteur analogique et memoire non volatile des resultats
+#define HAL_STORE_SIZE 1024                   // EEPROM emulée, enregistrée dans une entrée NVS
+int halPickupRead();                          // lecture ADC de CALIBRATION_PICKUP_PIN
+void halStoreRead(int address, byte *data, int length);
+bool halStoreWrite(int address, byte data);   // un octet en RAM (toujours true), enregistré en NVS par la tache de transport
+
+// taches du pipeline
+void halActuationBegin(void (*body)());      // tache d'actionnement : body() a chaque reveil
+void halActuationWake();                      // reveille la tache d'actionnement (evenement en file)
+void halActuationWakeAt(unsigned long delayUs); // reveille la tache d'actionnement dans delayUs µs (le plus proche gagne)
+void halTransportBegin(void (*body)());      // tache de transport : body() en boucle
+
+#endif // HAL_H
@@ -0,0 +1,50 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+----------------------------------------     HEALTH.H     -----------------------------------------------
+_________________________________________________________________________________________________________
+Compteurs de fonctionnement, lisibles par SysEx sans console serie
+
+Les compteurs sont incrementés la ou l'evenement a lieu (reception MIDI, Xylophone, ecriture des
+mcp) et ne sont jamais remis a zero : l'hote fait la difference entre deux lectures. Chaque
+compteur n'a qu'un seul endroit qui l'ecrit, les maxima sont mis a jour sous halLock().
+
+Demande : F0 SYSEX_MANUFACTURER_ID SYSEX_DEVICE_ID 06 F7
+Reponse : F0 SYSEX_MANUFACTURER_ID SYSEX_DEVICE_ID 06 <version 1> <nombre de compteurs>
+          puis chaque compteur de HealthCounters dans l'ordre, sur 5 octets de 7 bits
+          (poids faible d'abord, 32 bits), puis F7 : HEALTH_MESSAGE_SIZE octets en tout.
+Un compteur ajouté a la fin de HealthCounters ne change pas la place des autres.
+***********************************************************************************************************/
+
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#include <Arduino.h>
+#include "settings.h"
+
+#define HEALTH_SYSEX_COMMAND 0x06
+#define HEALTH_VERSION 1
+
+struct HealthCounters {
+  uint32_t notesReceived;       // note on reçus (vélocité > 0), tous canaux confondus
+  uint32_t notesPlayed;         // electroaimants alimentés
+  uint32_t notesOutOfRange;     // note on hors de l'instrument (apres l'octave en plus)
+  uint32_t notesFiltered;       // note on d'un autre canal que CHANNEL_XYLO
+  uint32_t retriggers;          // frappes demandées avant que la lame soit prete
+  uint32_t i2cWrites;           // transactions vers les mcp, réessais compris
+  uint32_t i2cFailures;         // ecritures non acquittées par un mcp (réessayées par Hal)
+  uint32_t maxLoopTime;         // plus long passage de la boucle d'actionnement en µs
+  uint32_t maxDwellOvershoot;   // plus grand retard d'une coupure sur son echeance en µs (trame de coupure posée)
+  uint32_t activeCoils;         // electroaimants alimentés au moment de la lecture
+};
+
+#define HEALTH_COUNTERS (sizeof(HealthCounters) / sizeof(uint32_t))
+#define HEALTH_MESSAGE_SIZE (6 + HEALTH_COUNTERS * 5 + 1)
+
+extern HealthCounters health;
+
+void healthMax(uint32_t &counter, unsigned long value);// garde le plus grand, utilisable depuis le timer
+// message SysEx complet de la reponse (HEALTH_MESSAGE_SIZE octets), copie des compteurs sous halLock()
+void healthMessage(byte *message, byte activeCoils);
+
+#endif // HEALTH_H
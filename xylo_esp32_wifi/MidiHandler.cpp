@@ -12,17 +12,26 @@ Version ESP32
 #include <Arduino.h>
 #include "settings.h"
 
+#define SMF_MARK_EVENT 0x00   // type de la marque d'une demande SMF_CONTROL_CC dans _fileEvents (data1 : sequence)
+
 // Instance statique pour les callbacks
 MidiHandler* MidiHandler::_instance = nullptr;
 
 // Instance AppleMIDI
-APPLEMIDI_CREATE_DEFAULTSESSION_INSTANCE();
+APPLEMIDI_CREATE_INSTANCE(JournalUdp, MIDI, APPLEMIDI_SESSION_NAME, APPLEMIDI_CONTROL_PORT); // JournalUdp : copie des paquets pour RtpJournal
 
 // ----------------------------------      PUBLIC  --------------------------------------------
 
-MidiHandler::MidiHandler(Xylophone &xylophone) : _xylophone(xylophone), _wifiConnected(false), _midiConnected(false) {
+MidiHandler::MidiHandler(Xylophone &xylophone) : _xylophone(xylophone), _wifiConnected(false), _midiConnected(false), _calibration(xylophone) {
   _extraOctaveEnabled = digitalRead(EXTRA_OCTAVE_SWITCH_PIN) == LOW;
   _instance = this;
+  _fileRequest = 0;
+  _fileSequence = 0;
+  _fileSequenceSeen = 0;
+  _fileSequenceDone = 0;
+  _fileMarkPending = false;
+  _journal.setHandler(onRecovered);
+  JournalUdp::journal = &_journal;
 
   if(DEBUG_HANDLER){
     Serial.println(F("constructor handler (ESP32 WiFi)"));
@@ -49,8 +58,11 @@ void MidiHandler::begin() {
   AppleMIDI.setHandleNoteOn(onNoteOn);
   AppleMIDI.setHandleNoteOff(onNoteOff);
   AppleMIDI.setHandleControlChange(onControlChange);
+  AppleMIDI.setHandleSystemExclusive(onSysEx);
 
   _xylophone.begin();
+  _player.begin();
+  _calibration.begin();           // reglages de la derniere calibration
 
   Serial.println("AppleMIDI initialisé - En attente de connexion...");
   Serial.print("Adresse IP: ");
@@ -89,6 +101,7 @@ void MidiHandler::connectWiFi() {
 void MidiHandler::onConnected(const ssrc_t & ssrc, const char* name) {
   if(_instance) {
     _instance->_midiConnected = true;
+    _instance->_journal.reset(); // nouvelle session, nouvelle sequence RTP
     Serial.print("AppleMIDI Connecté à session: ");
     Serial.println(name);
   }
@@ -97,55 +110,102 @@ void MidiHandler::onConnected(const ssrc_t & ssrc, const char* name) {
 void MidiHandler::onDisconnected(const ssrc_t & ssrc) {
   if(_instance) {
     _instance->_midiConnected = false;
-    _instance->_xylophone.reset();
+    _instance->queueEvent(0xB0, 123, 0); // all notes off, executé par la tache d'actionnement
     Serial.println("AppleMIDI Déconnecté!");
+    RecoveryStats stats = _instance->_journal.stats();
+    Serial.print("Paquets perdus: ");
+    Serial.print(stats.lostPackets);
+    Serial.print(", evenements rejoués: ");
+    Serial.print(stats.recovered);
+    Serial.print(", abandonnés: ");
+    Serial.println(stats.dropped);
   }
 }
 
 void MidiHandler::onNoteOn(byte channel, byte note, byte velocity) {
   if(_instance) {
+    if (velocity > 0) {
+      _instance->_journal.noteOn(channel, note);
+      health.notesReceived++;
+    } else {
+      _instance->_journal.noteOff(channel, note);
+    }
     // Vérification du canal
     if (!ALL_CHANNEL && channel != CHANNEL_XYLO) {
+      if (velocity > 0) {
+        health.notesFiltered++;
+      }
       return;
     }
-    _instance->handleNoteOn(note, velocity);
+    _instance->queueEvent(0x90, note, velocity);
+  }
+}
+
+// F0 <fabricant> <appareil> 06 F7 : reponse immediate, sans passer par la tache d'actionnement
+void MidiHandler::onSysEx(byte* data, unsigned size) {
+  if(_instance && size == 5 && data[1] == SYSEX_MANUFACTURER_ID
+     && (data[2] == SYSEX_DEVICE_ID || data[2] == 0x7F) && data[3] == HEALTH_SYSEX_COMMAND) {
+    byte message[HEALTH_MESSAGE_SIZE];
+    healthMessage(message, _instance->_xylophone.activeCoils());
+    MIDI.sendSysEx(sizeof(message), message, true);
   }
 }
 
 void MidiHandler::onNoteOff(byte channel, byte note, byte velocity) {
   if(_instance) {
+    _instance->_journal.noteOff(channel, note);
     // Vérification du canal
     if (!ALL_CHANNEL && channel != CHANNEL_XYLO) {
       return;
     }
-    _instance->handleNoteOff(note);
+    _instance->queueEvent(0x80, note, velocity);
   }
 }
 
 void MidiHandler::onControlChange(byte channel, byte control, byte value) {
   if(_instance) {
+    _instance->_journal.controlChange(channel, control, value);
     // Vérification du canal
     if (!ALL_CHANNEL && channel != CHANNEL_XYLO) {
       return;
     }
-    _instance->handleControlChange(control, value);
+    _instance->queueEvent(0xB0, control, value);
   }
 }
 
+// appelé par RtpJournal, dans la tache de transport, pour chaque evenement perdu encore a l'heure
+void MidiHandler::onRecovered(byte type, byte channel, byte data1, byte data2) {
+  if(_instance) {
+    // Vérification du canal
+    if (!ALL_CHANNEL && channel != CHANNEL_XYLO) {
+      return;
+    }
+    _instance->queueEvent(type, data1, data2);
+  }
+}
+
+RecoveryStats MidiHandler::recoveryStats() const {
+  return _journal.stats();
+}
+
 //*********************************************************************************************
 //******************          FUNCTION FOR TEST
 
 void MidiHandler::test(bool playMelody) {
   if (playMelody) {
     for (size_t i = 0; i < sizeof(INIT_MELODY) / sizeof(INIT_MELODY[0]); i++) {
-      handleNoteOn(INIT_MELODY[i], 127);
-      delay(INIT_MELODY_DELAY[i]);
-      handleNoteOff(INIT_MELODY[i]);
+      _rxTime = halMicros() - STRIKE_DELAY * 1000UL; // deja en retard : frappe immediate, sans precompensation
+      handleNoteOn(pgm_read_byte(&INIT_MELODY[i]), 127);
+      _xylophone.update(); // envoie la note aux mcp
+      delay(pgm_read_byte(&INIT_MELODY_DELAY[i]));
+      handleNoteOff(pgm_read_byte(&INIT_MELODY[i]));
     }
   } else {
     // Joue toutes les notes l'une après l'autre
     for (byte note = INSTRUMENT_START_NOTE; note < INSTRUMENT_START_NOTE + INSTRUMENT_RANGE; note++) {
+      _rxTime = halMicros() - STRIKE_DELAY * 1000UL; // deja en retard : frappe immediate, sans precompensation
       handleNoteOn(note, 127);
+      _xylophone.update(); // envoie la note aux mcp
       delay(20);
       _xylophone.update();
       handleNoteOff(note);
@@ -158,12 +218,220 @@ void MidiHandler::test(bool playMelody) {
   }
 }
 
-void MidiHandler::update() {
-  // Lecture des messages MIDI entrants
-  AppleMIDI.run();
+//*********************************************************************************************
+//******************          LATENCY BENCHMARK
+
+// rejoue des charges de reference a travers le handler et envoie les histogrammes sur Serial
+void MidiHandler::benchmark() {
+  if (!BENCHMARK_ENABLED) {
+    Serial.println(F("benchmark : mettre BENCHMARK_ENABLED a true dans settings.h"));
+    return;
+  }
+  unsigned long t;
+
+  // notes seules : toutes les notes de l'instrument a 100ms d'intervalle
+  benchReset();
+  t = halMicros();
+  for (byte i = 0; i < INSTRUMENT_RANGE; i++) {
+    benchWait(t += 100000UL);
+    benchNoteOn(INSTRUMENT_START_NOTE + i, 100);
+  }
+  benchWait(t + 100000UL);
+  benchReport("single_notes");
+
+  // accords denses : 20 accords de 6 notes a 150ms, vélocités differentes
+  benchReset();
+  t = halMicros();
+  for (byte c = 0; c < 20; c++) {
+    benchWait(t += 150000UL);
+    for (byte i = 0; i < 6; i++) {
+      benchNoteOn(INSTRUMENT_START_NOTE + (c + i * 4) % INSTRUMENT_RANGE, 70 + i * 10);
+    }
+  }
+  benchWait(t + 150000UL);
+  benchReport("dense_chords");
+
+  // notes repetées rapides : 50 frappes de la meme note toutes les 40ms
+  benchReset();
+  t = halMicros();
+  for (byte i = 0; i < 50; i++) {
+    benchWait(t += 40000UL);
+    benchNoteOn(INSTRUMENT_START_NOTE + INSTRUMENT_RANGE / 2, 100);
+  }
+  benchWait(t + 100000UL);
+  benchReport("fast_repeats");
+
+  // salves : accord de 8 notes coupé 5ms plus tard par un all notes off (CC 123)
+  benchReset();
+  t = halMicros();
+  for (byte c = 0; c < 10; c++) {
+    benchWait(t += 200000UL);
+    for (byte i = 0; i < 8; i++) {
+      benchNoteOn(INSTRUMENT_START_NOTE + (c + i * 3) % INSTRUMENT_RANGE, 100);
+    }
+    benchWait(t + 5000UL);          // all notes off au milieu des frappes
+    benchControl(123, 0);
+  }
+  benchWait(t + 200000UL);
+  benchReport("all_notes_off_bursts");
+}
 
-  // Mise à jour du xylophone
-  _xylophone.update();
+// les charges passent par les callbacks de la bibliotheque MIDI, puis par la file d'evenements
+void MidiHandler::benchNoteOn(byte note, byte velocity) {
+  onNoteOn(CHANNEL_XYLO, note, velocity);
+}
+
+void MidiHandler::benchControl(byte control, byte value) {
+  onControlChange(CHANNEL_XYLO, control, value);
+}
+
+// la tache d'actionnement n'est pas encore lancée : on fait son travail ici
+void MidiHandler::benchWait(unsigned long until) {
+  while ((long)(halMicros() - until) < 0) {
+    processEvents();
+    _xylophone.update();
+  }
+}
+
+//*********************************************************************************************
+//******************          START THE PIPELINE
+
+void MidiHandler::start() {
+  halActuationBegin(actuationTask);  // coeur ACTUATION_CORE : seule tache a toucher aux mcp et au PWM
+  halTransportBegin(transportTask);  // coeur TRANSPORT_CORE : AppleMIDI.run() et surveillance du WiFi
+}
+
+// appelé par la tache d'actionnement a chaque reveil (evenement en file ou echeance du timer)
+void MidiHandler::actuationTask() {
+  unsigned long start = halMicros();
+  _instance->processEvents();
+  _instance->playFile();
+  _instance->playRoll();
+  _instance->calibrate();
+  _instance->_xylophone.update();
+  healthMax(health.maxLoopTime, halMicros() - start);
+}
+
+void MidiHandler::transportTask() {
+  _instance->pollTransport();
+}
+
+//*********************************************************************************************
+//******************          QUEUE BETWEEN TRANSPORT AND ACTUATION
+
+// coté transport : un seul producteur (transportTask qui appelle AppleMIDI.run())
+void MidiHandler::queueEvent(byte type, byte data1, byte data2) {
+  MidiEvent event = { type, data1, data2, halMicros() };
+  if (_events.push(event)) {
+    halActuationWake();
+  }
+}
+
+// coté actionnement : traite tous les evenements en file, ils partent dans la meme ecriture
+void MidiHandler::processEvents() {
+  MidiEvent event;
+  while (_events.pop(event)) {
+    _rxTime = event.time;
+    switch (event.type) {
+      case 0x80: // Note Off
+        handleNoteOff(event.data1);
+        break;
+      case 0x90: // Note On
+        handleNoteOn(event.data1, event.data2);
+        break;
+      case 0xB0: // Control Change
+        handleControlChange(event.data1, event.data2);
+        break;
+    }
+  }
+}
+
+// coté transport : applique le dernier CC SMF_CONTROL_CC, puis decode le fichier jusqu'a
+// SMF_LOOKAHEAD ms en avance ; les lectures LittleFS restent hors du coeur des electroaimants
+void MidiHandler::feedFile() {
+  uint16_t request = __atomic_load_n(&_fileRequest, __ATOMIC_ACQUIRE);
+  if ((byte)(request >> 8) != _fileSequenceDone) {
+    _fileSequenceDone = request >> 8;
+    _player.stop();
+    byte value = request & 0x7F;
+    if (value > 0) {
+      char path[16];
+      snprintf(path, sizeof(path), "/midi/%d.mid", value);
+      _player.play(path, halMicros());
+    }
+    _fileMarkPending = true;
+  }
+
+  bool queued = false;
+  if (_fileMarkPending) {
+    // marque de la demande : la tache d'actionnement jette les notes d'avant (fichier remplacé)
+    MidiEvent mark = { SMF_MARK_EVENT, _fileSequenceDone, 0, 0 };
+    if (!_fileEvents.push(mark)) {
+      return;
+    }
+    _fileMarkPending = false;
+    queued = true;
+  }
+  MidiEvent event;
+  while (!_fileEvents.full() && _player.next(halMicros() + SMF_LOOKAHEAD * 1000UL, event)) {
+    _fileEvents.push(event);
+    queued = true;
+  }
+  if (queued) {
+    halActuationWake();
+  }
+}
+
+// coté actionnement : joue les notes du fichier arrivées a echeance et programme le reveil suivant
+void MidiHandler::playFile() {
+  MidiEvent event;
+  while (_fileEvents.peek(event)) {
+    if (event.type == SMF_MARK_EVENT) {
+      _fileSequenceSeen = event.data1;
+    } else if (_fileSequenceSeen == _fileSequence) {
+      long wait = (long)(event.time - halMicros());
+      if (wait > 0) {
+        halActuationWakeAt(wait); // les notes suivantes sont plus tardives
+        break;
+      }
+      _rxTime = event.time;
+      if (event.type == 0x90) {
+        handleNoteOn(event.data1, event.data2);
+      } else {
+        handleNoteOff(event.data1);
+      }
+    }
+    _fileEvents.pop(event);       // sinon : note d'une demande remplacée, jetée
+  }
+}
+
+// coté actionnement : coups des roulements arrivés a echeance, puis reveil sur le suivant
+void MidiHandler::playRoll() {
+  byte note;
+  byte velocity;
+  unsigned long time;
+  while (_roll.next(halMicros(), note, velocity, time)) {
+    _xylophone.scheduleNote(note, velocity, time);
+  }
+  unsigned long next;
+  if (_roll.nextTime(next)) {
+    long wait = (long)(next - halMicros());
+    halActuationWakeAt(wait > 0 ? wait : 0);
+  }
+}
+
+// coté actionnement : une lecture du capteur par reveil, reveil suivant a l'echantillon d'apres
+void MidiHandler::calibrate() {
+  if (_calibration.running()) {
+    _calibration.update(halMicros());
+    halActuationWakeAt(CALIBRATION_SAMPLE_INTERVAL);
+  }
+}
+
+void MidiHandler::pollTransport() {
+  // Lecture des messages MIDI entrants (les callbacks remplissent la file)
+  AppleMIDI.run();
+  feedFile();
 
   // Vérification de la connexion WiFi
   if (WiFi.status() != WL_CONNECTED && _wifiConnected) {
@@ -171,6 +439,8 @@ void MidiHandler::update() {
     Serial.println("WiFi déconnecté! Tentative de reconnexion...");
     connectWiFi();
   }
+
+  traceDrain();                   // hors du coeur des electroaimants, sans attendre le port serie
 }
 
 // ----------------------------------      PRIVATE  --------------------------------------------
@@ -198,12 +468,17 @@ void MidiHandler::handleNoteOn(byte note, byte velocity) {
   // Vérifiez si la note est dans la plage jouable du xylophone
   if (isNotePlayable(note)) {
     if(velocity > 0) {
-      if(DEBUG_HANDLER){
-        Serial.print(F("MIDIHandler noteOn = "));
-        Serial.println(note);
+      TRACE_EVENT(TRACE_NOTE_ON, note, velocity);
+      if (BENCHMARK_ENABLED) {
+        benchNoteReceived(note - INSTRUMENT_START_NOTE, _rxTime);
       }
-      _xylophone.playNote(note, velocity);
+      _xylophone.scheduleNote(note, velocity, _rxTime);
+      _roll.noteOn(note, velocity, _rxTime); // refrappée tant qu'elle est tenue si le roulement est armé
+    } else {
+      _roll.noteOff(note);            // note on de vélocité 0 = note off
     }
+  } else if (velocity > 0) {
+    health.notesOutOfRange++;
   }
 }
 
@@ -220,10 +495,8 @@ void MidiHandler::handleNoteOff(byte note) {
   }
 
   if (isNotePlayable(note)) {
-    if(DEBUG_HANDLER){
-      Serial.print(F("MIDIHandler noteOff = "));
-      Serial.println(note);
-    }
+    TRACE_EVENT(TRACE_NOTE_OFF, note, 0);
+    _roll.noteOff(note);              // fin du roulement de cette note
   }
 }
 
@@ -233,10 +506,33 @@ void MidiHandler::handleNoteOff(byte note) {
 void MidiHandler::handleControlChange(byte control, byte value) {
   switch (control) {
     case 121: // Réinitialisation de tous les contrôleurs
+      _roll.setRate(0, halMicros());
+      _roll.setShape(64);
       _xylophone.reset();
       break;
     case 123: // Désactiver toutes les notes
+      _roll.clear();
       _xylophone.reset();
       break;
+    case ROLL_CC: // cadence des roulements, 0 = desarmé
+      _roll.setRate(value, halMicros());
+      break;
+    case ROLL_SHAPE_CC: // forme de la vélocité des roulements
+      _roll.setShape(value);
+      break;
+    case THERMAL_REPORT_CC: // echauffement des bobines (voir CoilThermal.h)
+      _xylophone.thermalReport();
+      break;
+    case CALIBRATION_CC: // calibration automatique avec le capteur (voir Calibration.h)
+      if (value == 0) {
+        _calibration.stop();
+      } else {
+        _calibration.start(halMicros());
+      }
+      break;
+    case SMF_CONTROL_CC: // lecture d'un fichier MIDI de LittleFS, par la tache de transport
+      _fileSequence++;            // les notes deja en file pour la demande precedente seront jetées
+      __atomic_store_n(&_fileRequest, (uint16_t)((_fileSequence << 8) | value), __ATOMIC_RELEASE);
+      break;
   }
 }
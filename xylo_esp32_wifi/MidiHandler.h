@@ -17,6 +17,29 @@ noteOff : Enregistre le noteOff pour gérer les compteurs de notes actives
 controle change :
   - CC 121 : Réinitialisation de tous les contrôleurs
   - CC 123 : Désactiver toutes les notes
+  - CC THERMAL_REPORT_CC : envoie l'echauffement de chaque bobine en JSON sur Serial
+  - CC CALIBRATION_CC : valeur > 0 lance la calibration automatique des lames, 0 l'arrete
+  - CC ROLL_CC / ROLL_SHAPE_CC : cadence et forme des roulements generés par la carte (voir Roll.h),
+    les notes tenues sont refrappées jusqu'a leur note off
+
+Pipeline FreeRTOS (demarré par start()) :
+  - tache de transport sur TRANSPORT_CORE : la radio et les callbacks MIDI ne font que
+    ranger les messages dans une EventRing (file sans verrou, un producteur/un consommateur)
+  - tache d'actionnement sur ACTUATION_CORE, plus prioritaire : vide la file, joue les notes et
+    ecrit les mcp. C'est la seule tache qui touche aux mcp, au PWM et a l'etat des notes.
+test() et benchmark() s'utilisent avant start(), depuis setup().
+
+Fichiers MIDI : CC SMF_CONTROL_CC de valeur n joue /midi/<n>.mid depuis LittleFS (0 = arret).
+Le fichier est lu et decodé par la tache de transport, SMF_LOOKAHEAD ms avant l'heure de jeu, et
+les notes datées passent par une seconde EventRing : la tache d'actionnement ne touche jamais a
+LittleFS, elle joue chaque note a son heure (voir SmfPlayer.h).
+
+Pertes de paquets : la session AppleMIDI utilise JournalUdp, RtpJournal detecte les paquets
+perdus et rejoue dans la file les note on et CC retrouvés dans le recovery journal, sauf ceux
+qui arriveraient apres WIFI_RECOVERY_LATENESS. Compteurs lisibles par recoveryStats().
+
+SysEx F0 SYSEX_MANUFACTURER_ID SYSEX_DEVICE_ID 06 F7 : renvoie les compteurs de fonctionnement
+(Health.h), directement depuis la tache de transport.
 
 MidiHandler initialise tous les objets nécessaires utilisés, dans ce cas : xylophone
 
@@ -25,6 +48,11 @@ MidiHandler initialise tous les objets nécessaires utilisés, dans ce cas : xyl
 #define MIDI_HANDLER_H
 
 #include "Xylophone.h"
+#include "EventRing.h"
+#include "SmfPlayer.h"
+#include "Calibration.h"
+#include "Roll.h"
+#include "RtpJournal.h"
 #include <WiFi.h>
 #include <AppleMIDI.h>
 
@@ -33,11 +61,14 @@ public:
   MidiHandler(Xylophone &xylophone);
   void begin(); // initialise tout ce qui doit l'etre
   void test(bool playMelody);
-  void update();
+  void benchmark(); // mesure latence/gigue sur des charges de reference (BENCHMARK_ENABLED)
+  void start(); // demarre les taches de transport (coeur 0) et d'actionnement (coeur 1)
+  RecoveryStats recoveryStats() const; // paquets RTP perdus, evenements rejoués et abandonnés
 
 private:
   Xylophone& _xylophone;
   bool _extraOctaveEnabled;  // lit si le switch extra octave est actif ou non
+  unsigned long _rxTime;     // instant de reception du message en cours (halMicros)
   bool _wifiConnected;       // statut de connexion WiFi
   bool _midiConnected;       // statut de connexion MIDI
 
@@ -47,10 +78,38 @@ private:
   static void onNoteOn(byte channel, byte note, byte velocity);
   static void onNoteOff(byte channel, byte note, byte velocity);
   static void onControlChange(byte channel, byte control, byte value);
+  static void onRecovered(byte type, byte channel, byte data1, byte data2); // evenement retrouvé dans le journal
+  static void onSysEx(byte* data, unsigned size); // demande des compteurs de fonctionnement (Health.h)
 
   // Instance statique pour les callbacks
   static MidiHandler* _instance;
 
+  // Recuperation des pertes (coté transport)
+  RtpJournal _journal;
+
+  // Pipeline : file sans verrou entre la tache de transport et la tache d'actionnement
+  EventRing<MidiEvent, MIDI_RING_SIZE> _events;
+  void queueEvent(byte type, byte data1, byte data2); // coté transport
+  void processEvents();                                // coté actionnement
+
+  // Fichiers MIDI : decodés par la tache de transport, joués par la tache d'actionnement
+  SmfPlayer _player;                                   // coté transport
+  EventRing<MidiEvent, SMF_RING_SIZE> _fileEvents;     // notes datées, SMF_LOOKAHEAD ms d'avance au plus
+  uint16_t _fileRequest;     // sequence << 8 | valeur du dernier CC SMF_CONTROL_CC, ecrit par l'actionnement
+  byte _fileSequence;        // coté actionnement : sequence de la derniere demande
+  byte _fileSequenceSeen;    // coté actionnement : sequence de la derniere marque lue dans _fileEvents
+  byte _fileSequenceDone;    // coté transport : sequence de la derniere demande traitée
+  bool _fileMarkPending;     // coté transport : marque de la demande pas encore en file (file pleine)
+  void feedFile();                                     // coté transport : decode le fichier en avance
+  void playFile();                                     // coté actionnement : notes du fichier arrivées a echeance
+  Calibration _calibration;
+  void calibrate();                                    // coté actionnement : avance la calibration
+  Roll _roll;
+  void playRoll();                                     // coté actionnement : coups des roulements
+  static void actuationTask();
+  static void transportTask();
+  void pollTransport();
+
   // Gestion des messages NoteOn, NoteOff
   void handleNoteOn(byte note, byte velocity);
   void handleNoteOff(byte note);
@@ -59,6 +118,11 @@ private:
   // Gestion des Controls change
   void handleControlChange(byte control, byte value); // gestion des CC
 
+  // Charges de reference du benchmark
+  void benchNoteOn(byte note, byte velocity);
+  void benchControl(byte control, byte value);
+  void benchWait(unsigned long until); // fait tourner la file et update() jusqu'a l'instant indiqué
+
   // Gestion WiFi
   void connectWiFi();
 };
@@ -0,0 +1,84 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+----------------------------------------     ROLL.CPP     -----------------------------------------------
+_________________________________________________________________________________________________________
+Roulements (trémolo) generés par la carte
+
+***********************************************************************************************************/
+
+#include "Roll.h"
+
+Roll::Roll() : _period(0), _shape(0) {
+  clear();
+}
+
+void Roll::setRate(byte value, unsigned long now) {
+  bool wasArmed = armed();
+  if (value == 0) {
+    _period = 0;
+    _queue.clear();             // les notes restent tenues, sans coups
+    return;
+  }
+  unsigned long rate = map(value, 1, 127, ROLL_MIN_RATE, ROLL_MAX_RATE);
+  _period = 1000000UL / rate;   // appliqué a partir du prochain coup de chaque note
+  if (!wasArmed) {
+    // armé pendant que des notes sont tenues : elles roulent tout de suite
+    for (byte i = 0; i < INSTRUMENT_RANGE; i++) {
+      if (_velocity[i] != 0) {
+        _queue.push(i, now + _period);
+      }
+    }
+  }
+}
+
+void Roll::setShape(byte value) {
+  _shape = ((int)value - 64) / 8;
+}
+
+void Roll::noteOn(byte note, byte velocity, unsigned long time) {
+  int noteIndex = note - INSTRUMENT_START_NOTE;
+  if (noteIndex < 0 || noteIndex >= INSTRUMENT_RANGE || velocity == 0) {
+    return;
+  }
+  _velocity[noteIndex] = velocity;
+  if (armed()) {
+    _queue.push(noteIndex, time + _period);
+  }
+}
+
+void Roll::noteOff(byte note) {
+  int noteIndex = note - INSTRUMENT_START_NOTE;
+  if (noteIndex >= 0 && noteIndex < INSTRUMENT_RANGE) {
+    _velocity[noteIndex] = 0;
+    _queue.remove(noteIndex);
+  }
+}
+
+void Roll::clear() {
+  for (byte i = 0; i < INSTRUMENT_RANGE; i++) {
+    _velocity[i] = 0;
+  }
+  _queue.clear();
+}
+
+bool Roll::next(unsigned long now, byte &note, byte &velocity, unsigned long &time) {
+  if (!_queue.due(now)) {
+    return false;
+  }
+  time = _queue.topTime();
+  byte noteIndex = _queue.pop();
+  note = INSTRUMENT_START_NOTE + noteIndex;
+  velocity = _velocity[noteIndex];
+  _velocity[noteIndex] = constrain(velocity + _shape, 1, 127);
+  _queue.push(noteIndex, time + _period);      // depuis l'echeance, pas depuis now : pas de derive
+  return true;
+}
+
+bool Roll::nextTime(unsigned long &time) const {
+  if (_queue.empty()) {
+    return false;
+  }
+  time = _queue.topTime();
+  return true;
+}
@@ -0,0 +1,48 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+-----------------------------------------     ROLL.H     ------------------------------------------------
+_________________________________________________________________________________________________________
+Roulements (trémolo) generés par la carte
+
+CC ROLL_CC arme le roulement : valeur 1..127 de ROLL_MIN_RATE a ROLL_MAX_RATE coups par seconde,
+0 le desarme. Tant qu'il est armé, chaque note tenue (note on sans note off) est refrappée a
+cette cadence avec l'horloge de la carte : l'hote n'envoie qu'un note on et un note off, le
+lien BLE/WiFi/USB ne transporte plus chaque coup et n'en deforme plus la regularité.
+
+CC ROLL_SHAPE_CC donne la forme de la vélocité : 64 constante, au dessus chaque coup est plus
+fort que le precedent (crescendo), en dessous plus faible (decrescendo), de (valeur - 64) / 8
+par coup, entre 1 et 127.
+
+Les notes tenues sont suivies meme roulement desarmé : armer le roulement pendant qu'un accord
+est tenu le fait rouler. Les prochains coups sont dans une DeadlineQueue indexée par lame et
+chaque echeance est calculée depuis la precedente : pas de derive.
+***********************************************************************************************************/
+
+#ifndef ROLL_H
+#define ROLL_H
+
+#include <Arduino.h>
+#include "settings.h"
+#include "DeadlineQueue.h"
+
+class Roll {
+public:
+  Roll();
+  void setRate(byte value, unsigned long now);  // CC ROLL_CC
+  void setShape(byte value);                    // CC ROLL_SHAPE_CC
+  bool armed() const { return _period != 0; }
+  void noteOn(byte note, byte velocity, unsigned long time);// premier coup joué a time par l'appelant
+  void noteOff(byte note);
+  void clear();                                 // oublie les notes tenues
+  bool next(unsigned long now, byte &note, byte &velocity, unsigned long &time);// prochain coup arrivé a echeance
+  bool nextTime(unsigned long &time) const;     // echeance du prochain coup, false si aucun
+
+private:
+  unsigned long _period;                        // µs entre deux coups, 0 = desarmé
+  int8_t _shape;                                // variation de vélocité par coup
+  byte _velocity[INSTRUMENT_RANGE];             // vélocité du prochain coup, 0 = note relachée
+  DeadlineQueue<INSTRUMENT_RANGE> _queue;       // prochain coup de chaque note tenue
+};
+
+#endif // ROLL_H
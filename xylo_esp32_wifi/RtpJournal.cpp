@@ -0,0 +1,347 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+--------------------------------------    RTPJOURNAL.CPP    ---------------------------------------------
+_________________________________________________________________________________________________________
+Recuperation des pertes de paquets RTP-MIDI a l'aide du "recovery journal" (RFC 6295)
+
+***********************************************************************************************************/
+
+#include "RtpJournal.h"
+#include "Hal.h"
+
+// table des chapitres d'un journal de canal
+#define CHAPTER_P 0x80
+#define CHAPTER_C 0x40
+#define CHAPTER_M 0x20
+#define CHAPTER_W 0x10
+#define CHAPTER_N 0x08
+
+RtpJournal *JournalUdp::journal = nullptr;
+
+// ----------------------------------      PUBLIC  --------------------------------------------
+
+RtpJournal::RtpJournal() : _handler(nullptr), _lostPackets(0), _recovered(0), _dropped(0) {
+  reset();
+}
+
+void RtpJournal::reset() {
+  _synced = false;
+  _late = false;
+  memset(_notesOn, 0, sizeof(_notesOn));
+  memset(_noteOnSeq, 0, sizeof(_noteOnSeq));
+  memset(_ccValue, 0x80, sizeof(_ccValue));
+  memset(_ccCount, 0, sizeof(_ccCount));
+}
+
+void RtpJournal::setHandler(void (*handler)(byte type, byte channel, byte data1, byte data2)) {
+  _handler = handler;
+}
+
+RecoveryStats RtpJournal::stats() const {
+  RecoveryStats stats = { _lostPackets, _recovered, _dropped };
+  return stats;
+}
+
+//*********************************************************************************************
+//******************          STATE RECEIVED WITHOUT LOSS
+
+// les callbacks d'un paquet sont appelés apres feed() : _extendedSeq est celui de ce paquet
+void RtpJournal::noteOn(byte channel, byte note) {
+  if (channel >= 1 && channel <= 16) {
+    setNote(channel - 1, note & 0x7F, true);
+    _noteOnSeq[channel - 1][note & 0x7F] = _extendedSeq;
+  }
+}
+
+void RtpJournal::noteOff(byte channel, byte note) {
+  if (channel >= 1 && channel <= 16) {
+    setNote(channel - 1, note & 0x7F, false);
+  }
+}
+
+void RtpJournal::controlChange(byte channel, byte control, byte value) {
+  if (channel >= 1 && channel <= 16) {
+    _ccValue[channel - 1][control & 0x7F] = value & 0x7F;
+    _ccCount[channel - 1][control & 0x7F] = (_ccCount[channel - 1][control & 0x7F] + 1) & 0x3F;
+  }
+}
+
+//*********************************************************************************************
+//******************          RTP PACKET
+
+// appelé avec chaque paquet du port de données, avant que la bibliotheque n'en decode les commandes
+void RtpJournal::feed(const byte *packet, unsigned int length, bool complete) {
+  if (length < 12 || (packet[0] >> 6) != 2) {
+    return; // pas un paquet RTP
+  }
+  uint16_t seq = (packet[2] << 8) | packet[3];
+  uint32_t timestamp = ((uint32_t)packet[4] << 24) | ((uint32_t)packet[5] << 16) | (packet[6] << 8) | packet[7];
+  unsigned long now = halMicros();
+
+  if (_synced) {
+    uint16_t gap = seq - _lastSeq - 1;
+    if (gap >= 0x8000) {
+      return; // paquet en double ou arrivé apres un plus recent : son contenu est deja dans l'etat
+    }
+    _extendedSeq += gap + 1;
+    if (gap > 0) {
+      _lostPackets += gap;
+      _late = lateness(now, timestamp, gap) > WIFI_RECOVERY_LATENESS * 1000UL;
+
+      // entete RTP (12 octets + CSRC), puis section des commandes MIDI : B J Z P LEN
+      unsigned int pos = 12 + 4 * (packet[0] & 0x0F);
+      if (complete && pos < length) {
+        byte header = packet[pos];
+        unsigned int commandsLength = header & 0x0F;
+        if (header & 0x80) {
+          commandsLength = (commandsLength << 8) | (pos + 1 < length ? packet[pos + 1] : 0);
+          pos += 2;
+        } else {
+          pos += 1;
+        }
+        pos += commandsLength;
+        if ((header & 0x40) && pos < length) {
+          parseJournal(packet + pos, length - pos);
+        }
+      }
+    }
+  } else {
+    _extendedSeq = 0x10000UL + seq;
+  }
+  _synced = true;
+  _lastSeq = seq;
+  _lastTimestamp = timestamp;
+  _lastArrival = now;
+}
+
+// ----------------------------------      PRIVATE  --------------------------------------------
+
+//*********************************************************************************************
+//******************          LATENESS OF A LOST PACKET
+
+// retard du plus ancien des gap paquets perdus, envoyés a intervalles reguliers entre le dernier
+// paquet reçu et celui-ci : il aurait dû arriver span / (gap + 1) apres le dernier reçu
+unsigned long RtpJournal::lateness(unsigned long now, uint32_t timestamp, uint16_t gap) const {
+  unsigned long elapsed = now - _lastArrival;
+  int32_t ticks = timestamp - _lastTimestamp;
+  if (ticks <= 0) {
+    return elapsed;               // horloge de l'emetteur inutilisable : tout le silence est du retard
+  }
+  unsigned long expected = (uint64_t)ticks * 1000000UL / RTP_CLOCK_RATE / (gap + 1);
+  return elapsed > expected ? elapsed - expected : 0;
+}
+
+//*********************************************************************************************
+//******************          RECOVERY JOURNAL
+
+// entete : S Y A H TOTCHAN, numero de sequence du checkpoint, puis journal systeme et journaux de canal
+void RtpJournal::parseJournal(const byte *journal, unsigned int length) {
+  if (length < 3) {
+    return;
+  }
+  byte header = journal[0];
+  // checkpoint deroulé : au plus 2^16 - 1 paquets avant celui-ci
+  uint16_t checkpointSeq = (journal[1] << 8) | journal[2];
+  uint32_t checkpoint = _extendedSeq - (uint16_t)((uint16_t)_extendedSeq - checkpointSeq);
+  unsigned int pos = 3;
+
+  if (header & 0x40) {
+    // journal systeme (sysex, horloge...) : ignoré
+    if (pos + 2 > length) {
+      return;
+    }
+    pos += ((journal[pos] & 0x03) << 8) | journal[pos + 1];
+  }
+  if (!(header & 0x20)) {
+    return;
+  }
+
+  byte channels = (header & 0x0F) + 1;
+  for (byte i = 0; i < channels; i++) {
+    // entete de canal : S CHAN H LENGTH (10 bits, entete compris), puis table des chapitres
+    if (pos + 3 > length) {
+      return;
+    }
+    byte channel = (journal[pos] >> 3) & 0x0F;
+    unsigned int channelLength = ((journal[pos] & 0x03) << 8) | journal[pos + 1];
+    if (channelLength < 3 || pos + channelLength > length) {
+      return;
+    }
+    parseChannel(channel, journal + pos + 3, channelLength - 3, journal[pos + 2], checkpoint);
+    pos += channelLength;
+  }
+}
+
+// les chapitres sont dans l'ordre P C M W N E T A, seuls C et N sont utiles au xylophone
+void RtpJournal::parseChannel(byte channel, const byte *chapters, unsigned int length, byte toc,
+                              uint32_t checkpoint) {
+  unsigned int pos = 0;
+
+  if (toc & CHAPTER_P) {
+    pos += 3;
+  }
+  if (toc & CHAPTER_C) {
+    if (pos + 1 > length) {
+      return;
+    }
+    unsigned int chapterLength = 1 + 2 * ((chapters[pos] & 0x7F) + 1);
+    if (pos + chapterLength > length) {
+      return;
+    }
+    recoverControls(channel, chapters + pos);
+    pos += chapterLength;
+  }
+  if (toc & CHAPTER_M) {
+    if (pos + 2 > length) {
+      return;
+    }
+    pos += ((chapters[pos] & 0x03) << 8) | chapters[pos + 1];
+  }
+  if (toc & CHAPTER_W) {
+    pos += 2;
+  }
+  if (toc & CHAPTER_N) {
+    if (pos + 2 > length) {
+      return;
+    }
+    recoverNotes(channel, chapters + pos, length - pos, checkpoint);
+  }
+}
+
+// chapitre C : S LEN, puis LEN+1 entrees S NUMBER / A VALUE (ou A T ALT pour les CC codés en compteur)
+void RtpJournal::recoverControls(byte channel, const byte *chapter) {
+  byte count = (chapter[0] & 0x7F) + 1;
+  for (byte i = 0; i < count; i++) {
+    byte control = chapter[1 + 2 * i] & 0x7F;
+    byte value = chapter[2 + 2 * i];
+    if (value & 0x80) {
+      // compteur de messages : un ecart signifie qu'au moins un message a été perdu
+      byte alt = value & 0x3F;
+      if (_ccCount[channel][control] != alt) {
+        _ccCount[channel][control] = alt;
+        replay(0xB0, channel, control, (value & 0x40) ? 0 : ((alt & 1) ? 127 : 0), true);
+      }
+    } else if (_ccValue[channel][control] != value) {
+      _ccValue[channel][control] = value;
+      replay(0xB0, channel, control, value, true);
+    }
+  }
+}
+
+// chapitre N : B LEN, LOW HIGH, LEN journaux de note (S NOTENUM / Y VELOCITY), puis les OFFBITS
+// des notes LOW*8 a HIGH*8+7. Un journal de note est le dernier note on de la note apres le
+// checkpoint : un note on reçu dans un paquet plus recent que le checkpoint est celui-la (ou un
+// plus recent encore), il a deja été joué
+void RtpJournal::recoverNotes(byte channel, const byte *chapter, unsigned int length, uint32_t checkpoint) {
+  byte logs = chapter[0] & 0x7F;
+  byte low = chapter[1] >> 4;
+  byte high = chapter[1] & 0x0F;
+  unsigned int noteLogs = (logs == 127 && low == 15 && high == 0) ? 128 : logs;
+  unsigned int offBytes = low <= high ? high - low + 1 : 0;
+  if (2 + 2 * noteLogs + offBytes > length) {
+    return;
+  }
+
+  for (unsigned int i = 0; i < noteLogs; i++) {
+    byte note = chapter[2 + 2 * i] & 0x7F;
+    byte velocity = chapter[3 + 2 * i] & 0x7F;
+    if (velocity > 0 && _noteOnSeq[channel][note] <= checkpoint) {
+      // le note on perdu etait au plus tard dans le paquet qui precede celui-ci
+      setNote(channel, note, true);
+      _noteOnSeq[channel][note] = _extendedSeq - 1;
+      replay(0x90, channel, note, velocity, chapter[3 + 2 * i] & 0x80);
+    }
+  }
+
+  const byte *offBits = chapter + 2 + 2 * noteLogs;
+  for (unsigned int i = 0; i < offBytes; i++) {
+    for (byte bit = 0; bit < 8; bit++) {
+      byte note = (low + i) * 8 + bit;
+      if ((offBits[i] & (0x80 >> bit)) && isNoteOn(channel, note)) {
+        setNote(channel, note, false);
+        replay(0x80, channel, note, 0, true);
+      }
+    }
+  }
+}
+
+// un note off rejoué ne frappe pas : il n'est jamais trop tard pour corriger l'etat
+void RtpJournal::replay(byte type, byte channel, byte data1, byte data2, bool recommended) {
+  if (type != 0x80 && (!recommended || _late)) {
+    _dropped++;
+    return;
+  }
+  _recovered++;
+  if (_handler) {
+    _handler(type, channel + 1, data1, data2);
+  }
+}
+
+bool RtpJournal::isNoteOn(byte channel, byte note) const {
+  return _notesOn[channel][note >> 3] & (1 << (note & 7));
+}
+
+void RtpJournal::setNote(byte channel, byte note, bool on) {
+  if (on) {
+    _notesOn[channel][note >> 3] |= 1 << (note & 7);
+  } else {
+    _notesOn[channel][note >> 3] &= ~(1 << (note & 7));
+  }
+}
+
+//*********************************************************************************************
+//******************          UDP SOCKET COPYING THE DATA PORT
+
+uint8_t JournalUdp::begin(uint16_t port) {
+  _isDataPort = port == APPLEMIDI_CONTROL_PORT + 1;
+  return WiFiUDP::begin(port);
+}
+
+int JournalUdp::parsePacket() {
+  int size = WiFiUDP::parsePacket();
+  if (_isDataPort && size > 0) {
+    _packetSize = size;
+    _captured = 0;
+  }
+  return size;
+}
+
+int JournalUdp::read() {
+  int value = WiFiUDP::read();
+  if (value >= 0) {
+    byte data = value;
+    capture(&data, 1);
+  }
+  return value;
+}
+
+int JournalUdp::read(unsigned char *buffer, size_t length) {
+  int count = WiFiUDP::read(buffer, length);
+  if (count > 0) {
+    capture(buffer, count);
+  }
+  return count;
+}
+
+int JournalUdp::read(char *buffer, size_t length) {
+  return read((unsigned char *)buffer, length);
+}
+
+// le paquet est transmis au journal des que la bibliotheque en a lu le dernier octet
+void JournalUdp::capture(const byte *data, int length) {
+  if (!_isDataPort || _packetSize == 0) {
+    return;
+  }
+  for (int i = 0; i < length; i++, _captured++) {
+    if (_captured < RTP_PACKET_BUFFER_SIZE) {
+      _packet[_captured] = data[i];
+    }
+  }
+  if (_captured >= _packetSize) {
+    if (journal) {
+      journal->feed(_packet, min(_packetSize, RTP_PACKET_BUFFER_SIZE), _packetSize <= RTP_PACKET_BUFFER_SIZE);
+    }
+    _packetSize = 0;
+  }
+}
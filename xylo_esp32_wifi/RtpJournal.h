@@ -0,0 +1,108 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+---------------------------------------    RTPJOURNAL.H    ----------------------------------------------
+_________________________________________________________________________________________________________
+Recuperation des pertes de paquets RTP-MIDI a l'aide du "recovery journal" (RFC 6295)
+
+La bibliotheque AppleMIDI decode les commandes MIDI mais ignore le journal de recuperation que
+l'emetteur joint a chaque paquet. JournalUdp remplace WiFiUDP dans la session AppleMIDI : il
+laisse passer les octets sans les modifier et en garde une copie, RtpJournal analyse chaque paquet
+du port de données complet avant que la bibliotheque n'appelle les callbacks MIDI.
+
+RtpJournal suit les numeros de sequence RTP. Quand des paquets manquent, il compare les chapitres
+N (note on/off) et C (control change) du journal avec l'etat reçu (notes tenues, valeur et nombre
+de chaque CC) et rejoue ce qui a été perdu :
+  - note on perdu    -> le journal couvre les paquets qui suivent son checkpoint : un note on
+                        journalisé n'est perdu que si le dernier note on reçu pour cette note est
+                        arrivé au plus tard dans le paquet du checkpoint (RFC 6295, annexe A.4).
+                        Il est alors rejoué si l'emetteur le recommande (bit Y) et si le retard
+                        estimé reste dans WIFI_RECOVERY_LATENESS, sinon abandonné (une frappe hors
+                        temps est pire qu'une note manquante)
+  - note off perdu   -> etat corrigé (pas de note bloquée au prochain journal)
+  - control change   -> rejoué avec la valeur du journal, dans la meme limite de retard
+Le retard est estimé pour le plus ancien des paquets perdus : les timestamps RTP du dernier paquet
+reçu et de celui-ci donnent l'intervalle d'envoi, partagé a parts egales entre les paquets perdus.
+Le premier perdu aurait dû arriver intervalle / (pertes + 1) apres le dernier reçu, son retard
+est ce qui depasse cette arrivée attendue. Un long silence avant une perte n'est donc pas compté
+comme du retard.
+
+Tout tourne dans la tache de transport (AppleMIDI.run()), il n'y a pas de verrou.
+Les compteurs (paquets perdus, evenements rejoués, evenements abandonnés) sont lisibles par stats().
+***********************************************************************************************************/
+
+#ifndef RTP_JOURNAL_H
+#define RTP_JOURNAL_H
+
+#include <Arduino.h>
+#include <WiFiUdp.h>
+#include "settings.h"
+
+struct RecoveryStats {
+  unsigned long lostPackets;     // paquets manquants d'apres les numeros de sequence
+  unsigned long recovered;       // evenements reconstruits depuis le journal et rejoués
+  unsigned long dropped;         // evenements reconstruits mais abandonnés (trop tard ou non recommandés)
+};
+
+class RtpJournal {
+public:
+  RtpJournal();
+  void reset(); // nouvelle session : oublie la sequence et l'etat reçu
+  void setHandler(void (*handler)(byte type, byte channel, byte data1, byte data2));// evenements rejoués
+  void feed(const byte *packet, unsigned int length, bool complete);// paquet du port de données
+
+  // etat reçu normalement, canal 1..16 comme les callbacks AppleMIDI
+  void noteOn(byte channel, byte note);
+  void noteOff(byte channel, byte note);
+  void controlChange(byte channel, byte control, byte value);
+
+  RecoveryStats stats() const;
+
+private:
+  void (*_handler)(byte type, byte channel, byte data1, byte data2);
+  bool _synced;                  // false tant qu'aucun paquet n'a été reçu
+  uint16_t _lastSeq;             // numero de sequence du dernier paquet reçu
+  uint32_t _extendedSeq;         // le meme, deroulé sur 32 bits (jamais 0)
+  uint32_t _lastTimestamp;       // timestamp RTP de ce paquet (RTP_CLOCK_RATE)
+  unsigned long _lastArrival;    // instant de reception de ce paquet (halMicros)
+  bool _late;                    // perte en cours : retard estimé au dela de WIFI_RECOVERY_LATENESS
+  volatile unsigned long _lostPackets;
+  volatile unsigned long _recovered;
+  volatile unsigned long _dropped;
+
+  byte _notesOn[16][16];         // bit par note : note on reçu sans note off depuis
+  uint32_t _noteOnSeq[16][128];  // sequence deroulée du paquet du dernier note on de chaque note (0 = aucun)
+  byte _ccValue[16][128];        // derniere valeur de chaque CC (0x80 = inconnue)
+  byte _ccCount[16][128];        // nombre de CC reçus (modulo 64), pour les CC codés en compteur
+
+  unsigned long lateness(unsigned long now, uint32_t timestamp, uint16_t gap) const;
+  void parseJournal(const byte *journal, unsigned int length);
+  void parseChannel(byte channel, const byte *chapters, unsigned int length, byte toc, uint32_t checkpoint);
+  void recoverControls(byte channel, const byte *chapter);
+  void recoverNotes(byte channel, const byte *chapter, unsigned int length, uint32_t checkpoint);
+  void replay(byte type, byte channel, byte data1, byte data2, bool recommended);
+
+  bool isNoteOn(byte channel, byte note) const;
+  void setNote(byte channel, byte note, bool on);
+};
+
+// WiFiUDP qui garde une copie des paquets du port de données pour RtpJournal
+class JournalUdp : public WiFiUDP {
+public:
+  static RtpJournal *journal;
+
+  uint8_t begin(uint16_t port);
+  int parsePacket();
+  int read();
+  int read(unsigned char *buffer, size_t length);
+  int read(char *buffer, size_t length);
+
+private:
+  bool _isDataPort = false;
+  byte _packet[RTP_PACKET_BUFFER_SIZE];
+  int _packetSize = 0;           // taille annoncée par parsePacket()
+  int _captured = 0;             // octets deja lus par la bibliotheque
+  void capture(const byte *data, int length);
+};
+
+#endif // RTP_JOURNAL_H
@@ -0,0 +1,294 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+---------------------------------------    SMFPLAYER.CPP    ---------------------------------------------
+_________________________________________________________________________________________________________
+Lecture de fichiers MIDI standard stockés sur LittleFS
+
+***********************************************************************************************************/
+
+#include "SmfPlayer.h"
+
+#define SMF_TEMPO_EVENT 0xFF
+
+static uint32_t readBigEndian(const byte *data, byte count) {
+  uint32_t value = 0;
+  for (byte i = 0; i < count; i++) {
+    value = (value << 8) | data[i];
+  }
+  return value;
+}
+
+// ----------------------------------      PUBLIC  --------------------------------------------
+
+SmfPlayer::SmfPlayer() : _trackCount(0), _playing(false) {
+}
+
+bool SmfPlayer::begin() {
+  if (!LittleFS.begin(false)) {
+    Serial.println("LittleFS non monté : lecture de fichiers MIDI indisponible");
+    return false;
+  }
+  return true;
+}
+
+bool SmfPlayer::play(const char *path, unsigned long now) {
+  stop();
+  _file = LittleFS.open(path, "r");
+  if (!_file || !readHeader()) {
+    Serial.print("Fichier MIDI illisible: ");
+    Serial.println(path);
+    stop();
+    return false;
+  }
+
+  _startTime = now;
+  _tempo = _smpte ? 1000000 : 500000; // SMPTE : _division en ticks par seconde, sinon 120 bpm par defaut
+  _tempoTick = 0;
+  _tempoTime = 0;
+  _queue.clear();
+  for (byte i = 0; i < _trackCount; i++) {
+    readEvent(i);
+  }
+  _playing = !_queue.empty();
+  if (!_playing) {
+    stop();
+  }
+  return _playing;
+}
+
+void SmfPlayer::stop() {
+  _playing = false;
+  _queue.clear();
+  if (_file) {
+    _file.close();
+  }
+}
+
+bool SmfPlayer::nextTime(unsigned long &time) const {
+  if (!_playing) {
+    return false;
+  }
+  time = timeOf(_queue.topTime());
+  return true;
+}
+
+bool SmfPlayer::next(unsigned long now, MidiEvent &event) {
+  while (_playing) {
+    byte index = _queue.topSlot();
+    Track &track = _tracks[index];
+    unsigned long time = timeOf(track.tick);
+    if ((long)(now - time) < 0) {
+      return false;
+    }
+    _queue.pop();
+
+    bool found = false;
+    if (track.status == SMF_TEMPO_EVENT) {
+      if (!_smpte) {
+        _tempoTime = time - _startTime;
+        _tempoTick = track.tick;
+        _tempo = track.tempo;
+      }
+    } else {
+      byte channel = track.status & 0x0F;
+      if (ALL_CHANNEL || channel + 1 == CHANNEL_XYLO) {
+        event.type = track.status & 0xF0;
+        event.data1 = track.data1;
+        event.data2 = track.data2;
+        event.time = time;
+        found = true;
+      }
+    }
+
+    readEvent(index);
+    if (_queue.empty()) {
+      stop(); // toutes les pistes sont terminées
+    }
+    if (found) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// ----------------------------------      PRIVATE  --------------------------------------------
+
+//*********************************************************************************************
+//******************          FILE HEADER AND TRACK CHUNKS
+
+// MThd : format, nombre de pistes, division ; puis repere le debut et la fin de chaque MTrk
+bool SmfPlayer::readHeader() {
+  byte header[14];
+  if (_file.read(header, 14) != 14 || memcmp(header, "MThd", 4) != 0) {
+    return false;
+  }
+  uint32_t offset = 8 + readBigEndian(header + 4, 4);
+  uint16_t division = readBigEndian(header + 12, 2);
+  if (division & 0x8000) {
+    // SMPTE : -images par seconde et ticks par image, tempo fixe
+    _smpte = true;
+    _division = (unsigned long)(-(int8_t)(division >> 8)) * (division & 0xFF);
+  } else {
+    _smpte = false;
+    _division = division;
+  }
+  if (_division == 0) {
+    return false;
+  }
+
+  _trackCount = 0;
+  uint32_t size = _file.size();
+  while (offset + 8 <= size && _trackCount < SMF_MAX_TRACKS) {
+    byte chunk[8];
+    _file.seek(offset);
+    if (_file.read(chunk, 8) != 8) {
+      break;
+    }
+    uint32_t length = readBigEndian(chunk + 4, 4);
+    if (memcmp(chunk, "MTrk", 4) == 0) {
+      Track &track = _tracks[_trackCount++];
+      track.next = offset + 8;
+      track.end = min(offset + 8 + length, size);
+      track.position = 0;
+      track.length = 0;
+      track.runningStatus = 0;
+      track.tick = 0;
+    }
+    offset += 8 + length;    // les chunks inconnus sont ignorés
+  }
+  return _trackCount > 0;
+}
+
+//*********************************************************************************************
+//******************          READ-AHEAD WINDOW
+
+bool SmfPlayer::readByte(Track &track, byte &value) {
+  if (track.position == track.length) {
+    if (track.next >= track.end) {
+      return false;
+    }
+    byte count = min((uint32_t)SMF_READ_AHEAD, track.end - track.next);
+    _file.seek(track.next);
+    if (_file.read(track.window, count) != count) {
+      return false;
+    }
+    track.next += count;
+    track.position = 0;
+    track.length = count;
+  }
+  value = track.window[track.position++];
+  return true;
+}
+
+bool SmfPlayer::readVarLen(Track &track, unsigned long &value) {
+  value = 0;
+  for (byte i = 0; i < 4; i++) {
+    byte data;
+    if (!readByte(track, data)) {
+      return false;
+    }
+    value = (value << 7) | (data & 0x7F);
+    if (!(data & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// saute count octets sans les lire : au dela de la fenetre on avance seulement la position dans le fichier
+bool SmfPlayer::skip(Track &track, unsigned long count) {
+  byte available = track.length - track.position;
+  if (count <= available) {
+    track.position += count;
+    return true;
+  }
+  track.position = track.length;
+  track.next += count - available;
+  return track.next <= track.end;
+}
+
+//*********************************************************************************************
+//******************          TRACK EVENTS
+
+// decode jusqu'au prochain note on/off ou tempo de la piste ; false si la piste est terminée
+bool SmfPlayer::readEvent(byte index) {
+  Track &track = _tracks[index];
+  while (true) {
+    unsigned long delta;
+    byte status;
+    if (!readVarLen(track, delta) || !readByte(track, status)) {
+      return false;
+    }
+    track.tick += delta;
+
+    if (status == 0xFF) {
+      // meta evenement : type, longueur, données
+      byte type;
+      unsigned long length;
+      if (!readByte(track, type) || !readVarLen(track, length)) {
+        return false;
+      }
+      if (type == 0x2F) {
+        return false;        // fin de piste
+      }
+      if (type == 0x51 && length == 3) {
+        byte tempo[3];
+        for (byte i = 0; i < 3; i++) {
+          if (!readByte(track, tempo[i])) {
+            return false;
+          }
+        }
+        track.status = SMF_TEMPO_EVENT;
+        track.tempo = readBigEndian(tempo, 3);
+        _queue.push(index, track.tick);
+        return true;
+      }
+      if (!skip(track, length)) {
+        return false;
+      }
+      continue;
+    }
+    if (status == 0xF0 || status == 0xF7) {
+      // SysEx : longueur puis données, ignoré
+      unsigned long length;
+      if (!readVarLen(track, length) || !skip(track, length)) {
+        return false;
+      }
+      continue;
+    }
+
+    byte data1;
+    if (status & 0x80) {
+      track.runningStatus = status;
+      if (!readByte(track, data1)) {
+        return false;
+      }
+    } else {
+      if (track.runningStatus == 0) {
+        return false;        // fichier invalide
+      }
+      data1 = status;        // running status : l'octet lu est deja la premiere donnée
+      status = track.runningStatus;
+    }
+
+    byte type = status & 0xF0;
+    byte data2 = 0;
+    if (type != 0xC0 && type != 0xD0 && !readByte(track, data2)) {
+      return false;
+    }
+    if (type == 0x90 || type == 0x80) {
+      track.status = status;
+      track.data1 = data1;
+      track.data2 = data2;
+      _queue.push(index, track.tick);
+      return true;
+    }
+    // autres messages de canal : ignorés
+  }
+}
+
+// instant (halMicros) d'un tick, depuis le dernier changement de tempo
+unsigned long SmfPlayer::timeOf(unsigned long tick) const {
+  return _startTime + _tempoTime + (unsigned long)((uint64_t)(tick - _tempoTick) * _tempo / _division);
+}
@@ -0,0 +1,72 @@
+/***********************************************************************************************************
+---------------------------------------------------------------------------------------------------------
+------------------------    Ochestrion Project  : Xolophone/Glokenspiel      ----------------------------
+-----------------------------------------     TRACE.H     -----------------------------------------------
+_________________________________________________________________________________________________________
+Traces binaires des evenements, a la place des Serial.print dans le chemin des notes
+
+TRACE_ERROR(), TRACE_EVENT() et TRACE_DETAIL() rangent un enregistrement de 8 octets (identifiant,
+deux arguments, heure halMicros()) dans une file circulaire en RAM : quelques cycles, utilisable
+depuis l'interruption du timer. Un niveau au dessus de TRACE_LEVEL est supprimé a la compilation
+(ses arguments ne sont meme pas evalués) ; a 0, la file n'existe pas.
+
+traceDrain() envoie la file sur Serial quand rien ne presse (loop() au repos sur AVR, tache de
+transport sur ESP32), sans jamais attendre : seulement ce que le buffer d'emission accepte.
+Chaque enregistrement part en une trame de 10 octets : TRACE_SYNC, id, a, b (2 octets), heure
+(4 octets, poids faible d'abord), puis le ou exclusif des 8 octets. Les trames se melangent aux
+lignes texte (JSON de benchReport(), calibration...) : tools/trace_decode.py les separe et
+donne le nom de chaque identifiant en lisant l'enum ci dessous.
+Les enregistrements perdus quand la file est pleine sont signalés par un TRACE_LOST.
+***********************************************************************************************************/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <Arduino.h>
+#include "settings.h"
+
+#define TRACE_SYNC 0xA5
+#define TRACE_FRAME_SIZE 10
+
+// identifiants : tools/trace_decode.py lit les noms et les commentaires de cet enum
+enum TraceId : byte {
+  TRACE_LOST,          // a = 0, b = enregistrements perdus (file pleine)
+  TRACE_BOOT,          // a = 0 debut de Xylophone::begin(), 1 fin
+  TRACE_QUEUE_FULL,    // a = lame, b = 0 : file des frappes pleine, frappe immediate
+  TRACE_NOTE_ON,       // a = note, b = vélocité
+  TRACE_NOTE_OFF,      // a = note, b = 0
+  TRACE_STRIKE,        // a = lame, b = PWM
+  TRACE_RETRIGGER,     // a = lame, b = PWM : lame pas prete, refrappe gardée
+  TRACE_COOLING,       // a = lame, b = attente en ms : bobine trop chaude
+  TRACE_COIL_ON,       // a = lame, b = durée de frappe en dizaines de µs
+  TRACE_COIL_OFF,      // a = lame, b = retard de la coupure sur l'echeance en µs
+  TRACE_STAGGER,       // a = notes allumées, b = notes restantes : accord etalé
+  TRACE_COIL_HOLD,     // a = lame, b = PWM de maintien : fin de l'impulsion (DRIVE_PROFILE)
+};
+
+#if TRACE_LEVEL > 0
+void traceRecord(byte id, byte a, uint16_t b);
+void traceDrain();                            // envoie sur Serial ce qui tient dans le buffer d'emission
+#else
+inline void traceDrain() {}
+#endif
+
+#if TRACE_LEVEL >= 1
+#define TRACE_ERROR(id, a, b) traceRecord(id, a, b)
+#else
+#define TRACE_ERROR(id, a, b) ((void)0)
+#endif
+
+#if TRACE_LEVEL >= 2
+#define TRACE_EVENT(id, a, b) traceRecord(id, a, b)
+#else
+#define TRACE_EVENT(id, a, b) ((void)0)
+#endif
+
+#if TRACE_LEVEL >= 3
+#define TRACE_DETAIL(id, a, b) traceRecord(id, a, b)
+#else
+#define TRACE_DETAIL(id, a, b) ((void)0)
+#endif
+
+#endif // TRACE_H
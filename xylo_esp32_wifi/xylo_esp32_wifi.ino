@@ -10,7 +10,6 @@ IMPORTANT: Modifiez WIFI_SSID et WIFI_PASSWORD dans settings.h avant téléverse
 
 Bibliothèques requises:
 - Adafruit_MCP23X17
-- Ticker (ESP32)
 - AppleMIDI (https://github.com/lathoub/Arduino-AppleMIDI-Library)
 - WiFi (inclus avec ESP32)
 
@@ -39,6 +38,10 @@ void setup() {
   // Test optionnel - décommenter pour tester au démarrage
   // midiHandler.test(true);  // Joue la mélodie spécifiée dans INIT_MELODY
   // midiHandler.test(false); // Joue toutes les notes l'une après l'autre
+  // midiHandler.benchmark(); // Mesure latence/gigue (BENCHMARK_ENABLED dans settings.h), resultats JSON sur Serial
+
+  // Demarre les taches : transport MIDI sur le coeur 0, electroaimants sur le coeur 1
+  midiHandler.start();
 
   Serial.println("Système prêt - En attente de connexion AppleMIDI...");
   Serial.println("Utilisez une application compatible AppleMIDI pour vous connecter");
@@ -46,8 +49,6 @@ void setup() {
 
 void loop() {
   // Mise à jour pour la gestion des électroaimants et réception MIDI
-  midiHandler.update();
-
-  // Petite pause pour éviter de surcharger le CPU
-  delay(1);
+  // Tout tourne dans les taches demarrées par midiHandler.start() : la tache loop() n'est plus utile
+  vTaskDelete(NULL);
 }